@@ -2,6 +2,7 @@
 #import "u2f-host.h"
 #import "u2f_hid.h"
 #import "hidapi.h"
+#import <CommonCrypto/CommonDigest.h>
 
 typedef struct u2fdevice {
     struct u2fdevice *next;
@@ -10,6 +10,38 @@ import XCTest
 
 let U2FHID_PING: UInt8 = 0x81
 let U2FHID_INIT: UInt8 = 0x86
+let U2FHID_MSG: UInt8 = 0x83
+let U2FHID_LOCK: UInt8 = 0x84
+let U2FHID_ERROR: UInt8 = 0xbf
+let U2FHID_KEEPALIVE: UInt8 = 0xbb
+let U2FHID_CBOR: UInt8 = 0x90
+let U2FHID_VENDOR_FIRST: UInt8 = 0xc0
+let U2FHID_VENDOR_LAST: UInt8 = 0xff
+
+let CTAP2_OK: UInt8 = 0x00
+let CTAP2_ERR_CBOR_UNEXPECTED_TYPE: UInt8 = 0x11
+let CTAP2_ERR_INVALID_CBOR: UInt8 = 0x12
+let CTAP2_ERR_MISSING_PARAMETER: UInt8 = 0x14
+let CTAP2_ERR_UNSUPPORTED_ALGORITHM: UInt8 = 0x26
+let CTAP2_ERR_KEEPALIVE_CANCEL: UInt8 = 0x2d
+
+// Times the U2F handler below has been called.
+var u2fCalls = 0
+
+// Calls made by softu2f_call_after in the simulator, and how long they wait.
+var callsMade = 0
+var callDelay = 0.0
+
+// Times the worker handler below has been called.
+var workerCalls = 0
+
+// Key handles added to the simulated device before a run.
+var filterHandles: [[UInt8]] = []
+
+// Certificates set on the simulated device before a run, and whether each was
+// accepted.
+var setupCerts: [[UInt8]] = []
+var setupCertsSet: [Bool] = []
 
 class LibSoftU2FTests: XCTestCase {
     var ctx: OpaquePointer? = nil
@@ -111,7 +143,28 @@ class LibSoftU2FTests: XCTestCase {
         }
         
         XCTAssertEqual(req, [resp.nonce.0, resp.nonce.1, resp.nonce.2, resp.nonce.3, resp.nonce.4, resp.nonce.5, resp.nonce.6, resp.nonce.7])
-        XCTAssertEqual(resp.capFlags, UInt8(CAPFLAG_WINK))
+        XCTAssertEqual(resp.capFlags, UInt8(CAPFLAG_WINK | CAPFLAG_LOCK))
+    }
+    
+    func testInitPerformance() {
+        guard var dev = device else {
+            XCTFail("Error discovering softu2f device")
+            return
+        }
+        
+        dev.cid = CID_BROADCAST
+        
+        var req: [UInt8] = [0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88]
+        let reqLen = UInt16(req.count)
+        var respBytes = [UInt8](repeating: 0x00, count: 1024)
+        
+        measure {
+            for _ in 0..<100 {
+                var respLen = respBytes.count
+                let rc = u2fh_sendrecv(self.devs, dev.id, U2FHID_INIT, &req, reqLen, &respBytes, &respLen)
+                XCTAssertEqual(rc, U2FH_OK)
+            }
+        }
     }
     
     func testPing() {
@@ -136,6 +189,106 @@ class LibSoftU2FTests: XCTestCase {
         XCTAssertEqual(respBytes[0..<reqLen], req[0..<reqLen])
     }
     
+    func testLock() {
+        guard let dev = device else {
+            XCTFail("Error discovering softu2f device")
+            return
+        }
+        
+        // Take the lock and then release it.
+        for seconds: UInt8 in [1, 0] {
+            var req: [UInt8] = [seconds]
+            var respBytes = [UInt8](repeating: 0x00, count: 1024)
+            var respLen = respBytes.count
+            
+            let rc = u2fh_sendrecv(devs, dev.id, U2FHID_LOCK, &req, UInt16(req.count), &respBytes, &respLen)
+            
+            if rc != U2FH_OK {
+                XCTFail("Error calling u2fh_sendrecv")
+                return
+            }
+            
+            XCTAssertEqual(respLen, 0)
+        }
+    }
+    
+    func testRetryCache() {
+        guard let dev = device else {
+            XCTFail("Error discovering softu2f device")
+            return
+        }
+        
+        // Answers every U2F request with a fresh counter and SW_NO_ERROR.
+        softu2f_hid_msg_handler_register(ctx, U2FHID_MSG) { ctx, req in
+            u2fCalls += 1
+            
+            guard let resp = softu2f_hid_resp_start(ctx, req!.pointee.cid, U2FHID_MSG) else { return false }
+            var body: [UInt8] = [0x01, 0x00, 0x00, 0x00, UInt8(u2fCalls), 0x90, 0x00]
+            
+            guard softu2f_hid_resp_append(resp, &body, body.count) else {
+                softu2f_hid_resp_discard(ctx, resp)
+                return false
+            }
+            
+            return softu2f_hid_resp_send(ctx, resp)
+        }
+        softu2f_retry_window_set(ctx, 5)
+        
+        // The same signing AUTHENTICATE twice gets the same response, and the
+        // handler only sees it once.
+        var responses: [[UInt8]] = []
+        for p1: UInt8 in [0x03, 0x03, 0x07, 0x07] {
+            var req: [UInt8] = [0x00, 0x02, p1, 0x00, 0x03, 0x11, 0x22, 0x33]
+            var respBytes = [UInt8](repeating: 0x00, count: 1024)
+            var respLen = respBytes.count
+            
+            let rc = u2fh_sendrecv(devs, dev.id, U2FHID_MSG, &req, UInt16(req.count), &respBytes, &respLen)
+            
+            if rc != U2FH_OK {
+                XCTFail("Error calling u2fh_sendrecv")
+                return
+            }
+            
+            responses.append(Array(respBytes[0..<respLen]))
+        }
+        
+        XCTAssertEqual(responses[0], responses[1])
+        
+        // Check-only requests aren't cached.
+        XCTAssertNotEqual(responses[2], responses[3])
+        XCTAssertEqual(u2fCalls, 3)
+        
+        var stats = softu2f_stats()
+        softu2f_stats_get(ctx, &stats)
+        XCTAssertEqual(stats.retries_replayed, 1)
+    }
+    
+    func testUnsentResponse() {
+        guard let dev = device else {
+            XCTFail("Error discovering softu2f device")
+            return
+        }
+        
+        // Starts a response and forgets about it.
+        softu2f_hid_msg_handler_register(ctx, U2FHID_MSG) { ctx, req in
+            return softu2f_hid_resp_start(ctx, req!.pointee.cid, U2FHID_MSG) != nil
+        }
+        
+        var req: [UInt8] = [0x00, 0x03, 0x00, 0x00]
+        var respBytes = [UInt8](repeating: 0x00, count: 1024)
+        var respLen = respBytes.count
+        
+        // The client gets an error instead of waiting forever.
+        var rc = u2fh_sendrecv(devs, dev.id, U2FHID_MSG, &req, UInt16(req.count), &respBytes, &respLen)
+        XCTAssertNotEqual(rc, U2FH_OK)
+        
+        // And the builder is free for the next response.
+        respLen = respBytes.count
+        rc = u2fh_sendrecv(devs, dev.id, U2FHID_PING, &req, UInt16(req.count), &respBytes, &respLen)
+        XCTAssertEqual(rc, U2FH_OK)
+        XCTAssertEqual(respLen, req.count)
+    }
+    
     func testFragmentation() {
         guard let dev = device else {
             XCTFail("Error discovering softu2f device")
@@ -193,3 +346,1401 @@ class LibSoftU2FTests: XCTestCase {
         
     }
 }
+
+// Doesn't need the driver.
+class SHA256BatchTests: XCTestCase {
+    // Signed data of a REGISTER with a 64 byte key handle, hashed as it would be for a batch of requests.
+    let message = [UInt8](repeating: 0xAB, count: 1 + 32 + 32 + 64 + 65)
+    let count = 64
+
+    func hashBatch(_ digests: inout [UInt8]) {
+        message.withUnsafeBytes { msg in
+            digests.withUnsafeMutableBufferPointer { out in
+                var jobs = (0..<count).map { i in
+                    softu2f_sha256_job(data: msg.baseAddress, len: msg.count - i % 3, digest: out.baseAddress! + i * 32)
+                }
+                softu2f_sha256_batch(&jobs, jobs.count)
+            }
+        }
+    }
+
+    func hashOneByOne(_ digests: inout [UInt8]) {
+        message.withUnsafeBytes { msg in
+            digests.withUnsafeMutableBufferPointer { out in
+                for i in 0..<count {
+                    _ = CC_SHA256(msg.baseAddress, CC_LONG(msg.count - i % 3), out.baseAddress! + i * 32)
+                }
+            }
+        }
+    }
+
+    func testBatch() {
+        var batch = [UInt8](repeating: 0x00, count: count * 32)
+        var expected = [UInt8](repeating: 0x00, count: count * 32)
+
+        hashBatch(&batch)
+        hashOneByOne(&expected)
+
+        XCTAssertEqual(batch, expected)
+    }
+
+    func testBatchPerformance() {
+        var digests = [UInt8](repeating: 0x00, count: count * 32)
+
+        measure {
+            for _ in 0..<1000 {
+                self.hashBatch(&digests)
+            }
+        }
+    }
+
+    func testOneByOnePerformance() {
+        var digests = [UInt8](repeating: 0x00, count: count * 32)
+
+        measure {
+            for _ in 0..<1000 {
+                self.hashOneByOne(&digests)
+            }
+        }
+    }
+}
+
+class SimulatorTests: XCTestCase {
+    // Four clients PINGing twice a second each for a simulated minute.
+    func pingConfig() -> softu2f_sim_config {
+        var config = softu2f_sim_config()
+        config.clients = 4
+        config.arrival_rate = 2
+        config.latency = 0.002
+        config.frame_interval = 0.001
+        config.service_time = 0.01
+        config.cmd = UInt8(U2FHID_PING)
+        config.bcnt = 32
+        config.duration = 60
+        config.seed = 1
+        return config
+    }
+
+    func testSingleFrameRequests() {
+        var config = pingConfig()
+        var result = softu2f_sim_result()
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+
+        XCTAssertGreaterThan(result.requests, 0)
+        XCTAssertEqual(result.responses, result.requests)
+        XCTAssertEqual(result.errors, 0)
+
+        // Each request crosses the transport twice and waits for the handler.
+        XCTAssertGreaterThanOrEqual(result.latency_mean, 2 * config.latency + config.service_time)
+    }
+
+    func testReassemblyTimeout() {
+        var config = pingConfig()
+        var result = softu2f_sim_result()
+
+        // CONT frames come later than the 0.5 second reassembly timeout.
+        config.clients = 1
+        config.bcnt = 100
+        config.frame_interval = 0.6
+        config.duration = 10
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertGreaterThan(result.stats.timeouts, 0)
+    }
+
+    func testSameSeedSameRun() {
+        var config = pingConfig()
+        var first = softu2f_sim_result()
+        var second = softu2f_sim_result()
+
+        config.bcnt = 1024
+
+        XCTAssert(softu2f_sim_run(&config, &first))
+        XCTAssert(softu2f_sim_run(&config, &second))
+
+        XCTAssertEqual(first.responses, second.responses)
+        XCTAssertEqual(first.errors, second.errors)
+        XCTAssertEqual(first.latency_max, second.latency_max)
+    }
+
+    func testControlRepliesOvertakeBulk() {
+        var config = pingConfig()
+        var result = softu2f_sim_result()
+
+        // One client sends the largest PINGs while the others send INITs.
+        config.clients = 3
+        config.cmd = U2FHID_INIT
+        config.bcnt = 8
+        config.default_handler = true
+        config.bulk_clients = 1
+        config.bulk_cmd = U2FHID_PING
+        config.bulk_bcnt = 7609
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertEqual(result.errors, 0)
+        XCTAssertEqual(result.stats.out_overflows, 0)
+
+        // A PING echo takes 129 frames. An INIT reply shouldn't wait for one.
+        XCTAssertLessThan(result.small_latency_max, 0.02)
+        XCTAssertGreaterThan(result.latency_max, 0.129)
+    }
+
+    // Defers U2F requests and answers them from a call made callDelay later,
+    // as a coroutine that awaits sleep_for is suspended and resumed.
+    func callAfterConfig(_ delay: Double) -> softu2f_sim_config {
+        var config = pingConfig()
+
+        config.clients = 2
+        config.cmd = U2FHID_MSG
+        config.bcnt = 8
+        config.duration = 10
+        config.default_handler = true
+
+        callsMade = 0
+        callDelay = delay
+        config.setup = { ctx, _ in
+            softu2f_deadline_set(ctx, 0)
+            softu2f_hid_msg_async_handler_register(ctx, U2FHID_MSG, { ctx, pending, _, _ in
+                XCTAssert(softu2f_call_after(ctx, callDelay, { _, info in
+                    callsMade += 1
+                    softu2f_hid_pending_complete(OpaquePointer(info), CFDataCreate(nil, nil, 0))
+                }, UnsafeMutableRawPointer(pending)))
+            }, nil)
+        }
+
+        return config
+    }
+
+    func testDeferredHandler() {
+        var config = pingConfig()
+        var result = softu2f_sim_result()
+
+        config.cmd = U2FHID_MSG
+        config.bcnt = 8
+        config.deferred = true
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+
+        // Answered once the handler gets round to it, and nothing is left
+        // behind.
+        XCTAssertEqual(result.responses, result.requests)
+        XCTAssertEqual(result.errors, 0)
+        XCTAssertGreaterThanOrEqual(result.latency_mean, config.service_time)
+        XCTAssertEqual(result.frees, result.allocations)
+    }
+
+    func testResumeLater() {
+        var config = callAfterConfig(0.25)
+        var result = softu2f_sim_result()
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+
+        // Every request is suspended and resumed on the simulated clock.
+        XCTAssertEqual(Int(result.requests), callsMade)
+        XCTAssertEqual(result.responses, result.requests)
+        XCTAssertEqual(result.errors, 0)
+        XCTAssertGreaterThanOrEqual(result.latency_mean, 0.25)
+        XCTAssertEqual(result.frees, result.allocations)
+    }
+
+    func testTeardownWhilePending() {
+        var config = callAfterConfig(1000)
+        var result = softu2f_sim_result()
+
+        // The device goes away long before the calls are due.
+        config.stop = 5
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertGreaterThan(result.requests, 0)
+        XCTAssertEqual(result.responses, 0)
+
+        // Calls still waiting are made as the device is deinitialized, one for
+        // each client's request, and their requests are freed.
+        XCTAssertEqual(callsMade, Int(config.clients))
+        XCTAssertEqual(result.frees, result.allocations)
+    }
+
+    func testLock() {
+        // Each request's data starts with 1, so a LOCK takes the lock for a
+        // second.
+        let data: [UInt8] = [1] + [UInt8](repeating: 0x00, count: 31)
+        var config = pingConfig()
+        var result = softu2f_sim_result()
+
+        config.bulk_clients = 1
+        config.bulk_cmd = U2FHID_LOCK
+        config.bulk_bcnt = 1
+        config.bulk_requests = 1
+        config.default_handler = true
+
+        data.withUnsafeBufferPointer { data in
+            config.data = data.baseAddress
+            XCTAssert(softu2f_sim_run(&config, &result))
+        }
+
+        // The other channels get ERR_CHANNEL_BUSY while the lock is held, and
+        // nothing else goes wrong.
+        XCTAssertEqual(result.responses, result.requests)
+        XCTAssertGreaterThan(result.stats.locked_out, 0)
+        XCTAssertEqual(result.errors, result.stats.locked_out)
+
+        // The lock runs out after a second of the minute.
+        XCTAssertLessThan(result.errors, result.responses / 10)
+
+        // Unlike a lock that is taken again and again.
+        config.bulk_requests = 0
+        var locked = softu2f_sim_result()
+
+        data.withUnsafeBufferPointer { data in
+            config.data = data.baseAddress
+            XCTAssert(softu2f_sim_run(&config, &locked))
+        }
+
+        XCTAssertGreaterThan(locked.errors, locked.responses / 2)
+    }
+
+    func testDeadline() {
+        var config = pingConfig()
+        var result = softu2f_sim_result()
+        var deadline = 0.5
+
+        // Two clients whose requests wait a second for a touch that never
+        // comes in time.
+        config.clients = 2
+        config.arrival_rate = 0.5
+        config.service_time = 1
+        config.cmd = U2FHID_MSG
+        config.bcnt = 8
+        config.deferred = true
+        config.setup = { ctx, info in
+            softu2f_deadline_set(ctx, info!.load(as: Double.self))
+        }
+
+        withUnsafeMutablePointer(to: &deadline) { deadline in
+            config.info = UnsafeMutableRawPointer(deadline)
+            XCTAssert(softu2f_sim_run(&config, &result))
+        }
+
+        // Every request is abandoned with ERR_MSG_TIMEOUT.
+        XCTAssertGreaterThan(result.requests, 0)
+        XCTAssertEqual(result.responses, result.requests)
+        XCTAssertEqual(result.errors, result.responses)
+        XCTAssertEqual(result.reply_cmd, U2FHID_ERROR)
+        XCTAssertEqual(result.reply.0, 0x05)
+
+        // And frees its channel, so the next one isn't turned away as busy.
+        XCTAssertEqual(result.stats.stalls, result.stats.errors_sent)
+
+        // With time to spare, they're all answered.
+        deadline = 2
+        withUnsafeMutablePointer(to: &deadline) { deadline in
+            config.info = UnsafeMutableRawPointer(deadline)
+            XCTAssert(softu2f_sim_run(&config, &result))
+        }
+
+        XCTAssertEqual(result.errors, 0)
+        XCTAssertEqual(result.stats.stalls, 0)
+    }
+
+    // One request, deferred at the moment the simulated clock starts.
+    func waitingConfig(_ cmd: UInt8) -> softu2f_sim_config {
+        var config = pingConfig()
+
+        config.clients = 1
+        config.arrival_rate = .infinity
+        config.bulk_clients = 1
+        config.bulk_cmd = cmd
+        config.bulk_bcnt = 8
+        config.bulk_requests = 1
+        config.cmd = cmd
+        config.service_time = 1
+        config.deferred = true
+
+        return config
+    }
+
+    func testKeepAlive() {
+        var config = waitingConfig(U2FHID_MSG)
+        var result = softu2f_sim_result()
+
+        // A KEEPALIVE every 0.1 seconds of simulated time, however long the
+        // request waits.
+        for service in [0.5, 1, 2] {
+            config.service_time = service
+            XCTAssert(softu2f_sim_run(&config, &result))
+            XCTAssertEqual(result.responses, 1)
+            XCTAssertEqual(Double(result.keepalives), service / 0.1, accuracy: 1)
+        }
+    }
+
+    func testCancel() {
+        var config = waitingConfig(U2FHID_MSG)
+        var result = softu2f_sim_result()
+
+        // A cancelled U2F request is dropped, and its KEEPALIVEs stop.
+        config.cancel_after = 0.35
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertEqual(result.requests, 1)
+        XCTAssertEqual(result.responses, 0)
+        XCTAssertEqual(result.keepalives, 2)
+        XCTAssertEqual(result.frees, result.allocations)
+
+        // A cancelled CTAP2 request is answered at once.
+        config = waitingConfig(U2FHID_CBOR)
+        config.cancel_after = 0.35
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertEqual(result.responses, 1)
+        XCTAssertEqual(result.keepalives, 2)
+        XCTAssertEqual(result.reply_cmd, U2FHID_CBOR)
+        XCTAssertEqual(result.reply_bcnt, 1)
+        XCTAssertEqual(result.reply.0, CTAP2_ERR_KEEPALIVE_CANCEL)
+        XCTAssertLessThan(result.latency_max, 0.5)
+    }
+
+    func testReportSizes() {
+        let data = (0..<20000).map { UInt8(truncatingIfNeeded: $0 * 7 + 3) }
+        var config = waitingConfig(U2FHID_PING)
+        var result = softu2f_sim_result()
+
+        config.deferred = false
+        config.default_handler = true
+
+        func run(_ size: UInt16, _ bcnt: UInt16) -> Bool {
+            config.rpt_size = size
+            config.bcnt = bcnt
+            config.bulk_bcnt = bcnt
+            return data.withUnsafeBufferPointer { data in
+                config.data = data.baseAddress
+                return softu2f_sim_run(&config, &result)
+            }
+        }
+
+        for size in [64, 128, 256, 512, 1024] {
+            // The longest message 64 byte reports can carry is echoed whole,
+            // in fewer frames the larger they are.
+            XCTAssert(run(UInt16(size), 7609))
+            XCTAssertEqual(result.errors, 0)
+            XCTAssertEqual(result.reply_cmd, U2FHID_PING)
+            XCTAssertEqual(result.reply_bcnt, 7609)
+            XCTAssertEqual(withUnsafeBytes(of: result.reply) { Array($0) }, Array(data[0..<256]))
+
+            let frames = 1 + (7609 - (size - 7) + size - 6) / (size - 5)
+            XCTAssertEqual(Int(result.transport_calls), 2 * frames)
+
+            // Longer messages need reports of 256 bytes or more to fit in 128
+            // CONT frames.
+            XCTAssert(run(UInt16(size), 20000))
+            XCTAssertEqual(result.responses, 1)
+            if size < 256 {
+                XCTAssertEqual(result.reply_cmd, U2FHID_ERROR)
+                XCTAssertEqual(result.reply.0, UInt8(ERR_INVALID_LEN))
+            } else {
+                XCTAssertEqual(result.reply_cmd, U2FHID_PING)
+                XCTAssertEqual(result.reply_bcnt, 20000)
+            }
+        }
+
+        // Sizes the driver doesn't support.
+        XCTAssertFalse(run(100, 8))
+        XCTAssertFalse(run(2048, 8))
+    }
+
+    func testDevices() {
+        var config = pingConfig()
+        var shared = softu2f_sim_result()
+        var detached = softu2f_sim_result()
+
+        // Two clients, each using its own device on one engine.
+        config.clients = 2
+        config.bcnt = 100
+        config.duration = 10
+        config.devices = 2
+        XCTAssert(softu2f_sim_run(&config, &shared))
+        XCTAssertEqual(shared.responses, shared.requests)
+        XCTAssertGreaterThan(shared.stats.messages_handled, 0)
+        XCTAssertLessThan(shared.stats.messages_handled, shared.requests)
+
+        // The first device goes away halfway through. Its client's requests go
+        // unanswered from then on, while the other device keeps serving its
+        // own client as before.
+        config.detach = 5
+        XCTAssert(softu2f_sim_run(&config, &detached))
+        XCTAssertEqual(detached.requests, shared.requests)
+        XCTAssertLessThan(detached.responses, detached.requests)
+        XCTAssertGreaterThan(detached.responses, detached.stats.messages_handled)
+        XCTAssertEqual(detached.stats.messages_handled, shared.stats.messages_handled)
+        XCTAssertEqual(detached.errors, 0)
+        XCTAssertEqual(detached.frees, detached.allocations)
+
+        // Requests deferred on the device that went away are dropped, and
+        // freed when they're answered.
+        config.cmd = U2FHID_MSG
+        config.bcnt = 8
+        config.deferred = true
+        config.service_time = 1
+        XCTAssert(softu2f_sim_run(&config, &detached))
+        XCTAssertLessThan(detached.responses, detached.requests)
+        XCTAssertEqual(detached.frees, detached.allocations)
+    }
+
+    func testStatsCommand() {
+        var config = pingConfig()
+        var result = softu2f_sim_result()
+
+        config.clients = 1
+        config.cmd = U2FHID_VENDOR_FIRST
+        config.bcnt = 0
+        config.default_handler = true
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertEqual(result.errors, 0)
+
+        // A version byte, a count byte and that many big-endian counters.
+        let count = MemoryLayout<softu2f_stats>.size / 8
+        let reply = withUnsafeBytes(of: result.reply) { Array($0) }
+        XCTAssertEqual(result.reply_cmd, U2FHID_VENDOR_FIRST)
+        XCTAssertEqual(Int(result.reply_bcnt), 2 + 8 * count)
+        XCTAssertEqual(reply[0], 1)
+        XCTAssertEqual(Int(reply[1]), count)
+
+        func counter(_ field: PartialKeyPath<softu2f_stats>) -> UInt64 {
+            let i = 2 + MemoryLayout<softu2f_stats>.offset(of: field)!
+            return reply[i..<i + 8].reduce(0) { $0 << 8 | UInt64($1) }
+        }
+
+        // Counters as they were when the last reply was made, before it was
+        // copied into its frames and sent.
+        XCTAssertEqual(counter(\softu2f_stats.frames_received), result.requests)
+        XCTAssertEqual(counter(\softu2f_stats.messages_handled), result.responses)
+        XCTAssertEqual(counter(\softu2f_stats.frames_sent), result.stats.frames_sent - 3)
+        XCTAssertEqual(counter(\softu2f_stats.bytes_copied), result.stats.bytes_copied - UInt64(result.reply_bcnt))
+        XCTAssertEqual(counter(\softu2f_stats.scratch_refused), 0)
+    }
+
+    func testScratchIsBounded() {
+        var config = pingConfig()
+        var plain = softu2f_sim_result()
+        var result = softu2f_sim_result()
+
+        XCTAssert(softu2f_sim_run(&config, &plain))
+
+        // Handler temporaries come from scratch memory, which is allocated
+        // once for the device, not once per request.
+        config.scratch = 1000
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertEqual(result.errors, 0)
+        XCTAssertEqual(result.allocations, plain.allocations + 1)
+        XCTAssertEqual(result.alloc_bytes, plain.alloc_bytes + UInt64(SOFTU2F_SCRATCH_SIZE))
+        XCTAssertGreaterThanOrEqual(result.stats.scratch_max, 1000)
+
+        // Asking for more than a request gets is refused.
+        config.scratch = Int(SOFTU2F_SCRATCH_SIZE) + 1
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertEqual(result.errors, result.responses)
+        XCTAssertEqual(result.stats.scratch_refused, result.requests)
+    }
+}
+
+class AllocationTests: XCTestCase {
+    // One client sending a request every 100ms or so for a simulated 10 seconds.
+    func run(_ cmd: UInt8, _ bcnt: UInt16, defaultHandler: Bool = true, limits: softu2f_limits = softu2f_limits()) -> softu2f_sim_result {
+        var config = softu2f_sim_config()
+        var result = softu2f_sim_result()
+
+        config.clients = limits.cid_rate > 0 ? 4 : 1
+        config.arrival_rate = 10
+        config.latency = 0.001
+        config.frame_interval = 0.001
+        config.cmd = cmd
+        config.bcnt = bcnt
+        config.duration = 10
+        config.default_handler = defaultHandler
+        config.limits = limits
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertGreaterThan(result.responses, 0)
+
+        return result
+    }
+
+    func testRejectionsDontAllocate() {
+        var limits = softu2f_limits()
+        limits.cid_rate = 1
+        limits.cid_burst = 1
+
+        let result = run(U2FHID_PING, 8, limits: limits)
+
+        // Neither rejected nor admitted PINGs allocate. The outbound frames
+        // are allocated once.
+        XCTAssertGreaterThan(result.stats.rate_limited, 0)
+        XCTAssertEqual(result.allocations, 1)
+    }
+
+    func testSingleFrameBudget() {
+        for result in [run(U2FHID_INIT, 8), run(U2FHID_PING, 8), run(U2FHID_VENDOR_LAST, 8)] {
+            // Nothing per message. The outbound frames are allocated once.
+            XCTAssertGreaterThan(result.responses, 1)
+            XCTAssertEqual(result.allocations, 1)
+        }
+    }
+
+    func testMultiFrameBudget() {
+        for result in [run(U2FHID_PING, 1024), run(U2FHID_MSG, 64, defaultHandler: false)] {
+            // The read buffer and its copy, plus the first message from the pool
+            // and the outbound frames.
+            XCTAssertLessThanOrEqual(result.allocations, 4 * result.responses + 2)
+        }
+    }
+
+    func testReport() {
+        // Per request: allocations at most, bytes copied and transport calls.
+        // Longer requests are copied as they're reassembled, again when
+        // they're handled and once more into the response, and take a frame
+        // each way per 57 or 59 bytes.
+        let cases: [(UInt8, UInt16, Bool, UInt64, UInt64, UInt64)] = [
+            (U2FHID_INIT, 8, true, 0, 17, 2),
+            (U2FHID_PING, 8, true, 0, 8, 2),
+            (U2FHID_PING, 64, true, 4, 3 * 64, 4),
+            (U2FHID_PING, 1024, true, 4, 3 * 1024, 36),
+            (U2FHID_PING, 7609, true, 4, 3 * 7609, 258),
+            (U2FHID_MSG, 64, false, 4, 3 * 64, 4),
+        ]
+
+        for (cmd, bcnt, defaultHandler, allocations, copied, calls) in cases {
+            let result = run(cmd, bcnt, defaultHandler: defaultHandler)
+
+            // Besides the first message from the pool and the outbound frames.
+            XCTAssertLessThanOrEqual(result.allocations, allocations * result.responses + 2)
+            XCTAssertEqual(result.stats.bytes_copied, copied * result.responses)
+            XCTAssertEqual(result.transport_calls, calls * result.responses)
+        }
+    }
+}
+
+// Doesn't need the driver.
+class KeyFilterTests: XCTestCase {
+    let appId = [UInt8](repeating: 0xA1, count: 32)
+    let keyHandle = [UInt8](repeating: 0x4B, count: 32)
+
+    // One client probing for keyHandle with check-only AUTHENTICATEs for a
+    // simulated minute.
+    func probe(_ handles: [[UInt8]]) -> softu2f_sim_result {
+        let apdu: [UInt8] = [0x00, 0x02, 0x07, 0x00, 97] + [UInt8](repeating: 0x00, count: 32) + appId + [32] + keyHandle
+        var config = softu2f_sim_config()
+        var result = softu2f_sim_result()
+
+        config.clients = 1
+        config.arrival_rate = 2
+        config.latency = 0.002
+        config.frame_interval = 0.001
+        config.service_time = 0.01
+        config.cmd = U2FHID_MSG
+        config.bcnt = UInt16(apdu.count)
+        config.duration = 60
+        config.seed = 1
+
+        filterHandles = handles
+        config.setup = { ctx, _ in
+            let appId = [UInt8](repeating: 0xA1, count: 32)
+            for handle in filterHandles {
+                XCTAssert(softu2f_key_handle_add(ctx, appId, handle, UInt8(handle.count)))
+            }
+        }
+
+        apdu.withUnsafeBufferPointer { data in
+            config.data = data.baseAddress
+            XCTAssert(softu2f_sim_run(&config, &result))
+        }
+
+        XCTAssertGreaterThan(result.responses, 0)
+        XCTAssertEqual(result.errors, 0)
+
+        return result
+    }
+
+    func testEmptyFilter() {
+        // Nothing added, so nothing is turned away.
+        XCTAssertEqual(probe([]).stats.probes_rejected, 0)
+    }
+
+    func testMember() {
+        let others = (0..<100).map { i in [UInt8](repeating: 0x80 + UInt8(i), count: 32) }
+
+        // An added key handle always reaches the handler.
+        XCTAssertEqual(probe([keyHandle]).stats.probes_rejected, 0)
+        XCTAssertEqual(probe(others + [keyHandle]).stats.probes_rejected, 0)
+    }
+
+    func testMiss() {
+        let others = (0..<100).map { i in [UInt8](repeating: 0x80 + UInt8(i), count: 32) }
+        let result = probe(others)
+
+        // This one isn't in the filter, so every probe for it is answered there.
+        XCTAssertEqual(result.stats.probes_rejected, result.responses)
+    }
+}
+
+// Doesn't need the driver.
+class AttestationCertTests: XCTestCase {
+    // A SEQUENCE of a 128 byte TBSCertificate, an AlgorithmIdentifier and a
+    // signature BIT STRING.
+    let cert: [UInt8] = [0x30, 0x81, 0x8C, 0x30, 0x81, 0x80] + [UInt8](repeating: 0x02, count: 128) +
+        [0x30, 0x03, 0x06, 0x01, 0x00, 0x03, 0x02, 0x00, 0x00]
+
+    // Set each certificate on a simulated device with no clients.
+    func set(_ certs: [[UInt8]]) -> [Bool] {
+        var config = softu2f_sim_config()
+        var result = softu2f_sim_result()
+
+        config.duration = 1
+
+        setupCerts = certs
+        setupCertsSet = []
+        config.setup = { ctx, _ in
+            for cert in setupCerts {
+                setupCertsSet.append(softu2f_attestation_cert_set(ctx, cert, cert.count))
+            }
+        }
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertEqual(result.requests, 0)
+
+        return setupCertsSet
+    }
+
+    func testValid() {
+        XCTAssertEqual(set([cert]), [true])
+    }
+
+    func testTruncated() {
+        XCTAssertEqual(set([Array(cert.dropLast()), Array(cert.prefix(1)), []]), [false, false, false])
+    }
+
+    func testWrongTag() {
+        // A SET instead of the outer SEQUENCE, and an OCTET STRING instead of
+        // the BIT STRING.
+        var outer = cert
+        outer[0] = 0x31
+
+        var signature = cert
+        signature[cert.count - 4] = 0x04
+
+        XCTAssertEqual(set([outer, signature]), [false, false])
+    }
+
+    func testTrailingBytes() {
+        XCTAssertEqual(set([cert + [0x00]]), [false])
+    }
+
+    func testNonMinimalLength() {
+        // 14 bytes fits in the short form.
+        let long: [UInt8] = [0x30, 0x81, 0x0E, 0x30, 0x03, 0x02, 0x01, 0x01, 0x30, 0x03, 0x06, 0x01, 0x00, 0x03, 0x02, 0x00, 0x00]
+        var short = long
+        short.remove(at: 1)
+
+        XCTAssertEqual(set([long, short]), [false, true])
+    }
+}
+
+// Doesn't need the driver.
+class AdmissionTests: XCTestCase {
+    // Clients PINGing ten times a second each on the simulated clock.
+    func run(_ clients: UInt32, _ limits: softu2f_limits, duration: Double = 10) -> softu2f_sim_result {
+        var config = softu2f_sim_config()
+        var result = softu2f_sim_result()
+
+        config.clients = clients
+        config.arrival_rate = 10
+        config.latency = 0.001
+        config.frame_interval = 0.001
+        config.cmd = U2FHID_PING
+        config.bcnt = 8
+        config.duration = duration
+        config.seed = 1
+        config.default_handler = true
+        config.limits = limits
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertEqual(result.responses, result.requests)
+
+        // Everything turned away is answered with an error.
+        XCTAssertEqual(result.errors, result.stats.rate_limited)
+
+        return result
+    }
+
+    func testBurst() {
+        var limits = softu2f_limits()
+        limits.cid_rate = 0.001
+        limits.cid_burst = 3
+
+        // Next to no refill, so only the burst gets in.
+        let result = run(1, limits)
+        XCTAssertGreaterThan(result.requests, 3)
+        XCTAssertEqual(result.responses - result.errors, 3)
+    }
+
+    func testBurstAtStart() {
+        var config = softu2f_sim_config()
+        var result = softu2f_sim_result()
+
+        // Ten PINGs, all arriving the moment the simulated clock starts at 0.
+        config.clients = 1
+        config.arrival_rate = .infinity
+        config.bulk_clients = 1
+        config.bulk_cmd = U2FHID_PING
+        config.bulk_bcnt = 8
+        config.bulk_requests = 10
+        config.duration = 10
+        config.seed = 1
+        config.default_handler = true
+        config.limits.cid_rate = 0.001
+        config.limits.cid_burst = 3
+
+        XCTAssert(softu2f_sim_run(&config, &result))
+        XCTAssertEqual(result.requests, 10)
+        XCTAssertEqual(result.responses, result.requests)
+
+        // The burst is no bigger for starting at 0.
+        XCTAssertEqual(result.responses - result.errors, 3)
+        XCTAssertEqual(result.errors, result.stats.rate_limited)
+    }
+
+    func testRefill() {
+        var limits = softu2f_limits()
+        limits.cid_rate = 1
+        limits.cid_burst = 1
+
+        // About one a second gets in, never more.
+        let result = run(1, limits, duration: 60)
+        let admitted = result.responses - result.errors
+        XCTAssertGreaterThan(result.stats.rate_limited, 0)
+        XCTAssertLessThanOrEqual(admitted, 1 + 60)
+        XCTAssertGreaterThanOrEqual(admitted, 50)
+    }
+
+    func testChannelsAreIsolated() {
+        var limits = softu2f_limits()
+        limits.cid_rate = 0.001
+        limits.cid_burst = 3
+
+        // Each channel gets its own burst, however busy the others are.
+        let result = run(4, limits)
+        XCTAssertEqual(result.responses - result.errors, 4 * 3)
+
+        // Unlike the global limit, which they share.
+        limits = softu2f_limits()
+        limits.global_rate = 0.001
+        limits.global_burst = 3
+
+        let shared = run(4, limits)
+        XCTAssertEqual(shared.responses - shared.errors, 3)
+    }
+}
+
+// Doesn't need the driver.
+class CBORTests: XCTestCase {
+    let rpId = Array("example.com".utf8)
+    let hash = [UInt8](repeating: 0xCD, count: 32)
+    let credential: [UInt8] = [0xA2, 0x62] + Array("id".utf8) + [0x44, 0x01, 0x02, 0x03, 0x04] +
+        [0x64] + Array("type".utf8) + [0x6A] + Array("public-key".utf8)
+
+    // {1: "example.com", 2: hash, 3: [{"id": h'01020304', "type": "public-key"}]}
+    var getAssertion: [UInt8] {
+        return [0xA3, 0x01, 0x6B] + rpId + [0x02, 0x58, 0x20] + hash + [0x03, 0x81] + credential
+    }
+
+    // {1: hash, 2: {"id": "example.com"}, 3: {"id": h'01020304'}, 4: [{"alg": alg, "type": "public-key"}]}
+    func makeCredential(alg: UInt8 = 0x26, algs: Bool = true) -> [UInt8] {
+        var req: [UInt8] = [algs ? 0xA4 : 0xA3, 0x01, 0x58, 0x20] + hash
+        req += [0x02, 0xA1, 0x62] + Array("id".utf8) + [0x6B] + rpId
+        req += [0x03, 0xA1, 0x62] + Array("id".utf8) + [0x44, 0x01, 0x02, 0x03, 0x04]
+        if algs {
+            req += [0x04, 0x81, 0xA2, 0x63] + Array("alg".utf8) + [alg, 0x64] + Array("type".utf8) + [0x6A] + Array("public-key".utf8)
+        }
+        return req
+    }
+
+    func testReadItems() {
+        // [1, -1, "a", h'01', true]
+        let items: [UInt8] = [0x85, 0x01, 0x20, 0x61, 0x61, 0x41, 0x01, 0xF5]
+
+        items.withUnsafeBytes { data in
+            var reader = softu2f_cbor_reader()
+            var count = 0
+            var uint: UInt64 = 0
+            var int: Int64 = 0
+            var str: UnsafePointer<UInt8>? = nil
+            var len = 0
+            var bool = false
+
+            softu2f_cbor_reader_init(&reader, data.baseAddress, data.count)
+            XCTAssert(softu2f_cbor_read_array(&reader, &count))
+            XCTAssertEqual(count, 5)
+            XCTAssert(softu2f_cbor_read_uint(&reader, &uint))
+            XCTAssertEqual(uint, 1)
+            XCTAssert(softu2f_cbor_read_int(&reader, &int))
+            XCTAssertEqual(int, -1)
+            XCTAssert(softu2f_cbor_read_text(&reader, &str, &len))
+            XCTAssert(softu2f_cbor_text_eq(str, len, "a"))
+            XCTAssert(softu2f_cbor_read_bytes(&reader, &str, &len))
+            XCTAssertEqual(len, 1)
+            XCTAssert(softu2f_cbor_read_bool(&reader, &bool))
+            XCTAssert(bool)
+            XCTAssert(softu2f_cbor_reader_done(&reader))
+        }
+    }
+
+    func testTruncated() {
+        let items: [UInt8] = [0x85, 0x01, 0x20, 0x61, 0x61, 0x41, 0x01, 0xF5]
+
+        items.withUnsafeBytes { data in
+            for n in 0..<data.count {
+                var reader = softu2f_cbor_reader()
+                softu2f_cbor_reader_init(&reader, data.baseAddress, n)
+                XCTAssertFalse(softu2f_cbor_skip(&reader))
+                XCTAssertFalse(softu2f_cbor_reader_done(&reader))
+            }
+        }
+
+        // Every prefix of a good request is a bad one.
+        let req = getAssertion
+        var parsed = softu2f_ctap_get_assertion()
+        for n in 0..<req.count {
+            XCTAssertNotEqual(softu2f_ctap_get_assertion_parse(req, n, &parsed), CTAP2_OK)
+        }
+    }
+
+    func testDeeplyNested() {
+        // An unknown parameter 10000 arrays deep is skipped without recursing.
+        let nested = [UInt8](repeating: 0x81, count: 10000) + [0x00]
+        var req = getAssertion
+        req[0] = 0xA4
+        req += [0x04] + nested
+
+        var parsed = softu2f_ctap_get_assertion()
+        XCTAssertEqual(softu2f_ctap_get_assertion_parse(req, req.count, &parsed), CTAP2_OK)
+        XCTAssertEqual(softu2f_ctap_get_assertion_parse(req, req.count - 1, &parsed), CTAP2_ERR_INVALID_CBOR)
+    }
+
+    func testGetAssertion() {
+        getAssertion.withUnsafeBytes { data in
+            var req = softu2f_ctap_get_assertion()
+            var id: UnsafePointer<UInt8>? = nil
+            var len = 0
+
+            XCTAssertEqual(softu2f_ctap_get_assertion_parse(data.baseAddress, data.count, &req), CTAP2_OK)
+            XCTAssertEqual(req.rp_id_len, rpId.count)
+            XCTAssert(req.up)
+            XCTAssertEqual(req.allow_list.count, 1)
+
+            XCTAssert(softu2f_ctap_credential_next(&req.allow_list, &id, &len))
+            XCTAssertEqual(Array(UnsafeBufferPointer(start: id, count: len)), [0x01, 0x02, 0x03, 0x04])
+            XCTAssertFalse(softu2f_ctap_credential_next(&req.allow_list, &id, &len))
+        }
+
+        // The RP ID as a byte string.
+        var req = getAssertion
+        req[2] = 0x4B
+        var parsed = softu2f_ctap_get_assertion()
+        XCTAssertEqual(softu2f_ctap_get_assertion_parse(req, req.count, &parsed), CTAP2_ERR_CBOR_UNEXPECTED_TYPE)
+    }
+
+    func testMakeCredential() {
+        var parsed = softu2f_ctap_make_credential()
+
+        let req = makeCredential()
+        XCTAssertEqual(softu2f_ctap_make_credential_parse(req, req.count, &parsed), CTAP2_OK)
+        XCTAssert(parsed.es256)
+        XCTAssertEqual(parsed.rp_id_len, rpId.count)
+        XCTAssertEqual(parsed.user_id_len, 4)
+
+        // EdDSA only.
+        let eddsa = makeCredential(alg: 0x27)
+        XCTAssertEqual(softu2f_ctap_make_credential_parse(eddsa, eddsa.count, &parsed), CTAP2_ERR_UNSUPPORTED_ALGORITHM)
+
+        let noAlgs = makeCredential(algs: false)
+        XCTAssertEqual(softu2f_ctap_make_credential_parse(noAlgs, noAlgs.count, &parsed), CTAP2_ERR_MISSING_PARAMETER)
+    }
+}
+
+// Host end of a USB/IP connection to a device on a socketpair, submitting URBs
+// as vhci-hcd would.
+class USBIPHost {
+    var ctx: OpaquePointer? = nil
+    var fd: Int32 = -1
+    var seqnum: UInt32 = 1
+
+    init(flags: softu2f_init_flags = softu2f_init_flags(rawValue: 0)) {
+        var fds: [Int32] = [-1, -1]
+
+        XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, &fds), 0)
+        fd = fds[0]
+
+        ctx = softu2f_usbip_init_with_socket(flags, fds[1])
+        XCTAssertNotNil(ctx)
+
+        // Import the device.
+        var req: [UInt8] = [0x01, 0x11, 0x80, 0x03, 0, 0, 0, 0]
+        req += Array("1-1".utf8) + [UInt8](repeating: 0, count: 29)
+        write(req)
+
+        let rep = read(8 + 312)
+        XCTAssertNotNil(rep)
+        XCTAssertEqual(rep?[2], 0x00)
+        XCTAssertEqual(rep?[3], 0x03)
+        XCTAssertEqual(Array(rep?[4..<8] ?? []), [0, 0, 0, 0])
+    }
+
+    // Hang up, if the device hasn't already been deinitialized, and free it.
+    func close() {
+        if fd >= 0 {
+            Darwin.close(fd)
+            fd = -1
+        }
+
+        if ctx != nil {
+            softu2f_deinit(ctx)
+            ctx = nil
+        }
+    }
+
+    func write(_ bytes: [UInt8]) {
+        XCTAssertEqual(Darwin.write(fd, bytes, bytes.count), bytes.count)
+    }
+
+    // Read count bytes from the device, or from another socket, or nil if
+    // they don't come within timeout milliseconds.
+    func read(_ count: Int, timeout: Int32 = 1000, from: Int32? = nil) -> [UInt8]? {
+        let fd = from ?? self.fd
+        var buf = [UInt8](repeating: 0, count: count)
+        var got = 0
+
+        while got < count {
+            var pfd = pollfd(fd: fd, events: Int16(POLLIN), revents: 0)
+            if poll(&pfd, 1, timeout) <= 0 {
+                return nil
+            }
+
+            let n = buf.withUnsafeMutableBytes { Darwin.read(fd, $0.baseAddress! + got, count - got) }
+            if n <= 0 {
+                return nil
+            }
+
+            got += n
+        }
+
+        return buf
+    }
+
+    func be32(_ value: UInt32) -> [UInt8] {
+        return [UInt8(value >> 24), UInt8(value >> 16 & 0xff), UInt8(value >> 8 & 0xff), UInt8(value & 0xff)]
+    }
+
+    func be32(_ bytes: [UInt8], _ at: Int) -> UInt32 {
+        return UInt32(bytes[at]) << 24 | UInt32(bytes[at + 1]) << 16 | UInt32(bytes[at + 2]) << 8 | UInt32(bytes[at + 3])
+    }
+
+    // Submit a URB on the interrupt endpoint, with data for OUT. Returns its
+    // sequence number.
+    @discardableResult
+    func submit(out data: [UInt8]?) -> UInt32 {
+        let seq = seqnum
+        var hdr = [UInt8](repeating: 0, count: 48)
+
+        seqnum += 1
+        hdr.replaceSubrange(0..<4, with: be32(1))
+        hdr.replaceSubrange(4..<8, with: be32(seq))
+        hdr.replaceSubrange(12..<16, with: be32(data == nil ? 1 : 0))
+        hdr.replaceSubrange(16..<20, with: be32(1))
+        hdr.replaceSubrange(24..<28, with: be32(UInt32(data?.count ?? 64)))
+
+        write(hdr + (data ?? []))
+        return seq
+    }
+
+    // Unlink a URB. Returns the status of the RET_UNLINK.
+    func unlink(_ seq: UInt32) -> Int32 {
+        var hdr = [UInt8](repeating: 0, count: 48)
+
+        hdr.replaceSubrange(0..<4, with: be32(2))
+        hdr.replaceSubrange(4..<8, with: be32(seqnum))
+        hdr.replaceSubrange(20..<24, with: be32(seq))
+        seqnum += 1
+        write(hdr)
+
+        guard let rep = read(48) else { return 0 }
+        XCTAssertEqual(be32(rep, 0), 4)
+        return Int32(bitPattern: be32(rep, 20))
+    }
+
+    // Send frames in one OUT URB and wait for it to complete.
+    func send(_ frames: [[UInt8]]) {
+        let seq = submit(out: frames.flatMap { $0 })
+
+        guard let rep = read(48) else { return XCTFail("OUT URB not completed") }
+        XCTAssertEqual(be32(rep, 0), 3)
+        XCTAssertEqual(be32(rep, 4), seq)
+        XCTAssertEqual(be32(rep, 20), 0)
+    }
+
+    // An INIT frame. CIDs go in the device's byte order, as the driver hands
+    // them over.
+    func frame(_ cid: UInt32, _ cmd: UInt8, _ bcnt: UInt16, _ data: [UInt8] = []) -> [UInt8] {
+        var frame = withUnsafeBytes(of: cid) { Array($0) } + [cmd, UInt8(bcnt >> 8), UInt8(bcnt & 0xff)] + data
+        frame += [UInt8](repeating: 0, count: 64 - frame.count)
+        return frame
+    }
+
+    // A CONT frame.
+    func cont(_ cid: UInt32, _ seq: UInt8, _ data: [UInt8] = []) -> [UInt8] {
+        var frame = withUnsafeBytes(of: cid) { Array($0) } + [seq] + data
+        frame += [UInt8](repeating: 0, count: 64 - frame.count)
+        return frame
+    }
+
+    // The next frame from the device, or nil if none comes within timeout
+    // milliseconds.
+    func receive(timeout: Int32 = 1000) -> [UInt8]? {
+        let seq = submit(out: nil)
+
+        guard let rep = read(48 + 64, timeout: timeout) else {
+            XCTAssertEqual(unlink(seq), -104)
+            return nil
+        }
+
+        XCTAssertEqual(be32(rep, 0), 3)
+        XCTAssertEqual(be32(rep, 4), seq)
+        XCTAssertEqual(be32(rep, 24), 64)
+        return Array(rep[48...])
+    }
+
+    // The next frame on a channel other than KEEPALIVEs, skipping other
+    // channels' frames.
+    func response(_ cid: UInt32, timeout: Int32 = 1000) -> [UInt8]? {
+        while let frame = receive(timeout: timeout) {
+            if frame[0..<4].elementsEqual(withUnsafeBytes(of: cid) { Array($0) }) && frame[4] != U2FHID_KEEPALIVE {
+                return frame
+            }
+        }
+
+        return nil
+    }
+}
+
+class USBIPTests: XCTestCase {
+    func testInitRoundTrip() {
+        let host = USBIPHost()
+        defer { host.close() }
+
+        let nonce: [UInt8] = [1, 2, 3, 4, 5, 6, 7, 8]
+        host.send([host.frame(UInt32(CID_BROADCAST), U2FHID_INIT, 8, nonce)])
+
+        // The response waits for an IN URB on the interrupt endpoint.
+        guard let resp = host.receive() else { return XCTFail("No INIT response") }
+        XCTAssertEqual(resp[4], U2FHID_INIT)
+        XCTAssertEqual(Int(resp[5]) << 8 | Int(resp[6]), 17)
+        XCTAssertEqual(Array(resp[7..<15]), nonce)
+    }
+
+    func testUnlink() {
+        let host = USBIPHost()
+        defer { host.close() }
+
+        // An IN URB waiting for a frame is unlinked, and one that isn't there
+        // any more isn't.
+        let seq = host.submit(out: nil)
+        XCTAssertEqual(host.unlink(seq), -104)
+        XCTAssertEqual(host.unlink(seq), 0)
+    }
+
+    func testFramesRunOut() {
+        let host = USBIPHost()
+        defer { host.close() }
+
+        // Twenty PINGs on their own channels with no IN URBs to answer them on.
+        // One response waits in the frame ring, a few more are queued and the
+        // rest are dropped rather than blocking the device.
+        host.send((0..<20).map { host.frame(UInt32(100 + $0), U2FHID_PING, 4, [1, 2, 3, 4]) })
+
+        var seqs: [UInt32] = []
+        var answered = 0
+        for _ in 0..<20 {
+            seqs.append(host.submit(out: nil))
+        }
+        while let rep = host.read(48 + 64, timeout: 300) {
+            XCTAssertEqual(rep[48 + 4], U2FHID_PING)
+            answered += 1
+        }
+
+        var stats = softu2f_stats()
+        softu2f_stats_get(host.ctx, &stats)
+        XCTAssertGreaterThan(answered, 0)
+        XCTAssertLessThan(answered, 20)
+        XCTAssertEqual(UInt64(20 - answered), stats.out_overflows)
+
+        // The IN URBs nothing came for are still waiting.
+        XCTAssertEqual(seqs.suffix(20 - answered).filter { host.unlink($0) == -104 }.count, 20 - answered)
+
+        // And the device still answers.
+        host.send([host.frame(1, U2FHID_PING, 4, [1, 2, 3, 4])])
+        XCTAssertEqual(host.response(1)?[4], U2FHID_PING)
+    }
+
+    func testStreamedPing() {
+        let host = USBIPHost(flags: SOFTU2F_STREAM_PING)
+        defer { host.close() }
+
+        // The INIT frame is echoed before any CONT frame is sent.
+        host.send([host.frame(1, U2FHID_PING, 200, [UInt8](repeating: 0x11, count: 57))])
+        var resp = host.response(1)
+        XCTAssertEqual(resp?[4], U2FHID_PING)
+        XCTAssertEqual(resp?[6], 200)
+        XCTAssertEqual(Array(resp?[7...] ?? []), [UInt8](repeating: 0x11, count: 57))
+
+        // Meanwhile, another channel can be initialized but not sent anything
+        // else.
+        host.send([host.frame(2, U2FHID_INIT, 8, [1, 2, 3, 4, 5, 6, 7, 8])])
+        XCTAssertEqual(host.response(2)?[4], U2FHID_INIT)
+        host.send([host.frame(3, U2FHID_PING, 4, [1, 2, 3, 4])])
+        resp = host.response(3)
+        XCTAssertEqual(resp?[4], U2FHID_ERROR)
+        XCTAssertEqual(resp?[7], UInt8(ERR_CHANNEL_BUSY))
+
+        // Each CONT frame is echoed as it comes, until one is out of sequence.
+        host.send([host.cont(1, 0, [UInt8](repeating: 0x44, count: 59))])
+        XCTAssertEqual(host.response(1), host.cont(1, 0, [UInt8](repeating: 0x44, count: 59)))
+        host.send([host.cont(1, 2)])
+        resp = host.response(1)
+        XCTAssertEqual(resp?[4], U2FHID_ERROR)
+        XCTAssertEqual(resp?[7], UInt8(ERR_INVALID_SEQ))
+
+        // A whole PING is echoed frame for frame, without the last frame's
+        // padding.
+        host.send([host.frame(1, U2FHID_PING, 200, [UInt8](repeating: 0x11, count: 57)),
+                   host.cont(1, 0, [UInt8](repeating: 0x12, count: 59)),
+                   host.cont(1, 1, [UInt8](repeating: 0x13, count: 59)),
+                   host.cont(1, 2, [UInt8](repeating: 0x14, count: 59))])
+        XCTAssertEqual(host.response(1)?[4], U2FHID_PING)
+        XCTAssertEqual(host.response(1), host.cont(1, 0, [UInt8](repeating: 0x12, count: 59)))
+        XCTAssertEqual(host.response(1), host.cont(1, 1, [UInt8](repeating: 0x13, count: 59)))
+        XCTAssertEqual(host.response(1), host.cont(1, 2, [UInt8](repeating: 0x14, count: 25)))
+        XCTAssertNil(host.receive(timeout: 100))
+
+        // And the other channel can be used once it's done.
+        host.send([host.frame(3, U2FHID_PING, 4, [1, 2, 3, 4])])
+        XCTAssertEqual(host.response(3)?[4], U2FHID_PING)
+    }
+
+    func testHangUp() {
+        let host = USBIPHost()
+
+        // The device stops serving once the host goes away, and can still be
+        // deinitialized.
+        Darwin.close(host.fd)
+        host.fd = -1
+        usleep(100000)
+        host.close()
+    }
+}
+
+class WorkerTests: XCTestCase {
+    let name = "/softu2f-tests"
+
+    // Answers U2F requests with SW_NO_ERROR, or exits if the first byte of the
+    // request is 1, as a crashing worker would.
+    let handler: softu2f_hid_message_handler = { ctx, req in
+        workerCalls += 1
+
+        if CFDataGetBytePtr(req!.pointee.data)[0] == 1 {
+            _exit(0)
+        }
+
+        guard let resp = softu2f_hid_resp_start(ctx, req!.pointee.cid, U2FHID_MSG) else { return false }
+        softu2f_hid_resp_append_u16(resp, 0x9000)
+        return softu2f_hid_resp_send(ctx, resp)
+    }
+
+    // Send a request until a worker answers it, as the worker may not have
+    // attached yet.
+    func waitForWorker(_ host: USBIPHost) {
+        for _ in 0..<100 {
+            host.send([host.frame(5, U2FHID_MSG, 1, [0])])
+            if host.response(5)?[4] == U2FHID_MSG {
+                return
+            }
+            usleep(10000)
+        }
+
+        XCTFail("No worker attached")
+    }
+
+    func testThreadWorker() {
+        let host = USBIPHost()
+        let done = DispatchSemaphore(value: 0)
+
+        XCTAssert(softu2f_workers_start(host.ctx, name, 1))
+
+        // A thread stands in for the worker process.
+        workerCalls = 0
+        Thread {
+            XCTAssert(softu2f_worker_run(self.name, 0, self.handler, nil, softu2f_init_flags(rawValue: 0)))
+            done.signal()
+        }.start()
+
+        waitForWorker(host)
+        let calls = workerCalls
+
+        // Too long for any message. Refused before it gets near a worker.
+        host.send([host.frame(6, U2FHID_MSG, 8000)])
+        var resp = host.response(6)
+        XCTAssertEqual(resp?[4], U2FHID_ERROR)
+        XCTAssertEqual(resp?[7], UInt8(ERR_INVALID_LEN))
+
+        // Truncated. Times out without reaching a worker or holding up the next
+        // request.
+        host.send([host.frame(7, U2FHID_MSG, 100)])
+        usleep(600000)
+        host.send([host.frame(8, U2FHID_MSG, 1, [0])])
+        resp = host.response(7)
+        XCTAssertEqual(resp?[4], U2FHID_ERROR)
+        XCTAssertEqual(resp?[7], UInt8(ERR_MSG_TIMEOUT))
+        XCTAssertEqual(host.response(8)?[4], U2FHID_MSG)
+        XCTAssertEqual(workerCalls, calls + 1)
+
+        // Stopping the workers lets the worker return.
+        host.close()
+        XCTAssertEqual(done.wait(timeout: .now() + 5), .success)
+    }
+
+    func testWorkerDies() {
+        typealias Fork = @convention(c) () -> pid_t
+        let fork = unsafeBitCast(dlsym(UnsafeMutableRawPointer(bitPattern: -2), "fork"), to: Fork.self)
+        let host = USBIPHost()
+        defer { host.close() }
+
+        XCTAssert(softu2f_workers_start(host.ctx, name, 1))
+
+        let pid = fork()
+        if pid == 0 {
+            softu2f_worker_run(name, 0, handler, nil, softu2f_init_flags(rawValue: 0))
+            _exit(0)
+        }
+        XCTAssertGreaterThan(pid, 0)
+
+        waitForWorker(host)
+
+        // The worker exits while it has the request. Once it's gone the
+        // request fails instead of hanging.
+        host.send([host.frame(9, U2FHID_MSG, 1, [1])])
+        var status: Int32 = 0
+        XCTAssertEqual(waitpid(pid, &status, 0), pid)
+
+        let resp = host.response(9, timeout: 3000)
+        XCTAssertEqual(resp?[4], U2FHID_ERROR)
+        XCTAssertEqual(resp?[7], UInt8(ERR_OTHER))
+    }
+}
+
+class SignerTests: XCTestCase {
+    var host: USBIPHost! = nil
+    var daemon: Int32 = -1
+    let done = DispatchSemaphore(value: 0)
+
+    // A device on a run loop, for KEEPALIVEs, forwarding to a daemon on a
+    // socketpair.
+    override func setUp() {
+        super.setUp()
+
+        var fds: [Int32] = [-1, -1]
+
+        host = USBIPHost()
+        XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, &fds), 0)
+        daemon = fds[0]
+        XCTAssert(softu2f_signer_connect_with_socket(host.ctx, fds[1]))
+
+        let ctx = host.ctx
+        Thread {
+            softu2f_run(ctx)
+            self.done.signal()
+        }.start()
+
+        // Let the run loop start.
+        usleep(100000)
+    }
+
+    override func tearDown() {
+        softu2f_shutdown(host.ctx)
+        XCTAssertEqual(done.wait(timeout: .now() + 5), .success)
+
+        if daemon >= 0 {
+            close(daemon)
+        }
+        host.close()
+
+        super.tearDown()
+    }
+
+    // Read a request as the daemon.
+    func request() -> (UInt32, [UInt8])? {
+        guard let hdr = host.read(6, from: daemon) else { return nil }
+        let len = Int(hdr[4]) << 8 | Int(hdr[5])
+        guard let data = host.read(len, from: daemon) else { return nil }
+
+        return (host.be32(hdr, 0), data)
+    }
+
+    func testRoundTrip() {
+        host.send([host.frame(5, U2FHID_MSG, 3, [0x00, 0x03, 0x00])])
+
+        guard let req = request() else { return XCTFail("No request") }
+        XCTAssertEqual(req.0, 5)
+        XCTAssertEqual(req.1, [0x00, 0x03, 0x00])
+
+        let resp: [UInt8] = host.be32(5) + [0, 2, 0x90, 0x00]
+        XCTAssertEqual(write(daemon, resp, resp.count), resp.count)
+
+        let frame = host.response(5)
+        XCTAssertEqual(frame?[4], U2FHID_MSG)
+        XCTAssertEqual(frame?[6], 2)
+        XCTAssertEqual(frame?[7], 0x90)
+    }
+
+    func testKeepAlive() {
+        host.send([host.frame(5, U2FHID_MSG, 3, [0x00, 0x03, 0x00])])
+        XCTAssertNotNil(request())
+
+        // The daemon takes its time. The client hears from the device every
+        // SOFTU2F_KEEPALIVE_INTERVAL meanwhile.
+        var keepalives = 0
+        let start = Date()
+        while Date().timeIntervalSince(start) < 0.5 {
+            if let frame = host.receive(timeout: 200), frame[4] == U2FHID_KEEPALIVE {
+                keepalives += 1
+            }
+        }
+        XCTAssertGreaterThanOrEqual(keepalives, 3)
+
+        let resp: [UInt8] = host.be32(5) + [0, 2, 0x90, 0x00]
+        XCTAssertEqual(write(daemon, resp, resp.count), resp.count)
+        XCTAssertEqual(host.response(5)?[4], U2FHID_MSG)
+    }
+
+    func testHangUp() {
+        host.send([host.frame(5, U2FHID_MSG, 3, [0x00, 0x03, 0x00])])
+        XCTAssertNotNil(request())
+
+        // The daemon goes away with the request.
+        close(daemon)
+        daemon = -1
+
+        let frame = host.response(5)
+        XCTAssertEqual(frame?[4], U2FHID_ERROR)
+        XCTAssertEqual(frame?[7], UInt8(ERR_OTHER))
+
+        // Later requests fail straight away.
+        host.send([host.frame(6, U2FHID_MSG, 3, [0x00, 0x03, 0x00])])
+        XCTAssertEqual(host.response(6)?[7], UInt8(ERR_OTHER))
+    }
+}
@@ -13,14 +13,21 @@
 #define super IOHIDDevice
 OSDefineMetaClassAndStructors(SoftU2FDevice, IOHIDDevice)
 
-SoftU2FDevice* SoftU2FDevice::newDevice() {
-  SoftU2FDevice *device = new SoftU2FDevice;
+SoftU2FDevice* SoftU2FDevice::newDevice(uint16_t reportSize) {
+  SoftU2FDevice *device = nullptr;
+
+  if (!kSoftU2FReportSizeSupported(reportSize))
+    goto fail;
+
+  device = new SoftU2FDevice;
   if (!device)
     goto fail;
 
   if (!device->init(nullptr))
     goto fail;
 
+  device->_reportSize = reportSize;
+
   return device;
 
 fail:
@@ -30,8 +37,34 @@ fail:
   return nullptr;
 }
 
+uint16_t SoftU2FDevice::reportSize() const {
+  return _reportSize;
+}
+
 IOReturn SoftU2FDevice::newReportDescriptor(IOMemoryDescriptor **descriptor) const {
-  IOBufferMemoryDescriptor *buffer = IOBufferMemoryDescriptor::withBytes(u2fhid_report_descriptor, sizeof(u2fhid_report_descriptor), kIODirectionNone);
+  const unsigned char *bytes = u2fhid_report_descriptor;
+  vm_size_t length = sizeof(u2fhid_report_descriptor);
+
+  switch (_reportSize) {
+  case 128:
+    bytes = u2fhid_sized_report_descriptor<128>::bytes;
+    length = u2fhid_sized_report_descriptor<128>::length;
+    break;
+  case 256:
+    bytes = u2fhid_sized_report_descriptor<256>::bytes;
+    length = u2fhid_sized_report_descriptor<256>::length;
+    break;
+  case 512:
+    bytes = u2fhid_sized_report_descriptor<512>::bytes;
+    length = u2fhid_sized_report_descriptor<512>::length;
+    break;
+  case 1024:
+    bytes = u2fhid_sized_report_descriptor<1024>::bytes;
+    length = u2fhid_sized_report_descriptor<1024>::length;
+    break;
+  }
+
+  IOBufferMemoryDescriptor *buffer = IOBufferMemoryDescriptor::withBytes(bytes, length, kIODirectionNone);
   if (!buffer)
     return kIOReturnNoResources;
 
@@ -52,19 +85,19 @@ IOReturn SoftU2FDevice::setReport(IOMemoryDescriptor *report, IOHIDReportType re
 }
 
 OSString *SoftU2FDevice::newProductString() const {
-  return OSString::withCString("SoftU2F");
+  return OSString::withCString(kSoftU2FProductString);
 }
 
 OSString *SoftU2FDevice::newSerialNumberString() const {
-  return OSString::withCString("123");
+  return OSString::withCString(kSoftU2FSerialNumberString);
 }
 
 OSNumber *SoftU2FDevice::newVendorIDNumber() const {
-  return OSNumber::withNumber(123, 32);
+  return OSNumber::withNumber(kSoftU2FVendorID, 32);
 }
 
 OSNumber *SoftU2FDevice::newProductIDNumber() const {
-  return OSNumber::withNumber(123, 32);
+  return OSNumber::withNumber(kSoftU2FProductID, 32);
 }
 
 OSNumber* SoftU2FDevice::newPrimaryUsageNumber() const {
@@ -9,34 +9,53 @@
 #ifndef SoftU2FDevice_hpp
 #define SoftU2FDevice_hpp
 
+#include "UserKernelShared.h"
 #include <IOKit/hid/IOHIDDevice.h>
 
-unsigned char const u2fhid_report_descriptor[] = {
-    0x06, 0xD0, 0xF1, // Usage Page (Reserved 0xF1D0)
-    0x09, 0x01,       // Usage (0x01)
-    0xA1, 0x01,       // Collection (Application)
-    0x09, 0x20,       //   Usage (0x20)
-    0x15, 0x00,       //   Logical Minimum (0)
-    0x26, 0xFF, 0x00, //   Logical Maximum (255)
-    0x75, 0x08,       //   Report Size (8)
-    0x95, 0x40,       //   Report Count (64)
-    0x81, 0x02,       //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null
-                      //   Position)
-    0x09, 0x21,       //   Usage (0x21)
-    0x15, 0x00,       //   Logical Minimum (0)
-    0x26, 0xFF, 0x00, //   Logical Maximum (255)
-    0x75, 0x08,       //   Report Size (8)
-    0x95, 0x40,       //   Report Count (64)
-    0x91, 0x02,       //   Output (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null
-                      //   Position,Non-volatile)
-    0xC0,             // End Collection
+unsigned char const u2fhid_report_descriptor[] = kSoftU2FReportDescriptor;
+
+// Report descriptor for report sizes other than the default. The default
+// descriptor above is left as is so existing hosts see the same device.
+// Report Count is a two byte item here so sizes above 255 fit.
+template <uint16_t ReportSize>
+struct u2fhid_sized_report_descriptor {
+  static_assert(kSoftU2FReportSizeSupported(ReportSize), "Unsupported report size");
+
+  enum { length = 36 };
+  static const unsigned char bytes[length];
+};
+
+template <uint16_t ReportSize>
+const unsigned char u2fhid_sized_report_descriptor<ReportSize>::bytes[length] = {
+    0x06, 0xD0, 0xF1,                         // Usage Page (Reserved 0xF1D0)
+    0x09, 0x01,                               // Usage (0x01)
+    0xA1, 0x01,                               // Collection (Application)
+    0x09, 0x20,                               //   Usage (0x20)
+    0x15, 0x00,                               //   Logical Minimum (0)
+    0x26, 0xFF, 0x00,                         //   Logical Maximum (255)
+    0x75, 0x08,                               //   Report Size (8)
+    0x96, ReportSize & 0xFF, ReportSize >> 8, //   Report Count (ReportSize)
+    0x81, 0x02,                               //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null
+                                              //   Position)
+    0x09, 0x21,                               //   Usage (0x21)
+    0x15, 0x00,                               //   Logical Minimum (0)
+    0x26, 0xFF, 0x00,                         //   Logical Maximum (255)
+    0x75, 0x08,                               //   Report Size (8)
+    0x96, ReportSize & 0xFF, ReportSize >> 8, //   Report Count (ReportSize)
+    0x91, 0x02,                               //   Output (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null
+                                              //   Position,Non-volatile)
+    0xC0,                                     // End Collection
 };
 
 class SoftU2FDevice : public IOHIDDevice {
   OSDeclareDefaultStructors(SoftU2FDevice)
 
+  uint16_t _reportSize = 64;
+
 public:
-  static SoftU2FDevice* newDevice();
+  static SoftU2FDevice* newDevice(uint16_t reportSize);
+
+  uint16_t reportSize() const;
 
   virtual OSString *newProductString() const override;
   virtual OSString *newSerialNumberString() const override;
@@ -31,8 +31,9 @@ OSDefineMetaClassAndStructors(SoftU2FUserClient, IOUserClient)
  *  };
  */
 const IOExternalMethodDispatch SoftU2FUserClient::sMethods[kNumberOfMethods] = {
-    {(IOExternalMethodAction)&SoftU2FUserClient::sSendFrame, 0, sizeof(U2FHID_FRAME), 0, 0},
+    {(IOExternalMethodAction)&SoftU2FUserClient::sSendFrame, 0, kIOUCVariableStructureSize, 0, 0},
     {(IOExternalMethodAction)&SoftU2FUserClient::sNotifyFrame, 0, 0, 0, 0},
+    {(IOExternalMethodAction)&SoftU2FUserClient::sReadFrames, 0, 0, 0, kIOUCVariableStructureSize},
 };
 
 IOReturn SoftU2FUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch, OSObject *target, void *reference) {
@@ -59,12 +60,31 @@ IOReturn SoftU2FUserClient::externalMethodGated(ExternalMethodGatedArguments *ar
   return super::externalMethod(arguments->selector, arguments->arguments, arguments->dispatch, arguments->target, arguments->reference);
 }
 
+// initWithTask is called as a result of the user process calling
+// IOServiceOpen. The type argument selects the device's report size.
+bool SoftU2FUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
+  if (!super::initWithTask(owningTask, securityToken, type, properties))
+    return false;
+
+  if (type) {
+    if (!kSoftU2FReportSizeSupported(type))
+      return false;
+
+    _reportSize = type;
+  }
+
+  return true;
+}
+
 void SoftU2FUserClient::free() {
   IOLog("%s[%p]::%s()\n", getName(), this, __FUNCTION__);
 
   if (_notifyRef)
     IOFree(_notifyRef, sizeof(OSAsyncReference64));
 
+  if (_reportQueue)
+    IOFree(_reportQueue, kReportQueueLength * _reportSize);
+
   if (_commandGate)
     _commandGate->release();
 
@@ -85,7 +105,13 @@ bool SoftU2FUserClient::start(IOService *provider) {
   if (!super::start(provider))
     goto fail_super_start;
 
-  device = SoftU2FDevice::newDevice();
+  if (_reportSize > kSoftU2FInlineReportSize) {
+    _reportQueue = (uint8_t *)IOMalloc(kReportQueueLength * _reportSize);
+    if (!_reportQueue)
+      goto fail_new_device;
+  }
+
+  device = SoftU2FDevice::newDevice(_reportSize);
   if (!device)
     goto fail_new_device;
 
@@ -166,15 +192,33 @@ void SoftU2FUserClient::frameReceivedGated(IOMemoryDescriptor *report) {
   reportMap = report->map();
 
   // Notify userland that we got a report.
-  if (_notifyRef && reportMap->getLength() == sizeof(U2FHID_FRAME)) {
-    io_user_reference_t *args = (io_user_reference_t *)reportMap->getAddress();
-    sendAsyncResult64(*_notifyRef, kIOReturnSuccess, args, sizeof(U2FHID_FRAME) / sizeof(io_user_reference_t));
+  if (_notifyRef && reportMap->getLength() == _reportSize) {
+    if (_reportSize <= kSoftU2FInlineReportSize) {
+      io_user_reference_t *args = (io_user_reference_t *)reportMap->getAddress();
+      sendAsyncResult64(*_notifyRef, kIOReturnSuccess, args, _reportSize / sizeof(io_user_reference_t));
+    } else if (enqueueReport((void *)reportMap->getAddress())) {
+      // Too big to send inline. Userland reads it with readFrames.
+      sendAsyncResult64(*_notifyRef, kIOReturnSuccess, nullptr, 0);
+    }
   }
 
   reportMap->release();
   report->complete();
 }
 
+bool SoftU2FUserClient::enqueueReport(const void *report) {
+  if (_reportQueueCount == kReportQueueLength) {
+    IOLog("%s[%p]::%s() report queue full\n", getName(), this, __FUNCTION__);
+    return false;
+  }
+
+  uint32_t tail = (_reportQueueHead + _reportQueueCount) % kReportQueueLength;
+  memcpy(_reportQueue + tail * _reportSize, report, _reportSize);
+  _reportQueueCount++;
+
+  return true;
+}
+
 IOReturn SoftU2FUserClient::sSendFrame(SoftU2FUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
   return target->sendFrame((U2FHID_FRAME *)arguments->structureInput, arguments->structureInputSize);
 }
@@ -186,14 +230,14 @@ IOReturn SoftU2FUserClient::sendFrame(U2FHID_FRAME *frame, size_t frameSize) {
   if (isInactive())
     return kIOReturnOffline;
 
-  if (frameSize != HID_RPT_SIZE)
+  if (frameSize != _reportSize)
     return kIOReturnBadArgument;
 
   device = OSDynamicCast(SoftU2FDevice, getClient());
   if (!device)
     return kIOReturnNotAttached;
 
-  report = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, HID_RPT_SIZE);
+  report = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, _reportSize);
   if (!report)
     return kIOReturnNoResources;
 
@@ -232,3 +276,31 @@ IOReturn SoftU2FUserClient::notifyFrame(io_user_reference_t *ref, uint32_t refCo
 
   return kIOReturnSuccess;
 }
+
+IOReturn SoftU2FUserClient::sReadFrames(SoftU2FUserClient *target, void *reference, IOExternalMethodArguments *arguments) {
+  return target->readFrames(arguments->structureOutput, &arguments->structureOutputSize);
+}
+
+IOReturn SoftU2FUserClient::readFrames(void *frames, uint32_t *framesSize) {
+  uint32_t count = 0;
+
+  if (isInactive())
+    return kIOReturnOffline;
+
+  if (!frames || !_reportQueue) {
+    *framesSize = 0;
+    return kIOReturnSuccess;
+  }
+
+  // Copy out as many whole reports as fit.
+  while (_reportQueueCount && (count + 1) * _reportSize <= *framesSize) {
+    memcpy((uint8_t *)frames + count * _reportSize, _reportQueue + _reportQueueHead * _reportSize, _reportSize);
+    _reportQueueHead = (_reportQueueHead + 1) % kReportQueueLength;
+    _reportQueueCount--;
+    count++;
+  }
+
+  *framesSize = count * _reportSize;
+
+  return kIOReturnSuccess;
+}
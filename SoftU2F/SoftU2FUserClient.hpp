@@ -22,6 +22,13 @@ private:
   static const IOExternalMethodDispatch sMethods[kNumberOfMethods];
   OSAsyncReference64 *_notifyRef = nullptr;
   IOCommandGate *_commandGate = nullptr;
+  uint16_t _reportSize = HID_RPT_SIZE;
+
+  // Reports too large to deliver inline, waiting to be read by userland.
+  static const uint32_t kReportQueueLength = 32;
+  uint8_t *_reportQueue = nullptr;
+  uint32_t _reportQueueHead = 0;
+  uint32_t _reportQueueCount = 0;
 
   typedef struct {
     uint32_t                    selector;
@@ -33,8 +40,10 @@ private:
 
   IOReturn externalMethodGated(ExternalMethodGatedArguments * arguments);
   virtual void frameReceivedGated(IOMemoryDescriptor *report);
+  virtual bool enqueueReport(const void *report);
 
 public:
+  virtual bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) override;
   virtual void free() override;
 
   virtual bool start(IOService *provider) override;
@@ -53,6 +62,9 @@ protected:
 
   static IOReturn sNotifyFrame(SoftU2FUserClient *target, void *reference, IOExternalMethodArguments *arguments);
   virtual IOReturn notifyFrame(io_user_reference_t *ref, uint32_t refCount);
+
+  static IOReturn sReadFrames(SoftU2FUserClient *target, void *reference, IOExternalMethodArguments *arguments);
+  virtual IOReturn readFrames(void *frames, uint32_t *framesSize);
 };
 
 #endif /* SoftU2FUserClient_hpp */
@@ -15,7 +15,49 @@
 enum {
   kSoftU2FUserClientSendFrame,
   kSoftU2FUserClientNotifyFrame,
+  kSoftU2FUserClientReadFrames,
   kNumberOfMethods // Must be last
 };
 
+// A device's HID report size is passed as the type argument to IOServiceOpen.
+// Zero selects the default HID_RPT_SIZE.
+#define kSoftU2FMaxReportSize 1024
+#define kSoftU2FReportSizeSupported(size) ((size) >= 64 && (size) <= kSoftU2FMaxReportSize && ((size) & ((size)-1)) == 0)
+
+// Device identity, shared by the driver and the USB/IP backend.
+#define kSoftU2FVendorID 123
+#define kSoftU2FProductID 123
+#define kSoftU2FProductString "SoftU2F"
+#define kSoftU2FSerialNumberString "123"
+
+// HID report descriptor for a U2F device with the default HID_RPT_SIZE.
+#define kSoftU2FReportDescriptor                                                                                       \
+  {                                                                                                                    \
+    0x06, 0xD0, 0xF1, /* Usage Page (Reserved 0xF1D0) */                                                               \
+    0x09, 0x01,       /* Usage (0x01) */                                                                               \
+    0xA1, 0x01,       /* Collection (Application) */                                                                   \
+    0x09, 0x20,       /*   Usage (0x20) */                                                                             \
+    0x15, 0x00,       /*   Logical Minimum (0) */                                                                      \
+    0x26, 0xFF, 0x00, /*   Logical Maximum (255) */                                                                    \
+    0x75, 0x08,       /*   Report Size (8) */                                                                          \
+    0x95, 0x40,       /*   Report Count (64) */                                                                        \
+    0x81, 0x02,       /*   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position) */                     \
+    0x09, 0x21,       /*   Usage (0x21) */                                                                             \
+    0x15, 0x00,       /*   Logical Minimum (0) */                                                                      \
+    0x26, 0xFF, 0x00, /*   Logical Maximum (255) */                                                                    \
+    0x75, 0x08,       /*   Report Size (8) */                                                                          \
+    0x95, 0x40,       /*   Report Count (64) */                                                                        \
+    0x91, 0x02,       /*   Output (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile) */       \
+    0xC0,             /* End Collection */                                                                             \
+  }
+
+// Largest report that fits in the arguments of a frame notification
+// (kMaxAsyncArgs io_user_reference_t's). Larger reports are queued by the
+// driver and read with kSoftU2FUserClientReadFrames after an empty
+// notification.
+#define kSoftU2FInlineReportSize 128
+
+// Most bytes of queued reports returned by one kSoftU2FUserClientReadFrames.
+#define kSoftU2FReadFramesSize 4096
+
 #endif /* UserKernelShared_h */
@@ -0,0 +1,95 @@
+//
+//  admission.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+
+// Limit how fast clients can start messages and allocate CIDs.
+void softu2f_limits_set(softu2f_ctx *ctx, const softu2f_limits *limits) {
+  pthread_mutex_lock(&ctx->engine->mutex);
+
+  ctx->limits = *limits;
+
+  // Start every bucket full.
+  memset(ctx->cid_buckets, 0, sizeof(ctx->cid_buckets));
+  memset(&ctx->global_bucket, 0, sizeof(softu2f_bucket));
+  memset(&ctx->alloc_bucket, 0, sizeof(softu2f_bucket));
+
+  pthread_mutex_unlock(&ctx->engine->mutex);
+}
+
+// Decide whether to accept an INIT frame, before anything is allocated for
+// it. Rejected frames get ERR_CHANNEL_BUSY.
+bool softu2f_admit_init(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  softu2f_limits *limits = &ctx->limits;
+  softu2f_bucket *bucket;
+  double rate, burst, now;
+
+  if (limits->cid_rate <= 0 && limits->global_rate <= 0 && limits->alloc_rate <= 0)
+    return true;
+
+  now = softu2f_time_now(ctx);
+
+  // Broadcast INITs allocate CIDs and have their own bucket. Other CIDs share
+  // a bucket only with CIDs allocated SOFTU2F_CID_BUCKETS apart.
+  if (frame->cid == CID_BROADCAST) {
+    bucket = &ctx->alloc_bucket;
+    rate = limits->alloc_rate;
+    burst = limits->alloc_burst;
+  } else {
+    bucket = &ctx->cid_buckets[frame->cid % SOFTU2F_CID_BUCKETS];
+    rate = limits->cid_rate;
+    burst = limits->cid_burst;
+  }
+
+  if (!softu2f_bucket_take(bucket, rate, burst, now))
+    goto reject;
+
+  if (!softu2f_bucket_take(&ctx->global_bucket, limits->global_rate, limits->global_burst, now)) {
+    // Don't charge the channel for a message that wasn't started.
+    if (rate > 0)
+      bucket->tokens += 1;
+    goto reject;
+  }
+
+  return true;
+
+reject:
+  softu2f_log(ctx, "Rate limited INIT frame on CID: 0x%08x\n", frame->cid);
+  ctx->stats.rate_limited++;
+  softu2f_hid_err_send(ctx, frame->cid, ERR_CHANNEL_BUSY);
+  return false;
+}
+
+// Take a token from a bucket refilled at rate tokens per second, holding at
+// most burst. Always succeeds if rate isn't positive.
+bool softu2f_bucket_take(softu2f_bucket *bucket, double rate, double burst, double now) {
+  if (rate <= 0)
+    return true;
+
+  if (burst < 1)
+    burst = 1;
+
+  // A bucket that was never used is full. The clock may well read 0 when it's
+  // first used, so that can't stand for never.
+  if (!bucket->used) {
+    bucket->tokens = burst;
+    bucket->used = true;
+  } else {
+    bucket->tokens += (now - bucket->updated) * rate;
+    if (bucket->tokens > burst)
+      bucket->tokens = burst;
+  }
+
+  bucket->updated = now;
+
+  if (bucket->tokens < 1)
+    return false;
+
+  bucket->tokens -= 1;
+  return true;
+}
@@ -0,0 +1,317 @@
+//
+//  async.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+
+// Register a handler that responds to requests later.
+void softu2f_hid_msg_async_handler_register(softu2f_ctx *ctx, uint8_t type, softu2f_hid_message_async_handler handler, void *info) {
+  softu2f_async_handler *async = &ctx->async_handlers[SOFTU2F_CMD_INDEX(type)];
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+  async->handler = handler;
+  async->info = info;
+  pthread_mutex_unlock(&ctx->engine->mutex);
+}
+
+// Respond to a deferred request.
+bool softu2f_hid_pending_complete(softu2f_hid_pending *pending, CFDataRef data) {
+  return softu2f_hid_pending_respond(pending, CFDataGetBytePtr(data), CFDataGetLength(data));
+}
+
+// Respond to a deferred request with the given bytes, and free it.
+bool softu2f_hid_pending_respond(softu2f_hid_pending *pending, const void *data, size_t len) {
+  softu2f_engine *engine = pending->engine;
+  softu2f_hid_response *resp;
+  softu2f_ctx *ctx;
+  bool ret = false;
+
+  // The channel may give up on the request while we wait for the lock.
+  pthread_mutex_lock(&engine->mutex);
+
+  ctx = pending->ctx;
+  if (ctx) {
+    softu2f_hid_pending_detach(ctx, pending);
+
+    // Don't leave the client waiting if the response can't be built.
+    resp = softu2f_hid_resp_start(ctx, pending->cid, pending->cmd);
+    if (resp && softu2f_hid_resp_append(resp, data, len)) {
+      ret = softu2f_hid_resp_send(ctx, resp);
+    } else {
+      if (resp)
+        softu2f_hid_resp_discard(ctx, resp);
+      softu2f_hid_err_send(ctx, pending->cid, ERR_OTHER);
+    }
+  }
+
+  pthread_mutex_unlock(&engine->mutex);
+
+  softu2f_hid_pending_free(pending);
+  return ret;
+}
+
+// Fail a deferred request with a HID error.
+bool softu2f_hid_pending_fail(softu2f_hid_pending *pending, uint8_t code) {
+  softu2f_engine *engine = pending->engine;
+  softu2f_ctx *ctx;
+  bool ret = false;
+
+  pthread_mutex_lock(&engine->mutex);
+
+  ctx = pending->ctx;
+  if (ctx) {
+    softu2f_hid_pending_detach(ctx, pending);
+    ret = softu2f_hid_err_send(ctx, pending->cid, code);
+  }
+
+  pthread_mutex_unlock(&engine->mutex);
+
+  softu2f_hid_pending_free(pending);
+  return ret;
+}
+
+// Set the status reported in a deferred request's KEEPALIVEs.
+void softu2f_hid_pending_status_set(softu2f_hid_pending *pending, uint8_t status) {
+  softu2f_engine *engine = pending->engine;
+  softu2f_ctx *ctx;
+
+  pthread_mutex_lock(&engine->mutex);
+
+  // Tell the client about a change right away.
+  ctx = pending->ctx;
+  if (ctx && pending->status != status) {
+    pending->status = status;
+    pending->keepalive_at = 0;
+    softu2f_hid_pending_keepalive(ctx);
+  }
+
+  pthread_mutex_unlock(&engine->mutex);
+}
+
+// Call a function if a deferred request is cancelled.
+void softu2f_hid_pending_on_cancel(softu2f_hid_pending *pending, softu2f_callback callback, void *info) {
+  softu2f_engine *engine = pending->engine;
+
+  pthread_mutex_lock(&engine->mutex);
+  pending->on_cancel = callback;
+  pending->on_cancel_info = info;
+  pthread_mutex_unlock(&engine->mutex);
+}
+
+// Get the CID a deferred request came in on.
+uint32_t softu2f_hid_pending_cid(softu2f_hid_pending *pending) {
+  return pending->cid;
+}
+
+// Create a deferred request for a message and add it to the device's list.
+softu2f_hid_pending *softu2f_hid_pending_create(softu2f_ctx *ctx, softu2f_hid_message *msg) {
+  softu2f_hid_pending *pending;
+
+  // Through the engine's allocator, so it can be counted.
+  pending = (softu2f_hid_pending *)CFAllocatorAllocate(ctx->engine->allocator, sizeof(softu2f_hid_pending), 0);
+  if (!pending) {
+    softu2f_log(ctx, "No memory for deferred request.\n");
+    return NULL;
+  }
+
+  memset(pending, 0, sizeof(softu2f_hid_pending));
+
+  pending->ctx = ctx;
+  pending->engine = ctx->engine;
+  pending->cid = msg->cid;
+  pending->cmd = msg->cmd;
+  pending->status = KEEPALIVE_PROCESSING;
+  pending->started = softu2f_time_now(ctx);
+  pending->keepalive_at = pending->started + SOFTU2F_KEEPALIVE_INTERVAL;
+
+  if (ctx->deadline > 0)
+    pending->deadline = pending->started + ctx->deadline;
+
+  pending->next = ctx->pending_list;
+  ctx->pending_list = pending;
+
+  // The engine outlives its devices until every request is freed.
+  ctx->engine->npending++;
+
+  return pending;
+}
+
+// Free a deferred request. The last one freed after the engine's devices are
+// gone frees the engine.
+void softu2f_hid_pending_free(softu2f_hid_pending *pending) {
+  softu2f_engine *engine = pending->engine;
+  bool last;
+
+  pthread_mutex_lock(&engine->mutex);
+  last = --engine->npending == 0 && !engine->devices;
+  pthread_mutex_unlock(&engine->mutex);
+
+  CFAllocatorDeallocate(engine->allocator, pending);
+
+  if (last)
+    softu2f_engine_free(engine);
+}
+
+// Find the deferred request on a channel.
+softu2f_hid_pending *softu2f_hid_pending_find(softu2f_ctx *ctx, uint32_t cid) {
+  softu2f_hid_pending *pending;
+
+  for (pending = ctx->pending_list; pending; pending = pending->next) {
+    if (pending->cid == cid)
+      return pending;
+  }
+
+  return NULL;
+}
+
+// Remove a deferred request from its device. Completing it afterwards sends
+// nothing.
+void softu2f_hid_pending_detach(softu2f_ctx *ctx, softu2f_hid_pending *pending) {
+  softu2f_hid_pending **p = &ctx->pending_list;
+
+  while (*p && *p != pending) {
+    p = &(*p)->next;
+  }
+
+  if (*p)
+    *p = pending->next;
+
+  pending->next = NULL;
+  pending->ctx = NULL;
+}
+
+// Cancel a deferred request.
+void softu2f_hid_pending_cancel(softu2f_ctx *ctx, softu2f_hid_pending *pending) {
+  softu2f_log(ctx, "Cancelling request on CID: 0x%08x\n", pending->cid);
+
+  softu2f_hid_pending_detach(ctx, pending);
+
+  if (pending->on_cancel)
+    pending->on_cancel(ctx, pending->on_cancel_info);
+}
+
+// Send KEEPALIVEs for deferred requests that are due one.
+void softu2f_hid_pending_keepalive(softu2f_ctx *ctx) {
+  softu2f_hid_pending *pending;
+  double now;
+
+  if (!ctx->pending_list)
+    return;
+
+  now = softu2f_time_now(ctx);
+
+  for (pending = ctx->pending_list; pending; pending = pending->next) {
+    if (now < pending->keepalive_at)
+      continue;
+
+    softu2f_hid_keepalive_send(ctx, pending->cid, pending->status);
+    pending->keepalive_at = now + SOFTU2F_KEEPALIVE_INTERVAL;
+  }
+}
+
+// Send a KEEPALIVE with the given status.
+bool softu2f_hid_keepalive_send(softu2f_ctx *ctx, uint32_t cid, uint8_t status) {
+  uint8_t buf[kSoftU2FMaxReportSize];
+  U2FHID_FRAME *frame = (U2FHID_FRAME *)buf;
+
+  memset(buf, 0, ctx->layout.rpt_size);
+
+  frame->cid = cid;
+  frame->init.cmd = U2FHID_KEEPALIVE;
+  frame->init.bcntl = 1;
+  frame->init.data[0] = status;
+
+  return softu2f_hid_out_frame_send(ctx, frame);
+}
+
+// Call a function on the run loop's thread after a delay.
+bool softu2f_call_after(softu2f_ctx *ctx, double seconds, softu2f_callback callback, void *info) {
+  softu2f_call *call;
+  bool ret = false;
+
+  call = (softu2f_call *)calloc(1, sizeof(softu2f_call));
+  if (!call) {
+    softu2f_log(ctx, "No memory for scheduled call.\n");
+    return false;
+  }
+
+  call->callback = callback;
+  call->info = info;
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+
+  if (ctx->calls_closed) {
+    softu2f_log(ctx, "Can't schedule call. Device is going away.\n");
+    goto done;
+  }
+
+  // Through the device's wake function or the run loop's timer, whichever
+  // paces its frames.
+  if (!softu2f_hid_out_wake(ctx, seconds)) {
+    softu2f_log(ctx, "Can't schedule call. Run loop isn't running.\n");
+    goto done;
+  }
+
+  call->due = softu2f_time_now(ctx) + seconds;
+  call->next = ctx->calls;
+  ctx->calls = call;
+  call = NULL;
+  ret = true;
+
+  if (ctx->engine->run_loop)
+    CFRunLoopWakeUp(ctx->engine->run_loop);
+
+done:
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  if (call)
+    free(call);
+
+  return ret;
+}
+
+// Make the scheduled calls that are due.
+void softu2f_calls_run(softu2f_ctx *ctx) {
+  softu2f_call **p = &ctx->calls, *due = NULL, *call;
+  double now;
+
+  if (!ctx->calls)
+    return;
+
+  now = softu2f_time_now(ctx);
+
+  // Take the due calls off the list first. Calls they schedule wait for
+  // the next time round.
+  while ((call = *p)) {
+    if (call->due <= now) {
+      *p = call->next;
+      call->next = due;
+      due = call;
+    } else {
+      p = &call->next;
+    }
+  }
+
+  while ((call = due)) {
+    due = call->next;
+    call->callback(ctx, call->info);
+    free(call);
+  }
+}
+
+// Make every scheduled call now, as the device goes away.
+void softu2f_calls_close(softu2f_ctx *ctx) {
+  softu2f_call *call;
+
+  ctx->calls_closed = true;
+
+  while ((call = ctx->calls)) {
+    ctx->calls = call->next;
+    call->callback(ctx, call->info);
+    free(call);
+  }
+}
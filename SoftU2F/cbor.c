@@ -0,0 +1,275 @@
+//
+//  cbor.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+
+// Start reading CBOR items from a buffer.
+void softu2f_cbor_reader_init(softu2f_cbor_reader *reader, const void *data, size_t len) {
+  reader->p = (const uint8_t *)data;
+  reader->end = reader->p + len;
+  reader->error = false;
+  reader->mismatch = false;
+}
+
+// Check whether every item has been read.
+bool softu2f_cbor_reader_done(softu2f_cbor_reader *reader) {
+  return !reader->error && reader->p == reader->end;
+}
+
+// Get the major type of the next item without reading it.
+int softu2f_cbor_peek(softu2f_cbor_reader *reader) {
+  if (reader->error || reader->p == reader->end)
+    return -1;
+
+  return *reader->p >> 5;
+}
+
+// Read an unsigned integer.
+bool softu2f_cbor_read_uint(softu2f_cbor_reader *reader, uint64_t *value) {
+  return softu2f_cbor_read_head(reader, SOFTU2F_CBOR_UINT, value);
+}
+
+// Read an integer, positive or negative.
+bool softu2f_cbor_read_int(softu2f_cbor_reader *reader, int64_t *value) {
+  uint64_t arg;
+
+  if (softu2f_cbor_peek(reader) == SOFTU2F_CBOR_NEGINT) {
+    if (!softu2f_cbor_read_head(reader, SOFTU2F_CBOR_NEGINT, &arg) || arg > INT64_MAX)
+      return softu2f_cbor_fail(reader);
+
+    *value = -1 - (int64_t)arg;
+    return true;
+  }
+
+  if (!softu2f_cbor_read_head(reader, SOFTU2F_CBOR_UINT, &arg) || arg > INT64_MAX)
+    return softu2f_cbor_fail(reader);
+
+  *value = (int64_t)arg;
+  return true;
+}
+
+// Read a byte string in place.
+bool softu2f_cbor_read_bytes(softu2f_cbor_reader *reader, const uint8_t **data, size_t *len) {
+  return softu2f_cbor_read_string(reader, SOFTU2F_CBOR_BYTES, data, len);
+}
+
+// Read a text string in place. It isn't NUL terminated.
+bool softu2f_cbor_read_text(softu2f_cbor_reader *reader, const uint8_t **data, size_t *len) {
+  return softu2f_cbor_read_string(reader, SOFTU2F_CBOR_TEXT, data, len);
+}
+
+// Read the start of an array.
+bool softu2f_cbor_read_array(softu2f_cbor_reader *reader, size_t *count) {
+  uint64_t arg;
+
+  // Every item takes at least a byte.
+  if (!softu2f_cbor_read_head(reader, SOFTU2F_CBOR_ARRAY, &arg) || arg > (uint64_t)(reader->end - reader->p))
+    return softu2f_cbor_fail(reader);
+
+  *count = (size_t)arg;
+  return true;
+}
+
+// Read the start of a map.
+bool softu2f_cbor_read_map(softu2f_cbor_reader *reader, size_t *count) {
+  uint64_t arg;
+
+  if (!softu2f_cbor_read_head(reader, SOFTU2F_CBOR_MAP, &arg) || arg > (uint64_t)(reader->end - reader->p) / 2)
+    return softu2f_cbor_fail(reader);
+
+  *count = (size_t)arg;
+  return true;
+}
+
+// Read a boolean.
+bool softu2f_cbor_read_bool(softu2f_cbor_reader *reader, bool *value) {
+  uint64_t arg;
+
+  if (!softu2f_cbor_read_head(reader, SOFTU2F_CBOR_SIMPLE, &arg))
+    return false;
+
+  if (arg != SOFTU2F_CBOR_FALSE && arg != SOFTU2F_CBOR_TRUE) {
+    reader->mismatch = true;
+    return softu2f_cbor_fail(reader);
+  }
+
+  *value = arg == SOFTU2F_CBOR_TRUE;
+  return true;
+}
+
+// Skip an item, along with anything nested in it.
+bool softu2f_cbor_skip(softu2f_cbor_reader *reader) {
+  uint64_t remaining = 1, arg;
+  uint8_t major;
+
+  // Count items still to skip instead of recursing into containers.
+  while (remaining > 0) {
+    if (reader->error || reader->p == reader->end)
+      return softu2f_cbor_fail(reader);
+
+    major = *reader->p >> 5;
+    if (!softu2f_cbor_read_head(reader, major, &arg))
+      return false;
+
+    remaining--;
+
+    switch (major) {
+    case SOFTU2F_CBOR_BYTES:
+    case SOFTU2F_CBOR_TEXT:
+      if (arg > (uint64_t)(reader->end - reader->p))
+        return softu2f_cbor_fail(reader);
+      reader->p += arg;
+      break;
+    case SOFTU2F_CBOR_ARRAY:
+    case SOFTU2F_CBOR_MAP:
+      if (major == SOFTU2F_CBOR_MAP)
+        arg *= 2;
+      if (arg > (uint64_t)(reader->end - reader->p))
+        return softu2f_cbor_fail(reader);
+      remaining += arg;
+      break;
+    case SOFTU2F_CBOR_TAG:
+      remaining++;
+      break;
+    }
+  }
+
+  return true;
+}
+
+// Read an item's head, checking its major type. Only definite lengths are
+// accepted, as CTAP2 requires.
+bool softu2f_cbor_read_head(softu2f_cbor_reader *reader, uint8_t major, uint64_t *arg) {
+  uint8_t info, size, i;
+
+  if (reader->error || reader->p == reader->end)
+    return softu2f_cbor_fail(reader);
+
+  if (*reader->p >> 5 != major) {
+    reader->mismatch = true;
+    return softu2f_cbor_fail(reader);
+  }
+
+  info = *reader->p & 0x1f;
+  reader->p++;
+
+  if (info < 24) {
+    *arg = info;
+    return true;
+  }
+
+  if (info > 27)
+    return softu2f_cbor_fail(reader);
+
+  size = 1 << (info - 24);
+  if (size > reader->end - reader->p)
+    return softu2f_cbor_fail(reader);
+
+  *arg = 0;
+  for (i = 0; i < size; i++) {
+    *arg = *arg << 8 | *reader->p++;
+  }
+
+  return true;
+}
+
+// Read a byte or text string in place.
+bool softu2f_cbor_read_string(softu2f_cbor_reader *reader, uint8_t major, const uint8_t **data, size_t *len) {
+  uint64_t arg;
+
+  if (!softu2f_cbor_read_head(reader, major, &arg) || arg > (uint64_t)(reader->end - reader->p))
+    return softu2f_cbor_fail(reader);
+
+  *data = reader->p;
+  *len = (size_t)arg;
+  reader->p += arg;
+
+  return true;
+}
+
+// Mark a reader as failed. Later reads fail too.
+bool softu2f_cbor_fail(softu2f_cbor_reader *reader) {
+  reader->error = true;
+  return false;
+}
+
+// Check whether a text string read in place equals a C string.
+bool softu2f_cbor_text_eq(const uint8_t *data, size_t len, const char *str) {
+  return strlen(str) == len && memcmp(data, str, len) == 0;
+}
+
+// Append an unsigned integer to a response.
+bool softu2f_cbor_write_uint(softu2f_hid_response *resp, uint64_t value) {
+  return softu2f_cbor_write_head(resp, SOFTU2F_CBOR_UINT, value);
+}
+
+// Append an integer to a response.
+bool softu2f_cbor_write_int(softu2f_hid_response *resp, int64_t value) {
+  if (value < 0)
+    return softu2f_cbor_write_head(resp, SOFTU2F_CBOR_NEGINT, (uint64_t)(-1 - value));
+
+  return softu2f_cbor_write_head(resp, SOFTU2F_CBOR_UINT, (uint64_t)value);
+}
+
+// Append a byte string to a response.
+bool softu2f_cbor_write_bytes(softu2f_hid_response *resp, const void *data, size_t len) {
+  return softu2f_cbor_write_head(resp, SOFTU2F_CBOR_BYTES, len) && softu2f_hid_resp_append(resp, data, len);
+}
+
+// Append a text string to a response.
+bool softu2f_cbor_write_text(softu2f_hid_response *resp, const char *str) {
+  size_t len = strlen(str);
+
+  return softu2f_cbor_write_head(resp, SOFTU2F_CBOR_TEXT, len) && softu2f_hid_resp_append(resp, str, len);
+}
+
+// Append the start of an array to a response.
+bool softu2f_cbor_write_array(softu2f_hid_response *resp, size_t count) {
+  return softu2f_cbor_write_head(resp, SOFTU2F_CBOR_ARRAY, count);
+}
+
+// Append the start of a map to a response.
+bool softu2f_cbor_write_map(softu2f_hid_response *resp, size_t count) {
+  return softu2f_cbor_write_head(resp, SOFTU2F_CBOR_MAP, count);
+}
+
+// Append a boolean to a response.
+bool softu2f_cbor_write_bool(softu2f_hid_response *resp, bool value) {
+  return softu2f_cbor_write_head(resp, SOFTU2F_CBOR_SIMPLE, value ? SOFTU2F_CBOR_TRUE : SOFTU2F_CBOR_FALSE);
+}
+
+// Append an item's head to a response, in its shortest encoding.
+bool softu2f_cbor_write_head(softu2f_hid_response *resp, uint8_t major, uint64_t arg) {
+  uint8_t buf[9];
+  unsigned int size, i;
+
+  if (arg < 24) {
+    buf[0] = major << 5 | (uint8_t)arg;
+    return softu2f_hid_resp_append(resp, buf, 1);
+  }
+
+  if (arg <= UINT8_MAX) {
+    size = 1;
+    buf[0] = major << 5 | 24;
+  } else if (arg <= UINT16_MAX) {
+    size = 2;
+    buf[0] = major << 5 | 25;
+  } else if (arg <= UINT32_MAX) {
+    size = 4;
+    buf[0] = major << 5 | 26;
+  } else {
+    size = 8;
+    buf[0] = major << 5 | 27;
+  }
+
+  for (i = 0; i < size; i++) {
+    buf[size - i] = (uint8_t)(arg >> (8 * i));
+  }
+
+  return softu2f_hid_resp_append(resp, buf, size + 1);
+}
@@ -0,0 +1,42 @@
+//
+//  clock.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+#include <sys/time.h>
+
+// Use another time source for a device, or the system's if clock is NULL.
+void softu2f_clock_set(softu2f_ctx *ctx, const softu2f_clock *clock) {
+  pthread_mutex_lock(&ctx->engine->mutex);
+
+  if (clock)
+    ctx->clock = *clock;
+  else
+    memset(&ctx->clock, 0, sizeof(softu2f_clock));
+
+  pthread_mutex_unlock(&ctx->engine->mutex);
+}
+
+// Get the current time in seconds.
+double softu2f_time_now(softu2f_ctx *ctx) {
+  struct timeval now;
+
+  if (ctx->clock.now)
+    return ctx->clock.now(ctx->clock.info);
+
+  gettimeofday(&now, NULL);
+
+  return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+// Wait for an interval.
+void softu2f_time_sleep(softu2f_ctx *ctx, const struct timespec *interval) {
+  if (ctx->clock.sleep)
+    ctx->clock.sleep(ctx->clock.info, interval->tv_sec + interval->tv_nsec / 1000000000.0);
+  else
+    nanosleep(interval, NULL);
+}
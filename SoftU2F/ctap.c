@@ -0,0 +1,317 @@
+//
+//  ctap.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+
+// Parse authenticatorMakeCredential parameters in place.
+uint8_t softu2f_ctap_make_credential_parse(const void *data, size_t len, softu2f_ctap_make_credential *req) {
+  softu2f_cbor_reader reader;
+  size_t count, i, hash_len;
+  bool algs = false;
+  uint64_t key;
+  uint8_t status;
+
+  memset(req, 0, sizeof(softu2f_ctap_make_credential));
+  softu2f_cbor_reader_init(&reader, data, len);
+
+  if (!softu2f_cbor_read_map(&reader, &count))
+    return softu2f_ctap_reader_status(&reader);
+
+  for (i = 0; i < count; i++) {
+    if (!softu2f_cbor_read_uint(&reader, &key))
+      return softu2f_ctap_reader_status(&reader);
+
+    switch (key) {
+    case CTAP_MC_CLIENT_DATA_HASH:
+      softu2f_cbor_read_bytes(&reader, &req->client_data_hash, &hash_len);
+      if (!reader.error && hash_len != CTAP_CLIENT_DATA_HASH_SIZE)
+        return CTAP1_ERR_INVALID_LENGTH;
+      break;
+    case CTAP_MC_RP:
+      status = softu2f_ctap_entity_parse(&reader, "id", &req->rp_id, &req->rp_id_len, false);
+      if (status != CTAP2_OK)
+        return status;
+      break;
+    case CTAP_MC_USER:
+      status = softu2f_ctap_entity_parse(&reader, "id", &req->user_id, &req->user_id_len, true);
+      if (status != CTAP2_OK)
+        return status;
+      break;
+    case CTAP_MC_PUB_KEY_CRED_PARAMS:
+      status = softu2f_ctap_algs_parse(&reader, &req->es256);
+      if (status != CTAP2_OK)
+        return status;
+      algs = true;
+      break;
+    case CTAP_MC_EXCLUDE_LIST:
+      softu2f_ctap_credential_list_parse(&reader, &req->exclude_list);
+      break;
+    case CTAP_MC_OPTIONS:
+      status = softu2f_ctap_options_parse(&reader, &req->rk, NULL, &req->uv);
+      if (status != CTAP2_OK)
+        return status;
+      break;
+    case CTAP_MC_PIN_AUTH:
+      softu2f_cbor_read_bytes(&reader, &req->pin_auth, &req->pin_auth_len);
+      break;
+    case CTAP_MC_PIN_PROTOCOL:
+      softu2f_cbor_read_uint(&reader, &req->pin_protocol);
+      break;
+    default:
+      softu2f_cbor_skip(&reader);
+      break;
+    }
+
+    if (reader.error)
+      return softu2f_ctap_reader_status(&reader);
+  }
+
+  if (!softu2f_cbor_reader_done(&reader))
+    return CTAP2_ERR_INVALID_CBOR;
+
+  if (!req->client_data_hash || !req->rp_id || !req->user_id || !algs)
+    return CTAP2_ERR_MISSING_PARAMETER;
+
+  if (!req->es256)
+    return CTAP2_ERR_UNSUPPORTED_ALGORITHM;
+
+  return CTAP2_OK;
+}
+
+// Parse authenticatorGetAssertion parameters in place.
+uint8_t softu2f_ctap_get_assertion_parse(const void *data, size_t len, softu2f_ctap_get_assertion *req) {
+  softu2f_cbor_reader reader;
+  size_t count, i, hash_len;
+  uint64_t key;
+  uint8_t status;
+
+  memset(req, 0, sizeof(softu2f_ctap_get_assertion));
+  req->up = true;
+  softu2f_cbor_reader_init(&reader, data, len);
+
+  if (!softu2f_cbor_read_map(&reader, &count))
+    return softu2f_ctap_reader_status(&reader);
+
+  for (i = 0; i < count; i++) {
+    if (!softu2f_cbor_read_uint(&reader, &key))
+      return softu2f_ctap_reader_status(&reader);
+
+    switch (key) {
+    case CTAP_GA_RP_ID:
+      softu2f_cbor_read_text(&reader, &req->rp_id, &req->rp_id_len);
+      break;
+    case CTAP_GA_CLIENT_DATA_HASH:
+      softu2f_cbor_read_bytes(&reader, &req->client_data_hash, &hash_len);
+      if (!reader.error && hash_len != CTAP_CLIENT_DATA_HASH_SIZE)
+        return CTAP1_ERR_INVALID_LENGTH;
+      break;
+    case CTAP_GA_ALLOW_LIST:
+      softu2f_ctap_credential_list_parse(&reader, &req->allow_list);
+      break;
+    case CTAP_GA_OPTIONS:
+      status = softu2f_ctap_options_parse(&reader, NULL, &req->up, &req->uv);
+      if (status != CTAP2_OK)
+        return status;
+      break;
+    case CTAP_GA_PIN_AUTH:
+      softu2f_cbor_read_bytes(&reader, &req->pin_auth, &req->pin_auth_len);
+      break;
+    case CTAP_GA_PIN_PROTOCOL:
+      softu2f_cbor_read_uint(&reader, &req->pin_protocol);
+      break;
+    default:
+      softu2f_cbor_skip(&reader);
+      break;
+    }
+
+    if (reader.error)
+      return softu2f_ctap_reader_status(&reader);
+  }
+
+  if (!softu2f_cbor_reader_done(&reader))
+    return CTAP2_ERR_INVALID_CBOR;
+
+  if (!req->rp_id || !req->client_data_hash)
+    return CTAP2_ERR_MISSING_PARAMETER;
+
+  return CTAP2_OK;
+}
+
+// Read the next credential ID from an excludeList or allowList. Returns false
+// at the end of the list or if the list is malformed.
+bool softu2f_ctap_credential_next(softu2f_ctap_credential_list *list, const uint8_t **id, size_t *id_len) {
+  softu2f_cbor_reader *reader = &list->items;
+  const uint8_t *key, *type = NULL;
+  size_t count, key_len, type_len, i;
+
+  if (list->count == 0)
+    return false;
+
+  list->count--;
+  *id = NULL;
+
+  if (!softu2f_cbor_read_map(reader, &count))
+    return false;
+
+  for (i = 0; i < count; i++) {
+    if (!softu2f_cbor_read_text(reader, &key, &key_len))
+      return false;
+
+    if (softu2f_cbor_text_eq(key, key_len, "id")) {
+      softu2f_cbor_read_bytes(reader, id, id_len);
+    } else if (softu2f_cbor_text_eq(key, key_len, "type")) {
+      softu2f_cbor_read_text(reader, &type, &type_len);
+    } else {
+      softu2f_cbor_skip(reader);
+    }
+  }
+
+  if (reader->error || !*id || !type || !softu2f_cbor_text_eq(type, type_len, "public-key"))
+    return softu2f_cbor_fail(reader);
+
+  return true;
+}
+
+// Send a CTAP2 response with only a status code.
+bool softu2f_ctap_status_send(softu2f_ctx *ctx, uint32_t cid, uint8_t status) {
+  softu2f_hid_response *resp;
+
+  resp = softu2f_hid_resp_start(ctx, cid, U2FHID_CBOR);
+  if (!resp)
+    return false;
+
+  softu2f_hid_resp_append_byte(resp, status);
+
+  return softu2f_hid_resp_send(ctx, resp);
+}
+
+// Note where a credential list is and skip over it. Its entries are read
+// with softu2f_ctap_credential_next.
+void softu2f_ctap_credential_list_parse(softu2f_cbor_reader *reader, softu2f_ctap_credential_list *list) {
+  size_t count, i;
+
+  if (!softu2f_cbor_read_array(reader, &count))
+    return;
+
+  list->items = *reader;
+  list->count = count;
+
+  for (i = 0; i < count && !reader->error; i++) {
+    softu2f_cbor_skip(reader);
+  }
+
+  list->items.end = reader->p;
+}
+
+// Parse a PublicKeyCredentialRpEntity or UserEntity, keeping the value of
+// the given key. User IDs are byte strings and RP IDs text.
+uint8_t softu2f_ctap_entity_parse(softu2f_cbor_reader *reader, const char *id_key, const uint8_t **id, size_t *id_len, bool bytes) {
+  const uint8_t *key;
+  size_t count, key_len, i;
+
+  if (!softu2f_cbor_read_map(reader, &count))
+    return softu2f_ctap_reader_status(reader);
+
+  for (i = 0; i < count; i++) {
+    if (!softu2f_cbor_read_text(reader, &key, &key_len))
+      return softu2f_ctap_reader_status(reader);
+
+    if (!softu2f_cbor_text_eq(key, key_len, id_key)) {
+      softu2f_cbor_skip(reader);
+    } else if (bytes) {
+      softu2f_cbor_read_bytes(reader, id, id_len);
+    } else {
+      softu2f_cbor_read_text(reader, id, id_len);
+    }
+  }
+
+  return softu2f_ctap_reader_status(reader);
+}
+
+// Parse pubKeyCredParams, noting whether ES256 public keys are allowed.
+uint8_t softu2f_ctap_algs_parse(softu2f_cbor_reader *reader, bool *es256) {
+  const uint8_t *key, *type;
+  size_t count, nkeys, key_len, type_len, i, j;
+  bool public_key;
+  int64_t alg;
+
+  if (!softu2f_cbor_read_array(reader, &count))
+    return softu2f_ctap_reader_status(reader);
+
+  for (i = 0; i < count; i++) {
+    if (!softu2f_cbor_read_map(reader, &nkeys))
+      return softu2f_ctap_reader_status(reader);
+
+    alg = 0;
+    public_key = false;
+
+    for (j = 0; j < nkeys; j++) {
+      if (!softu2f_cbor_read_text(reader, &key, &key_len))
+        return softu2f_ctap_reader_status(reader);
+
+      if (softu2f_cbor_text_eq(key, key_len, "alg")) {
+        softu2f_cbor_read_int(reader, &alg);
+      } else if (softu2f_cbor_text_eq(key, key_len, "type") && softu2f_cbor_read_text(reader, &type, &type_len)) {
+        public_key = softu2f_cbor_text_eq(type, type_len, "public-key");
+      } else {
+        softu2f_cbor_skip(reader);
+      }
+    }
+
+    if (public_key && alg == CTAP_COSE_ALG_ES256)
+      *es256 = true;
+  }
+
+  return softu2f_ctap_reader_status(reader);
+}
+
+// Parse an options map. Options not asked for are rejected if present.
+uint8_t softu2f_ctap_options_parse(softu2f_cbor_reader *reader, bool *rk, bool *up, bool *uv) {
+  const uint8_t *key;
+  size_t count, key_len, i;
+  bool *option;
+
+  if (!softu2f_cbor_read_map(reader, &count))
+    return softu2f_ctap_reader_status(reader);
+
+  for (i = 0; i < count; i++) {
+    if (!softu2f_cbor_read_text(reader, &key, &key_len))
+      return softu2f_ctap_reader_status(reader);
+
+    if (softu2f_cbor_text_eq(key, key_len, "rk")) {
+      option = rk;
+    } else if (softu2f_cbor_text_eq(key, key_len, "up")) {
+      option = up;
+    } else if (softu2f_cbor_text_eq(key, key_len, "uv")) {
+      option = uv;
+    } else {
+      // Unknown options are ignored.
+      softu2f_cbor_skip(reader);
+      continue;
+    }
+
+    if (!option)
+      return CTAP2_ERR_UNSUPPORTED_OPTION;
+
+    if (!softu2f_cbor_read_bool(reader, option))
+      return softu2f_ctap_reader_status(reader);
+  }
+
+  return softu2f_ctap_reader_status(reader);
+}
+
+// Get the CTAP2 status for a reader's state.
+uint8_t softu2f_ctap_reader_status(softu2f_cbor_reader *reader) {
+  if (!reader->error)
+    return CTAP2_OK;
+
+  if (reader->mismatch)
+    return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+
+  return CTAP2_ERR_INVALID_CBOR;
+}
@@ -0,0 +1,70 @@
+// CTAP2 authenticator API constants
+// FIDO Client to Authenticator Protocol v2.0
+
+#ifndef __CTAP_H_INCLUDED__
+#define __CTAP_H_INCLUDED__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Authenticator commands, the first byte of a U2FHID_CBOR request
+
+#define CTAP_MAKE_CREDENTIAL        0x01    // authenticatorMakeCredential
+#define CTAP_GET_ASSERTION          0x02    // authenticatorGetAssertion
+#define CTAP_GET_INFO               0x04    // authenticatorGetInfo
+#define CTAP_CLIENT_PIN             0x06    // authenticatorClientPIN
+#define CTAP_RESET                  0x07    // authenticatorReset
+#define CTAP_GET_NEXT_ASSERTION     0x08    // authenticatorGetNextAssertion
+
+// authenticatorMakeCredential parameters
+
+#define CTAP_MC_CLIENT_DATA_HASH    0x01
+#define CTAP_MC_RP                  0x02
+#define CTAP_MC_USER                0x03
+#define CTAP_MC_PUB_KEY_CRED_PARAMS 0x04
+#define CTAP_MC_EXCLUDE_LIST        0x05
+#define CTAP_MC_EXTENSIONS          0x06
+#define CTAP_MC_OPTIONS             0x07
+#define CTAP_MC_PIN_AUTH            0x08
+#define CTAP_MC_PIN_PROTOCOL        0x09
+
+// authenticatorGetAssertion parameters
+
+#define CTAP_GA_RP_ID               0x01
+#define CTAP_GA_CLIENT_DATA_HASH    0x02
+#define CTAP_GA_ALLOW_LIST          0x03
+#define CTAP_GA_EXTENSIONS          0x04
+#define CTAP_GA_OPTIONS             0x05
+#define CTAP_GA_PIN_AUTH            0x06
+#define CTAP_GA_PIN_PROTOCOL        0x07
+
+// General constants
+
+#define CTAP_CLIENT_DATA_HASH_SIZE  32      // SHA-256 of the client data
+#define CTAP_COSE_ALG_ES256         (-7)    // ECDSA with SHA-256 on P-256
+#define CTAP_MAX_CBOR_DEPTH         4       // Deepest nesting in requests
+
+// Status codes, the first byte of a U2FHID_CBOR response
+
+#define CTAP2_OK                        0x00    // Success
+#define CTAP1_ERR_INVALID_COMMAND       0x01    // Invalid command
+#define CTAP1_ERR_INVALID_PARAMETER     0x02    // Invalid parameter
+#define CTAP1_ERR_INVALID_LENGTH        0x03    // Invalid message length
+#define CTAP2_ERR_CBOR_UNEXPECTED_TYPE  0x11    // Unexpected CBOR type
+#define CTAP2_ERR_INVALID_CBOR          0x12    // Invalid CBOR
+#define CTAP2_ERR_MISSING_PARAMETER     0x14    // Missing required parameter
+#define CTAP2_ERR_CREDENTIAL_EXCLUDED   0x19    // Excluded credential present
+#define CTAP2_ERR_UNSUPPORTED_ALGORITHM 0x26    // No supported algorithm
+#define CTAP2_ERR_OPERATION_DENIED      0x27    // User declined
+#define CTAP2_ERR_UNSUPPORTED_OPTION    0x2B    // Unsupported option
+#define CTAP2_ERR_KEEPALIVE_CANCEL      0x2D    // Cancelled by the client
+#define CTAP2_ERR_NO_CREDENTIALS        0x2E    // No valid credentials
+#define CTAP2_ERR_NOT_ALLOWED           0x30    // Not allowed right now
+#define CTAP2_ERR_OTHER                 0x7F    // Other unspecified error
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __CTAP_H_INCLUDED__
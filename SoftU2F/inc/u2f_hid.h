@@ -74,6 +74,12 @@ typedef struct __attribute__((packed)) {
 #define U2FHID_SYNC         (TYPE_INIT | 0x3c)  // Protocol resync command
 #define U2FHID_ERROR        (TYPE_INIT | 0x3f)  // Error response
 
+// CTAPHID commands
+
+#define U2FHID_CBOR         (TYPE_INIT | 0x10)  // CTAP2 CBOR encoded message
+#define U2FHID_CANCEL       (TYPE_INIT | 0x11)  // Cancel outstanding request
+#define U2FHID_KEEPALIVE    (TYPE_INIT | 0x3b)  // Request still being processed
+
 #define U2FHID_VENDOR_FIRST (TYPE_INIT | 0x40)  // First vendor defined command
 #define U2FHID_VENDOR_LAST  (TYPE_INIT | 0x7f)  // Last vendor defined command
     
@@ -82,6 +88,7 @@ typedef struct __attribute__((packed)) {
 #define INIT_NONCE_SIZE         8       // Size of channel initialization challenge
 #define CAPFLAG_WINK            0x01    // Device supports WINK command
 #define CAPFLAG_LOCK            0x02    // Device supports LOCK command
+#define CAPFLAG_CBOR            0x04    // Device supports CBOR command
 
 typedef struct __attribute__((packed)) {
   uint8_t nonce[INIT_NONCE_SIZE];       // Client application nonce
@@ -97,6 +104,11 @@ typedef struct __attribute__((packed)) {
   uint8_t capFlags;                     // Capabilities flags  
 } U2FHID_INIT_RESP;
 
+// U2FHID_KEEPALIVE command defines
+
+#define KEEPALIVE_PROCESSING    1       // Still processing the request
+#define KEEPALIVE_UPNEEDED      2       // Waiting for user presence
+
 // U2FHID_SYNC command defines
 
 typedef struct __attribute__((packed)) {
@@ -10,45 +10,750 @@
 #define internal_h
 
 #include "UserKernelShared.h"
+#include "ctap.h"
+#include "u2f.h"
 #include "u2f_hid.h"
 #include <IOKit/IOKitLib.h>
 #include <pthread.h>
 
-// Context includes cid counter, connection.
+// One INIT frame followed by at most 128 CONT frames.
+#define SOFTU2F_MAX_FRAMES 129
+
+// Frame geometry for a device's HID report size. U2FHID_FRAME describes the
+// frame headers; payloads run to the end of the report.
+typedef struct softu2f_frame_layout {
+  uint16_t rpt_size;     // Bytes per frame.
+  uint16_t init_payload; // Payload bytes in an INIT frame.
+  uint16_t cont_payload; // Payload bytes in a CONT frame.
+  uint16_t max_msg;      // Largest message payload.
+} softu2f_frame_layout;
+
+// Find a frame in an array of frames of the given report size.
+#define SOFTU2F_FRAME_AT(frames, index, rpt_size) ((U2FHID_FRAME *)((uint8_t *)(frames) + (size_t)(index) * (rpt_size)))
+
+// Response being built directly in the frames it will be sent in.
+struct softu2f_hid_response {
+  softu2f_frame_layout layout;
+  uint32_t cid;
+  uint8_t cmd;
+  uint16_t len;
+  bool busy;
+  bool overflow;
+  uint8_t *frames;
+};
+
+// Bytes set aside for the CFData object wrapping a single-frame message.
+#define SOFTU2F_FRAME_DATA_SIZE 256
+
+// Number of CID buckets for finding incomming messages.
+#define SOFTU2F_MSG_TABLE_SIZE 64
+
+// Most messages kept around for reuse by an engine.
+#define SOFTU2F_MSG_POOL_SIZE 32
+
+// Index of a HID command in per-command tables.
+#define SOFTU2F_CMD_INDEX(cmd) ((cmd) & ~TYPE_INIT)
+
+// Number of HID commands.
+#define SOFTU2F_CMD_COUNT 128
+
+// Version of the vendor STATS response format.
+#define SOFTU2F_STATS_VERSION 1
+
+// Counters in a vendor STATS response.
+#define SOFTU2F_STATS_COUNT (sizeof(softu2f_stats) / sizeof(uint64_t))
+
+// Size of the key handle filter in bits (8KB). With 4 probes, fewer than one
+// in 50,000 foreign key handles get past it with 1,000 credentials added.
+#define SOFTU2F_KEY_FILTER_BITS (1 << 16)
+
+// Bits set per key handle in the key handle filter.
+#define SOFTU2F_KEY_FILTER_HASHES 4
+
+// Messages hashed together by softu2f_sha256_batch.
+#define SOFTU2F_SHA256_LANES 8
+
+// Eight 32 bit lanes, lowered to whatever SIMD the target has (two SSE or
+// NEON registers, or one AVX2 register).
+typedef uint32_t softu2f_u32x8 __attribute__((vector_size(32)));
+
+// Rotate 32 bit values right.
+#define SOFTU2F_ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// CBOR major types.
+#define SOFTU2F_CBOR_UINT 0
+#define SOFTU2F_CBOR_NEGINT 1
+#define SOFTU2F_CBOR_BYTES 2
+#define SOFTU2F_CBOR_TEXT 3
+#define SOFTU2F_CBOR_ARRAY 4
+#define SOFTU2F_CBOR_MAP 5
+#define SOFTU2F_CBOR_TAG 6
+#define SOFTU2F_CBOR_SIMPLE 7
+
+// CBOR simple values.
+#define SOFTU2F_CBOR_FALSE 20
+#define SOFTU2F_CBOR_TRUE 21
+
+// Asynchronous handler registered for a HID command.
+typedef struct softu2f_async_handler {
+  softu2f_hid_message_async_handler handler;
+  void *info;
+} softu2f_async_handler;
+
+typedef struct softu2f_engine softu2f_engine;
+
+// Request a handler has deferred responding to. ctx is cleared once the
+// channel no longer expects the response. engine stays set until it's freed.
+struct softu2f_hid_pending {
+  softu2f_ctx *ctx;
+  softu2f_engine *engine;
+  uint32_t cid;
+  uint8_t cmd;
+  softu2f_hid_pending *next;
+
+  // KEEPALIVE status and when the next KEEPALIVE is due.
+  uint8_t status;
+  double keepalive_at;
+
+  // Called if the request is cancelled.
+  softu2f_callback on_cancel;
+  void *on_cancel_info;
+
+  // When the request was dispatched and when it is abandoned, or 0 for never.
+  double started;
+  double deadline;
+};
+
+// Seconds between KEEPALIVEs for a deferred request.
+#define SOFTU2F_KEEPALIVE_INTERVAL 0.1
+
+// Function scheduled with softu2f_call_after, and when it's due on the
+// device's clock.
+typedef struct softu2f_call softu2f_call;
+struct softu2f_call {
+  softu2f_callback callback;
+  void *info;
+  double due;
+  softu2f_call *next;
+};
+
+// Token bucket for admission control.
+typedef struct softu2f_bucket {
+  double tokens;
+  double updated; // When tokens was last refilled.
+  bool used;      // Whether tokens and updated have been set.
+} softu2f_bucket;
+
+// Number of per-CID token buckets.
+#define SOFTU2F_CID_BUCKETS 256
+
+// Longest a channel can hold a LOCK, in seconds.
+#define SOFTU2F_LOCK_MAX 10
+
+// Seconds a request can take by default, long enough for user presence.
+#define SOFTU2F_DEADLINE_DEFAULT 30.0
+
+// Priority classes of outbound responses, most urgent first.
+#define SOFTU2F_OUT_ERROR 0     // U2FHID_ERROR.
+#define SOFTU2F_OUT_KEEPALIVE 1 // U2FHID_KEEPALIVE.
+#define SOFTU2F_OUT_CONTROL 2   // INIT, SYNC, LOCK and WINK replies.
+#define SOFTU2F_OUT_BULK 3      // Everything else.
+#define SOFTU2F_OUT_CLASSES 4
+
+// Most responses a device can have queued. Others are sent straight away.
+#define SOFTU2F_OUT_STREAMS 8
+
+// Response being sent a frame at a time, in turn with others.
+typedef struct softu2f_hid_stream softu2f_hid_stream;
+struct softu2f_hid_stream {
+  uint8_t *frames; // Room for SOFTU2F_MAX_FRAMES, kept while the device is.
+  unsigned int nframes; // 0 if the stream is free.
+  unsigned int sent;
+  uint32_t cid;
+  uint8_t cls;
+
+  // More frames will be added, up to total, as for a streamed PING echo.
+  bool open;
+  unsigned int total;
+
+  // Next in its class's queue or the free list, and the response queued
+  // behind this one on the same channel.
+  softu2f_hid_stream *next;
+  softu2f_hid_stream *waiting;
+};
+
+// Alignment of each allocation from scratch memory.
+#define SOFTU2F_SCRATCH_ALIGN 16
+
+// Bump allocator for a device's handlers, reset after each request.
+struct softu2f_scratch {
+  softu2f_ctx *ctx;
+  uint8_t *base; // SOFTU2F_SCRATCH_SIZE bytes, kept while the device is.
+  size_t used;
+};
+
+// Channels the retry cache remembers a response for.
+#define SOFTU2F_RETRY_ENTRIES 16
+
+// Retry cache entry states.
+#define SOFTU2F_RETRY_FREE 0
+#define SOFTU2F_RETRY_ARMED 1  // The request is being handled.
+#define SOFTU2F_RETRY_STORED 2 // The response can be replayed.
+
+// Last cacheable U2F request on a channel, and its response once there is one.
+typedef struct softu2f_retry_entry {
+  uint32_t cid;
+  uint8_t state;
+  uint8_t hash[32]; // SHA-256 of the request APDU.
+  double expires;   // When the response stops being replayed.
+  uint8_t *data;    // Room for max_msg bytes, kept while the device is.
+  uint16_t len;
+} softu2f_retry_entry;
+
+typedef struct softu2f_workers softu2f_workers;
+typedef struct softu2f_signer softu2f_signer;
+typedef struct softu2f_usbip softu2f_usbip;
+
+// Engine includes the run loop, lock and message pool shared by its devices.
+struct softu2f_engine {
+  pthread_mutex_t mutex;
+  CFRunLoopRef run_loop;
+  CFRunLoopTimerRef run_loop_timer;
+  IONotificationPortRef notification_port;
+
+  // Devices served by this engine.
+  softu2f_ctx *devices;
+
+  // Allocator for messages and deferred requests, retained.
+  CFAllocatorRef allocator;
+
+  // Free messages.
+  softu2f_hid_message *msg_pool;
+  unsigned int msg_pool_count;
+
+  // Deferred requests not yet freed, and devices being deinitialized, which
+  // keep the engine around.
+  unsigned int npending;
+};
+
+// Context includes cid counter, connection. Each context is one device.
 struct softu2f_ctx {
   io_connect_t con;
   uint32_t next_cid;
-  pthread_mutex_t mutex;
-  CFRunLoopRef run_loop;
+  softu2f_frame_layout layout;
 
-  // Incomming messages.
+  // Engine this device belongs to and the next device in it.
+  softu2f_engine *engine;
+  softu2f_ctx *next_device;
+
+  // Data for handlers.
+  void *user_data;
+
+  // Counters.
+  softu2f_stats stats;
+
+  // Incomming messages, oldest first.
   softu2f_hid_message *msg_list;
+  softu2f_hid_message *msg_list_tail;
+  unsigned int msg_count;
+
+  // Incomming messages, bucketed by CID.
+  softu2f_hid_message *msg_table[SOFTU2F_MSG_TABLE_SIZE];
+
+  // Complete messages waiting to be handled.
+  softu2f_hid_message *ready_list;
+  softu2f_hid_message *ready_tail;
+
+  // Outgoing response builder.
+  softu2f_hid_response resp;
+
+  // Allocator handing out frame_data, for the CFData wrapping a single-frame
+  // message's payload, so dispatching one doesn't allocate.
+  CFAllocatorRef frame_allocator;
+  uint8_t frame_data[SOFTU2F_FRAME_DATA_SIZE] __attribute__((aligned(16)));
+  bool frame_data_used;
+
+  // Responses waiting to go out, by priority class, and free streams.
+  softu2f_hid_stream streams[SOFTU2F_OUT_STREAMS];
+  softu2f_hid_stream *out_queue[SOFTU2F_OUT_CLASSES];
+  softu2f_hid_stream *out_tail[SOFTU2F_OUT_CLASSES];
+  softu2f_hid_stream *out_free;
+
+  // When the next frame can go out, and the seconds between frames.
+  double out_next;
+  double out_interval;
+
+  // Requests that will be responded to later.
+  softu2f_hid_pending *pending_list;
+
+  // Functions scheduled with softu2f_call_after. No more can be scheduled
+  // once the device is being deinitialized.
+  softu2f_call *calls;
+  bool calls_closed;
+
+  // Sends a frame out of the device.
+  bool (*send_frame)(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+  // Whether the transport wants another frame, for transports that ask for
+  // frames instead of being paced. NULL to pace by out_interval.
+  bool (*send_ready)(softu2f_ctx *ctx);
+
+  // Arranges for queued frames to be sent later, or NULL to use the run
+  // loop's timer.
+  void (*wake)(softu2f_ctx *ctx, double seconds);
+
+  // Worker processes serving U2FHID_MSG requests for this device.
+  softu2f_workers *workers;
+
+  // Shared memory this context serves requests from, if it is a worker.
+  softu2f_workers *worker;
+
+  // Signing daemon U2FHID_MSG requests are forwarded to.
+  softu2f_signer *signer;
+
+  // USB/IP server the device is exported by, instead of the driver.
+  softu2f_usbip *usbip;
 
   // Verbose logging.
   bool debug;
 
-  // Handlers registered for HID msg types.
-  softu2f_hid_message_handler ping_handler;
-  softu2f_hid_message_handler msg_handler;
-  softu2f_hid_message_handler init_handler;
-  softu2f_hid_message_handler wink_handler;
-  softu2f_hid_message_handler sync_handler;
+  // Echo PINGs as their frames arrive.
+  bool stream_ping;
+
+  // Handlers registered for HID msg types, by command.
+  softu2f_hid_message_handler handlers[SOFTU2F_CMD_COUNT];
+
+  // Handlers that respond later, by command.
+  softu2f_async_handler async_handlers[SOFTU2F_CMD_COUNT];
+
+  // Bloom filter of key handles the device issued, or NULL.
+  uint8_t *key_filter;
+
+  // Admission limits and their token buckets.
+  softu2f_limits limits;
+  softu2f_bucket cid_buckets[SOFTU2F_CID_BUCKETS];
+  softu2f_bucket global_bucket;
+  softu2f_bucket alloc_bucket;
+
+  // Time source, or zeroed for the system's.
+  softu2f_clock clock;
+
+  // Seconds a request can take, or 0 for no limit, and who to tell when one
+  // doesn't make it.
+  double deadline;
+  softu2f_stall_handler stall_handler;
+
+  // Channel holding a LOCK, and when the lock runs out.
+  uint32_t lock_cid;
+  double lock_until;
+
+  // Seconds a response is replayed to a resent request, or 0 if never, and
+  // the responses kept.
+  double retry_window;
+  softu2f_retry_entry retry[SOFTU2F_RETRY_ENTRIES];
+
+  // Scratch memory for the request being handled.
+  softu2f_scratch scratch;
+
+  // Validated attestation certificate for REGISTER responses, or NULL.
+  uint8_t *att_cert;
+  uint16_t att_cert_len;
+};
+
+// Identifies shared memory set up by softu2f_workers_start.
+#define SOFTU2F_WORKERS_MAGIC 0x53553257
+
+// Requests that can be queued for each worker.
+#define SOFTU2F_WORKER_REQ_SLOTS 8
+
+// Response frames that can be queued by each worker.
+#define SOFTU2F_WORKER_RESP_SLOTS 256
+
+// Polls between checks that worker or front processes are still alive.
+#define SOFTU2F_WORKER_CHECK_POLLS 100
+
+// Worker slot states.
+#define SOFTU2F_WORKER_FREE 0
+#define SOFTU2F_WORKER_ATTACHING 1
+#define SOFTU2F_WORKER_ATTACHED 2
+
+// Shared memory header. Worker slots follow it.
+typedef struct softu2f_workers_shm {
+  uint32_t magic;
+  uint16_t rpt_size;
+  uint16_t max_msg;
+  uint32_t nworkers;
+  uint32_t closed;
+  pid_t front_pid;
+  uint32_t slot_size; // Bytes per worker slot, including its rings.
+} softu2f_workers_shm;
+
+// Worker slot header, followed by the worker's request and response rings.
+// Ring indices run freely and each is only written by one side.
+typedef struct softu2f_worker_slot {
+  uint32_t state;
+  pid_t pid;
+  uint32_t req_head;  // Written by the front process.
+  uint32_t req_tail;  // Written by the worker.
+  uint32_t resp_head; // Written by the worker.
+  uint32_t resp_tail; // Written by the front process.
+} softu2f_worker_slot;
+
+// Request in a worker's request ring. The payload follows it.
+typedef struct softu2f_worker_req {
+  uint32_t cid;
+  uint8_t cmd;
+  uint8_t reserved;
+  uint16_t bcnt;
+} softu2f_worker_req;
+
+// Shared memory mapped by the front process or a worker.
+struct softu2f_workers {
+  char *name;
+  softu2f_workers_shm *shm;
+  size_t size;
+
+  // Whether this is the front process, which created the shared memory.
+  bool front;
+
+  // Front process's thread forwarding responses from workers.
+  pthread_t thread;
+  bool stop;
+
+  // Slot owned by this process, if it is a worker.
+  softu2f_worker_slot *slot;
+};
+
+// Shared memory layout. Each part starts on its own cache line.
+#define SOFTU2F_WORKERS_ALIGN(n) (((size_t)(n) + 63) & ~(size_t)63)
+#define SOFTU2F_WORKERS_HEADER_SIZE SOFTU2F_WORKERS_ALIGN(sizeof(softu2f_workers_shm))
+#define SOFTU2F_WORKER_SLOT_HEADER_SIZE SOFTU2F_WORKERS_ALIGN(sizeof(softu2f_worker_slot))
+#define SOFTU2F_WORKER_REQ_SIZE(max_msg) SOFTU2F_WORKERS_ALIGN(sizeof(softu2f_worker_req) + (max_msg))
+#define SOFTU2F_WORKER_SLOT_SIZE(max_msg, rpt_size)                                                                    \
+  (SOFTU2F_WORKER_SLOT_HEADER_SIZE + SOFTU2F_WORKER_REQ_SLOTS * SOFTU2F_WORKER_REQ_SIZE(max_msg) +                     \
+   SOFTU2F_WORKER_RESP_SLOTS * (size_t)(rpt_size))
+
+// Most requests outstanding with a signing daemon at once.
+#define SOFTU2F_SIGNER_MAX_PENDING 32
+
+// Signer protocol record header: a big-endian CID and APDU length.
+#define SOFTU2F_SIGNER_HDR_SIZE 6
+
+// Request queued for or written to a signing daemon.
+typedef struct softu2f_signer_req {
+  uint32_t cid;
+  softu2f_hid_pending *pending; // NULL once the channel has given up on it.
+} softu2f_signer_req;
+
+// Connection to a signing daemon.
+struct softu2f_signer {
+  int fd;
+  pthread_t thread;
+  bool closed;
+
+  // Requests that haven't been answered, oldest first. The signer answers a
+  // channel's requests in order.
+  softu2f_signer_req pending[SOFTU2F_SIGNER_MAX_PENDING];
+  unsigned int npending;
+
+  // Requests waiting to be written, and how much of them has been.
+  CFMutableDataRef out;
+  CFIndex out_sent;
+
+  // Responses read, up to the end of the last partial one.
+  uint8_t in[SOFTU2F_SIGNER_HDR_SIZE + UINT16_MAX];
+  size_t nin;
+};
+
+// USB/IP protocol.
+#define SOFTU2F_USBIP_VERSION 0x0111
+#define SOFTU2F_USBIP_OP_REQ_DEVLIST 0x8005
+#define SOFTU2F_USBIP_OP_REP_DEVLIST 0x0005
+#define SOFTU2F_USBIP_OP_REQ_IMPORT 0x8003
+#define SOFTU2F_USBIP_OP_REP_IMPORT 0x0003
+#define SOFTU2F_USBIP_CMD_SUBMIT 1
+#define SOFTU2F_USBIP_CMD_UNLINK 2
+#define SOFTU2F_USBIP_RET_SUBMIT 3
+#define SOFTU2F_USBIP_RET_UNLINK 4
+#define SOFTU2F_USBIP_DIR_IN 1
+#define SOFTU2F_USBIP_SPEED_FULL 2
+#define SOFTU2F_USBIP_OP_HDR_SIZE 8
+#define SOFTU2F_USBIP_HDR_SIZE 48
+#define SOFTU2F_USBIP_DEV_SIZE 312
+#define SOFTU2F_USBIP_BUSID_SIZE 32
+
+// Linux error codes in URB completions.
+#define SOFTU2F_USBIP_EPIPE (-32)
+#define SOFTU2F_USBIP_ECONNRESET (-104)
+
+// Bus ID the device is exported as.
+#define SOFTU2F_USBIP_BUSID "1-1"
+
+// Polling interval of the interrupt endpoints, in ms.
+#define SOFTU2F_USBIP_INTERVAL 1
+
+// String descriptor indices and largest string descriptor.
+#define SOFTU2F_USBIP_STRING_PRODUCT 1
+#define SOFTU2F_USBIP_STRING_SERIAL 2
+#define SOFTU2F_USBIP_STRING_SIZE 64
+
+// IN URBs the host can have waiting for frames.
+#define SOFTU2F_USBIP_MAX_IN_URBS 32
+
+// Frames that can wait for IN URBs. Enough for two of the longest messages.
+#define SOFTU2F_USBIP_MAX_FRAMES (2 * SOFTU2F_MAX_FRAMES)
+
+// Largest transfer accepted from the host.
+#define SOFTU2F_USBIP_MAX_TRANSFER 4096
+
+// USB/IP server exporting a device.
+struct softu2f_usbip {
+  int listen_fd;
+  pthread_t thread;
+  bool stop;
+
+  // Host connected before the device was created, or -1 to listen for hosts.
+  int host_fd;
+
+  // Connected host, and whether it has imported the device.
+  int fd;
+  bool attached;
+
+  // Sequence numbers of IN URBs waiting for frames, oldest first.
+  uint32_t in_urbs[SOFTU2F_USBIP_MAX_IN_URBS];
+  unsigned int in_urb_head;
+  unsigned int in_urb_count;
+
+  // Frames waiting for IN URBs, oldest first.
+  uint8_t frames[SOFTU2F_USBIP_MAX_FRAMES * HID_RPT_SIZE];
+  unsigned int frame_head;
+  unsigned int frame_count;
+
+  // Completions waiting to be written together, and whether URBs from the
+  // host are being handled.
+  CFMutableDataRef out;
+  bool batching;
+
+  // URBs read from the host, up to the end of the last partial one.
+  uint8_t in[SOFTU2F_USBIP_HDR_SIZE + SOFTU2F_USBIP_MAX_TRANSFER + 16384];
+  size_t nin;
 };
 
-struct timespec softu2f_poll_interval = {0, 1000000L}; // 1ms. Spec says 5ms...
+// USB descriptors of the device exported over USB/IP.
+extern const uint8_t softu2f_usbip_report_descriptor[];
+extern const uint8_t softu2f_usbip_device_descriptor[];
+extern const uint8_t softu2f_usbip_config_descriptor[];
+
+// Requests a simulated client can have waiting to be sent.
+#define SOFTU2F_SIM_QUEUE 256
+
+// Simulator event types.
+#define SOFTU2F_SIM_ARRIVAL 0   // A client has a new request.
+#define SOFTU2F_SIM_FRAME_IN 1  // A frame reaches the device.
+#define SOFTU2F_SIM_FRAME_OUT 2 // A frame reaches a client.
+#define SOFTU2F_SIM_TICK 3      // The engine's periodic timer fires.
+#define SOFTU2F_SIM_SEND 4      // The device sends a frame or makes calls.
+#define SOFTU2F_SIM_COMPLETE 5  // A deferred request is answered.
+#define SOFTU2F_SIM_DETACH 6    // The first device is deinitialized.
+
+// Something that happens at a point in simulated time.
+typedef struct softu2f_sim_event {
+  double time;
+  uint64_t seq; // Orders events at the same time.
+  uint8_t type;
+  unsigned int client;
+  uint8_t *frame; // For FRAME_IN and FRAME_OUT.
+} softu2f_sim_event;
+
+// Simulated client, with its own CID and one request in flight at a time.
+typedef struct softu2f_sim_client {
+  uint32_t cid;
+  bool busy;
+  bool bulk;
+  unsigned int arrived; // Requests that arrived.
+
+  // When waiting requests arrived, oldest first. The first is in flight if
+  // busy is set.
+  double arrivals[SOFTU2F_SIM_QUEUE];
+  unsigned int head;
+  unsigned int count;
+
+  // Response being received.
+  bool receiving;
+  uint16_t resp_bcnt;
+  unsigned int resp_len;
+} softu2f_sim_client;
+
+// Discrete-event simulation of clients using a device.
+typedef struct softu2f_sim {
+  const softu2f_sim_config *config;
+  softu2f_sim_result *result;
+  softu2f_sim_client *clients;
+
+  // Devices sharing the engine, the client at each index using the device at
+  // that index modulo ndevices. Detached devices are NULL. ctx is the last
+  // one, which is never detached.
+  softu2f_ctx **devices;
+  unsigned int ndevices;
+  softu2f_ctx *ctx;
+
+  // The device's clock, which handlers and frame pauses advance.
+  double now;
+
+  // Pending events, as a binary heap ordered by time.
+  softu2f_sim_event *events;
+  size_t nevents;
+  size_t cap;
+  uint64_t seq;
+
+  // When a SOFTU2F_SIM_SEND event is scheduled for, or 0 if none is.
+  double send_at;
+
+  // Deferred requests, in the order they're answered. Those before
+  // deferred_head have been.
+  softu2f_hid_pending **deferred;
+  size_t deferred_head;
+  size_t ndeferred;
+  size_t deferred_cap;
+
+  uint32_t rand;
+  double latency_sum;
+  double small_latency_sum;
+  uint64_t small_responses;
+  bool failed;
+} softu2f_sim;
+
+// Whether event a comes before event b.
+#define SOFTU2F_SIM_BEFORE(a, b) ((a).time < (b).time || ((a).time == (b).time && (a).seq < (b).seq))
+
+extern struct timespec softu2f_poll_interval;
+
+// Allocate an engine without any devices.
+softu2f_engine *softu2f_engine_create(softu2f_init_flags flags);
+
+// Free an engine and its message pool.
+void softu2f_engine_free(softu2f_engine *engine);
+
+// Create a device and add it to an engine.
+softu2f_ctx *softu2f_device_add_to_engine(softu2f_engine *engine, softu2f_init_flags flags, uint16_t rpt_size);
+
+// Allocate a context with frame geometry for the given report size.
+softu2f_ctx *softu2f_ctx_create(softu2f_init_flags flags, uint16_t rpt_size);
+
+// Register for frame notifications from a device's connection.
+bool softu2f_device_notify(softu2f_ctx *ctx);
+
+// Send an individual HID frame to the device.
+bool softu2f_hid_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Send an individual HID frame to the driver.
+bool softu2f_kext_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Find where the payload byte at the given message offset lives in the
+// response's frames, and how many bytes are left in that frame.
+uint8_t *softu2f_hid_resp_payload(softu2f_hid_response *resp, uint16_t offset, unsigned int *avail);
+
+// Release the response builder if a handler returned without sending or
+// discarding its response, so later responses can use it. Returns true if it
+// had to.
+bool softu2f_hid_resp_release(softu2f_ctx *ctx);
+
+// Read frames queued by the driver and handle them in batches.
+void softu2f_hid_frames_fetch(softu2f_ctx *ctx);
+
+// Compute frame geometry for a HID report size.
+void softu2f_frame_layout_init(softu2f_frame_layout *layout, uint16_t rpt_size);
 
-// Read an individual HID frame from the device into a HID message.
-void softu2f_hid_frame_read(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+// Maximum number of frames classified in one pass by softu2f_hid_frames_read.
+#define SOFTU2F_FRAME_BATCH 32
 
-// Handle complete messages. Abort messages that timed out.
+// Frame classification flags.
+#define SOFTU2F_FRAME_INIT 0x01          // INIT frame (otherwise CONT).
+#define SOFTU2F_FRAME_CID_ZERO 0x02      // Frame on CID 0.
+#define SOFTU2F_FRAME_CID_BROADCAST 0x04 // Frame on the broadcast CID.
+#define SOFTU2F_FRAME_CONTINUES 0x08     // CONT frame in sequence after the previous frame.
+
+// Classify frames[base..base+count) by type, CID and sequence continuity.
+void softu2f_hid_frames_classify(U2FHID_FRAME *frames, uint16_t rpt_size, unsigned int base, unsigned int count, uint8_t *classes);
+
+// Start echoing a PING as its frames arrive. Returns the message tracking the
+// rest of the echo.
+softu2f_hid_message *softu2f_hid_msg_echo_init(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Echo a CONT frame of a streamed PING. Returns the message if it is still
+// waiting for more frames.
+softu2f_hid_message *softu2f_hid_msg_echo_cont(softu2f_ctx *ctx, softu2f_hid_message *msg, U2FHID_FRAME *frame);
+
+// Read an individual HID frame, classified by softu2f_hid_frames_classify,
+// into a HID message. Returns the message the frame was read into, if any.
+softu2f_hid_message *softu2f_hid_frame_read(softu2f_ctx *ctx, U2FHID_FRAME *frame, uint8_t cls);
+
+// Append the payload of a CONT frame to a message's read buffer. Returns the
+// message if it is still waiting for more frames.
+softu2f_hid_message *softu2f_hid_msg_append_cont(softu2f_ctx *ctx, softu2f_hid_message *msg, U2FHID_FRAME *frame);
+
+// Append data to a message's read buffer, moving it to the ready queue once
+// it is complete. Returns the message if it is still waiting for more frames.
+softu2f_hid_message *softu2f_hid_msg_append(softu2f_ctx *ctx, softu2f_hid_message *msg, uint8_t *data, unsigned int ndata);
+
+// Dispatch a message contained entirely in an INIT frame, without copying
+// its payload out of the frame.
+void softu2f_hid_frame_dispatch(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Create the allocator for the CFData wrapping single-frame messages.
+CFAllocatorRef softu2f_frame_allocator_create(softu2f_ctx *ctx);
+
+// Allocate from the device's frame_data, if it's free and big enough.
+void *softu2f_frame_allocate(CFIndex size, CFOptionFlags hint, void *info);
+
+// Give frame_data back.
+void softu2f_frame_deallocate(void *ptr, void *info);
+
+// Handle complete messages. Abort messages that timed out, keep deferred
+// requests alive, make scheduled calls and send queued frames.
 void softu2f_hid_handle_messages(softu2f_ctx *ctx);
 
+// Dispatch and free messages on the ready queue.
+void softu2f_hid_handle_ready(softu2f_ctx *ctx);
+
+// Check if a channel has a message waiting on the ready queue.
+bool softu2f_hid_ready_has(softu2f_ctx *ctx, uint32_t cid);
+
+// Abort messages that timed out.
+void softu2f_hid_handle_timeouts(softu2f_ctx *ctx);
+
+// Call the handler for a complete message.
+void softu2f_hid_msg_dispatch(softu2f_ctx *ctx, softu2f_hid_message *msg);
+
 // Find a message handler for a message.
 softu2f_hid_message_handler softu2f_hid_msg_handler(softu2f_ctx *ctx, softu2f_hid_message *msg);
 
 // Send an INIT response for a given request.
 bool softu2f_hid_msg_handle_init(softu2f_ctx *ctx, softu2f_hid_message *req);
 
+// Handlers used when none is registered, by command.
+extern const softu2f_hid_message_handler softu2f_hid_default_handlers[SOFTU2F_CMD_COUNT];
+
+// Lock the device to a channel for a LOCK request.
+bool softu2f_hid_msg_handle_lock(softu2f_ctx *ctx, softu2f_hid_message *req);
+
+// Check whether an INIT frame is shut out by another channel's LOCK. Shut out
+// frames get ERR_CHANNEL_BUSY.
+bool softu2f_hid_locked_out(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Send the device's counters for a vendor STATS request.
+bool softu2f_hid_msg_handle_stats(softu2f_ctx *ctx, softu2f_hid_message *req);
+
+// Count the time a handler took, and record a stall if it overran.
+void softu2f_hid_handler_done(softu2f_ctx *ctx, softu2f_hid_message *msg, double start);
+
+// Abandon deferred requests that overran their deadlines. The client gets
+// ERR_MSG_TIMEOUT and the handler's cancel callback is called.
+void softu2f_hid_pending_watchdog(softu2f_ctx *ctx);
+
+// Log and count a stall and tell the stall handler about it.
+void softu2f_stall_record(softu2f_ctx *ctx, uint32_t cid, uint8_t cmd, double elapsed, bool deferred);
+
 // Send a PING response for a given request.
 bool softu2f_hid_msg_handle_ping(softu2f_ctx *ctx, softu2f_hid_message *req);
 
@@ -58,8 +763,204 @@ bool softu2f_hid_msg_handle_wink(softu2f_ctx *ctx, softu2f_hid_message *req);
 // Send a SYNC response for a given request.
 bool softu2f_hid_msg_handle_sync(softu2f_ctx *ctx, softu2f_hid_message *req);
 
+// Create a deferred request for a message and add it to the device's list.
+softu2f_hid_pending *softu2f_hid_pending_create(softu2f_ctx *ctx, softu2f_hid_message *msg);
+
+// Find the deferred request on a channel.
+softu2f_hid_pending *softu2f_hid_pending_find(softu2f_ctx *ctx, uint32_t cid);
+
+// Free a deferred request. The last one freed after the engine's devices are
+// gone frees the engine.
+void softu2f_hid_pending_free(softu2f_hid_pending *pending);
+
+// Respond to a deferred request with the given bytes, and free it.
+bool softu2f_hid_pending_respond(softu2f_hid_pending *pending, const void *data, size_t len);
+
+// Remove a deferred request from its device. Completing it afterwards sends
+// nothing.
+void softu2f_hid_pending_detach(softu2f_ctx *ctx, softu2f_hid_pending *pending);
+
+// Answer a check-only AUTHENTICATE for a key handle the device didn't issue.
+// Returns false if the request should be handled normally.
+bool softu2f_key_filter_check(softu2f_ctx *ctx, softu2f_hid_message *msg);
+
+// Hash an application ID and key handle (64 bit FNV-1a).
+uint64_t softu2f_key_filter_hash(const uint8_t *app_id, const uint8_t *key_handle, uint8_t key_handle_len);
+
+// Find the filter bit for one of a hash's probes.
+uint32_t softu2f_key_filter_bit(uint64_t hash, unsigned int probe);
+
+// Check that a certificate is a well-formed DER X.509 certificate.
+bool softu2f_der_cert_valid(const uint8_t *cert, size_t len);
+
+// Read the header of a DER element with the given tag.
+bool softu2f_der_read(const uint8_t *p, size_t len, uint8_t tag, size_t *hdr, size_t *body);
+
+// SHA-256 round constants.
+extern const uint32_t softu2f_sha256_k[64];
+
+// SHA-256 initial hash value.
+extern const uint32_t softu2f_sha256_h0[8];
+
+// Hash up to SOFTU2F_SHA256_LANES messages, one per vector lane.
+void softu2f_sha256_lanes(const softu2f_sha256_job *jobs, size_t count);
+
+// Run one block through every lane whose mask is set.
+void softu2f_sha256_lanes_compress(softu2f_u32x8 *state, softu2f_u32x8 *w, const softu2f_u32x8 *mask);
+
+// Get a padded block of a message.
+void softu2f_sha256_block_get(const void *data, size_t len, size_t index, uint8_t *block);
+
+// Decide whether to accept an INIT frame, before anything is allocated for
+// it. Rejected frames get ERR_CHANNEL_BUSY.
+bool softu2f_admit_init(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Take a token from a bucket refilled at rate tokens per second.
+bool softu2f_bucket_take(softu2f_bucket *bucket, double rate, double burst, double now);
+
+// Get the current time in seconds.
+double softu2f_time_now(softu2f_ctx *ctx);
+
+// Wait for an interval.
+void softu2f_time_sleep(softu2f_ctx *ctx, const struct timespec *interval);
+
+// Take a free stream to queue a response in. If every stream is busy, queued
+// frames are sent now, paced, until one is done. Returns NULL if the
+// transport can't take them.
+softu2f_hid_stream *softu2f_hid_out_take(softu2f_ctx *ctx);
+
+// Queue the INIT frame of a response whose CONT frames will follow with
+// softu2f_hid_out_extend as they become available.
+bool softu2f_hid_out_open(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Add the next CONT frame to a channel's open response. Returns false if the
+// channel has none.
+bool softu2f_hid_out_extend(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Cut a channel's open response short, sending what it has.
+void softu2f_hid_out_close(softu2f_ctx *ctx, uint32_t cid);
+
+// Find a channel's open response.
+softu2f_hid_stream *softu2f_hid_out_find_open(softu2f_ctx *ctx, uint32_t cid);
+
+// Queue a response whose frames have been written to a stream, and send what
+// can be sent now.
+void softu2f_hid_out_queue(softu2f_ctx *ctx, softu2f_hid_stream *stream, unsigned int nframes);
+
+// Add a stream to the back of its class's queue.
+void softu2f_hid_out_append(softu2f_ctx *ctx, softu2f_hid_stream *stream);
+
+// Get the priority class of a response.
+uint8_t softu2f_hid_out_class(uint8_t cmd);
+
+// Send queued frames as long as the transport can take them.
+void softu2f_hid_out_pump(softu2f_ctx *ctx);
+
+// Send the next queued frame, waiting for its time when told to or when
+// nothing will call us back. Returns false if nothing was sent.
+bool softu2f_hid_out_next(softu2f_ctx *ctx, bool wait);
+
+// Free a stream that is done, starting the next response on its channel.
+void softu2f_hid_out_release(softu2f_ctx *ctx, softu2f_hid_stream *stream);
+
+// Have softu2f_hid_handle_messages called again after the given seconds.
+// Returns false if nothing will call it.
+bool softu2f_hid_out_wake(softu2f_ctx *ctx, double seconds);
+
+// Set a device's outbound streams up, all of them free.
+void softu2f_hid_out_init(softu2f_ctx *ctx);
+
+// Free a device's outbound frames.
+void softu2f_hid_out_free(softu2f_ctx *ctx);
+
+// Send a single frame response, queued like any other.
+bool softu2f_hid_out_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Free a request's scratch memory once it has been handled.
+void softu2f_scratch_reset(softu2f_ctx *ctx, softu2f_hid_message *msg);
+
+// Answer a U2F request from the retry cache if it repeats the last one on its
+// channel. Otherwise, note the request so its response can be cached.
+bool softu2f_retry_check(softu2f_ctx *ctx, softu2f_hid_message *msg);
+
+// Hash the U2F requests waiting to be handled, all at once, so they can be
+// looked up in the retry cache.
+void softu2f_retry_hash_ready(softu2f_ctx *ctx);
+
+// Whether the response to a U2F request may be replayed.
+bool softu2f_retry_cacheable(softu2f_hid_message *msg);
+
+// Cache a response built with softu2f_hid_resp_start, if its channel is
+// waiting for one.
+void softu2f_retry_store_resp(softu2f_ctx *ctx, softu2f_hid_response *resp);
+
+// Cache a response sent with softu2f_hid_msg_send, if its channel is waiting
+// for one.
+void softu2f_retry_store_msg(softu2f_ctx *ctx, softu2f_hid_message *msg);
+
+// Get the entry of a channel waiting for a U2F response, with room for the
+// response.
+softu2f_retry_entry *softu2f_retry_waiting(softu2f_ctx *ctx, uint32_t cid, uint8_t cmd);
+
+// Keep a response copied into an entry if it succeeded.
+void softu2f_retry_stored(softu2f_ctx *ctx, softu2f_retry_entry *entry, uint16_t len);
+
+// Find a channel's retry cache entry.
+softu2f_retry_entry *softu2f_retry_find(softu2f_ctx *ctx, uint32_t cid);
+
+// Get an entry for another channel, taking a free one or the one that
+// expires soonest.
+softu2f_retry_entry *softu2f_retry_evict(softu2f_ctx *ctx);
+
+// Free the retry cache's buffers.
+void softu2f_retry_free(softu2f_ctx *ctx);
+
+// Cancel a deferred request. Its handler is told, and completing it sends
+// nothing.
+void softu2f_hid_pending_cancel(softu2f_ctx *ctx, softu2f_hid_pending *pending);
+
+// Send KEEPALIVEs for deferred requests that are due one.
+void softu2f_hid_pending_keepalive(softu2f_ctx *ctx);
+
+// Send a KEEPALIVE with the given status.
+bool softu2f_hid_keepalive_send(softu2f_ctx *ctx, uint32_t cid, uint8_t status);
+
+// Read an item's head, checking its major type.
+bool softu2f_cbor_read_head(softu2f_cbor_reader *reader, uint8_t major, uint64_t *arg);
+
+// Read a byte or text string in place.
+bool softu2f_cbor_read_string(softu2f_cbor_reader *reader, uint8_t major, const uint8_t **data, size_t *len);
+
+// Mark a reader as failed.
+bool softu2f_cbor_fail(softu2f_cbor_reader *reader);
+
+// Append an item's head to a response, in its shortest encoding.
+bool softu2f_cbor_write_head(softu2f_hid_response *resp, uint8_t major, uint64_t arg);
+
+// Note where a credential list is and skip over it.
+void softu2f_ctap_credential_list_parse(softu2f_cbor_reader *reader, softu2f_ctap_credential_list *list);
+
+// Parse an RP or user entity, keeping the value of the given key.
+uint8_t softu2f_ctap_entity_parse(softu2f_cbor_reader *reader, const char *id_key, const uint8_t **id, size_t *id_len, bool bytes);
+
+// Parse pubKeyCredParams, noting whether ES256 public keys are allowed.
+uint8_t softu2f_ctap_algs_parse(softu2f_cbor_reader *reader, bool *es256);
+
+// Parse an options map. Options passed as NULL are rejected if present.
+uint8_t softu2f_ctap_options_parse(softu2f_cbor_reader *reader, bool *rk, bool *up, bool *uv);
+
+// Get the CTAP2 status for a reader's state.
+uint8_t softu2f_ctap_reader_status(softu2f_cbor_reader *reader);
+
+// Make the scheduled calls that are due.
+void softu2f_calls_run(softu2f_ctx *ctx);
+
+// Make every scheduled call now, as the device goes away, and refuse new
+// ones.
+void softu2f_calls_close(softu2f_ctx *ctx);
+
 // Create a new message and add it to the list.
-softu2f_hid_message *softu2f_hid_msg_list_create(softu2f_ctx *ctx);
+softu2f_hid_message *softu2f_hid_msg_list_create(softu2f_ctx *ctx, uint32_t cid);
 
 // Find a message with the given cid.
 softu2f_hid_message *softu2f_hid_msg_list_find(softu2f_ctx *ctx, uint32_t cid);
@@ -70,6 +971,9 @@ unsigned int softu2f_hid_msg_list_count(softu2f_ctx *ctx);
 // Remove a message from the list and free it.
 void softu2f_hid_msg_list_remove(softu2f_ctx *ctx, softu2f_hid_message *msg);
 
+// Remove a message from the list without freeing it.
+void softu2f_hid_msg_list_unlink(softu2f_ctx *ctx, softu2f_hid_message *msg);
+
 // Allocate memory for a new message.
 softu2f_hid_message *softu2f_hid_msg_alloc(softu2f_ctx *ctx);
 
@@ -82,8 +986,209 @@ bool softu2f_hid_msg_is_complete(softu2f_ctx *ctx, softu2f_hid_message *msg);
 // Initialize the message's data with the contents of its read buffer.
 void softu2f_hid_msg_finalize(softu2f_ctx *ctx, softu2f_hid_message *msg);
 
+// Free a message's data and return it to the engine's pool.
+void softu2f_hid_msg_release(softu2f_ctx *ctx, softu2f_hid_message *msg);
+
 // Free a HID message and associated data.
-void softu2f_hid_msg_free(softu2f_hid_message *msg);
+void softu2f_hid_msg_free(softu2f_engine *engine, softu2f_hid_message *msg);
+
+// Map shared memory for workers. Creates it if nworkers is non-zero.
+softu2f_workers *softu2f_workers_map(const char *name, uint16_t rpt_size, unsigned int nworkers);
+
+// Unmap worker shared memory, removing it if this is the front process.
+void softu2f_workers_unmap(softu2f_workers *workers);
+
+// Find a worker's slot in shared memory.
+softu2f_worker_slot *softu2f_workers_slot(softu2f_workers_shm *shm, unsigned int index);
+
+// Find a request in a worker's request ring.
+softu2f_worker_req *softu2f_workers_req(softu2f_workers_shm *shm, softu2f_worker_slot *slot, uint32_t index);
+
+// Find a frame in a worker's response ring.
+U2FHID_FRAME *softu2f_workers_frame(softu2f_workers_shm *shm, softu2f_worker_slot *slot, uint32_t index);
+
+// Queue a U2F message for the worker with the message's CID.
+bool softu2f_workers_dispatch(softu2f_ctx *ctx, softu2f_hid_message *msg);
+
+// Forward frames workers have responded with. Run on its own thread.
+void *softu2f_workers_thread(void *arg);
+
+// Queue frames a worker has responded with to go out with the device's other
+// responses. Returns whether there were any.
+bool softu2f_workers_collect(softu2f_ctx *ctx, softu2f_worker_slot *slot);
+
+// Fail requests queued for a dead worker and free its slot.
+void softu2f_workers_reap(softu2f_ctx *ctx, softu2f_worker_slot *slot);
+
+// Queue a frame for the front process to send. Waits while the ring is full.
+bool softu2f_worker_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Check if the front process a worker serves has gone away.
+bool softu2f_worker_front_gone(softu2f_workers *workers);
+
+// Free a signer connection.
+void softu2f_signer_free(softu2f_signer *signer);
+
+// Queue a U2F request for the signing daemon. It's answered when the signer
+// responds, and has a deadline and KEEPALIVEs like any deferred request.
+void softu2f_hid_msg_handle_signer(softu2f_ctx *ctx, softu2f_hid_pending *pending, softu2f_hid_message *req, void *info);
+
+// Forget a signer request the channel gave up on, such as one past its
+// deadline. The signer's answer is dropped when it comes.
+void softu2f_signer_cancelled(softu2f_ctx *ctx, void *info);
+
+// Write queued requests to the signing daemon without blocking. Whatever the
+// socket can't take yet is written on a later pass.
+void softu2f_signer_flush(softu2f_ctx *ctx);
+
+// Read responses from the signing daemon. Run on its own thread.
+void *softu2f_signer_thread(void *arg);
+
+// Send responses read from the signing daemon to their channels.
+void softu2f_signer_complete(softu2f_ctx *ctx);
+
+// Find a channel's oldest outstanding signer request. Returns -1 if there is
+// none.
+int softu2f_signer_pending_find(softu2f_signer *signer, uint32_t cid);
+
+// Find the oldest signer request nobody is waiting for. Returns -1 if there is
+// none.
+int softu2f_signer_abandoned_find(softu2f_signer *signer);
+
+// Remove an outstanding signer request, keeping the rest in order.
+void softu2f_signer_pending_remove(softu2f_signer *signer, unsigned int index);
+
+// Create a device exported over USB/IP, listening on addr and port for hosts
+// unless one is already connected on host_fd.
+softu2f_ctx *softu2f_usbip_create(softu2f_init_flags flags, const char *addr, uint16_t port, int host_fd);
+
+// Stop exporting a device over USB/IP.
+void softu2f_usbip_stop(softu2f_ctx *ctx);
+
+// Free a USB/IP server.
+void softu2f_usbip_free(softu2f_usbip *usbip);
+
+// Accept USB/IP hosts one at a time. Run on its own thread.
+void *softu2f_usbip_thread(void *arg);
+
+// Serve a connected USB/IP host, closing the connection when it's done.
+void softu2f_usbip_connection(softu2f_ctx *ctx, int fd);
+
+// Serve one USB/IP host connection until it closes.
+void softu2f_usbip_serve(softu2f_ctx *ctx, int fd);
+
+// Answer a USB/IP device list or import request. Returns true once the host
+// has imported the device.
+bool softu2f_usbip_op(softu2f_ctx *ctx, int fd);
+
+// Write the USB/IP description of the exported device.
+void softu2f_usbip_device_put(uint8_t *p);
+
+// Handle complete URBs read from the host. Returns false if the host sent
+// something we can't handle.
+bool softu2f_usbip_urbs(softu2f_ctx *ctx);
+
+// Answer a control transfer on endpoint 0. data is NULL for IN transfers.
+void softu2f_usbip_control(softu2f_ctx *ctx, uint32_t seqnum, uint8_t *setup, uint8_t *data, uint32_t len);
+
+// Handle an IN URB on the interrupt endpoint.
+void softu2f_usbip_in(softu2f_ctx *ctx, uint32_t seqnum);
+
+// Handle an OUT URB on the interrupt endpoint.
+void softu2f_usbip_out(softu2f_ctx *ctx, uint32_t seqnum, uint8_t *data, uint32_t len);
+
+// Unlink a queued IN URB.
+void softu2f_usbip_unlink(softu2f_ctx *ctx, uint32_t seqnum, uint32_t unlink_seqnum);
+
+// Queue a URB completion. data may be NULL for OUT transfers.
+void softu2f_usbip_ret_submit(softu2f_usbip *usbip, uint32_t seqnum, int32_t status, uint32_t len, const uint8_t *data);
+
+// Write queued completions to the host.
+void softu2f_usbip_flush(softu2f_ctx *ctx);
+
+// Send a frame to the host on the next IN URB.
+bool softu2f_usbip_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Whether the host is waiting for a frame, or would get one right away.
+bool softu2f_usbip_send_ready(softu2f_ctx *ctx);
+
+// Build a string descriptor. Returns its length, or 0 if there is none.
+uint32_t softu2f_usbip_string(uint8_t index, uint8_t *buf);
+
+// Read exactly len bytes from a socket.
+bool softu2f_usbip_read(int fd, uint8_t *buf, size_t len);
+
+// Write exactly len bytes to a socket.
+bool softu2f_usbip_write(int fd, const uint8_t *buf, size_t len);
+
+// Create a simulated device and add it to the engine.
+softu2f_ctx *softu2f_sim_device_create(softu2f_sim *sim, softu2f_engine *engine);
+
+// Schedule an event. A copy of frame is kept, if there is one.
+bool softu2f_sim_schedule(softu2f_sim *sim, double time, uint8_t type, unsigned int client, const void *frame);
+
+// Take the earliest event.
+bool softu2f_sim_next(softu2f_sim *sim, softu2f_sim_event *event);
+
+// Handle an event.
+void softu2f_sim_event_handle(softu2f_sim *sim, softu2f_sim_event *event);
+
+// Send a client's oldest waiting request.
+void softu2f_sim_client_send(softu2f_sim *sim, unsigned int index, double time);
+
+// Read a response frame on a client.
+void softu2f_sim_client_read(softu2f_sim *sim, unsigned int index, U2FHID_FRAME *frame, double time);
+
+// Copy part of an answer into the result, as far as it fits.
+void softu2f_sim_reply_copy(softu2f_sim_result *result, unsigned int off, const uint8_t *data, unsigned int len);
+
+// Finish a client's request and send the next one.
+void softu2f_sim_client_done(softu2f_sim *sim, unsigned int index, double time, bool error);
+
+// Whether anything is still going on in the simulation.
+bool softu2f_sim_busy(softu2f_sim *sim);
+
+// Answer a request after the configured service time.
+bool softu2f_sim_handle(softu2f_ctx *ctx, softu2f_hid_message *req);
+
+// Defer a request, to be answered after the configured service time.
+void softu2f_sim_handle_async(softu2f_ctx *ctx, softu2f_hid_pending *pending, softu2f_hid_message *req, void *info);
+
+// Send a frame out of a simulated device.
+bool softu2f_sim_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame);
+
+// Read the simulated clock.
+double softu2f_sim_clock_now(void *info);
+
+// Advance the simulated clock.
+void softu2f_sim_clock_sleep(void *info, double seconds);
+
+// Schedule the device to send its next queued frame or make a scheduled call.
+void softu2f_sim_wake(softu2f_ctx *ctx, double seconds);
+
+// Get a random number in (0, 1].
+double softu2f_sim_random(softu2f_sim *sim);
+
+// Create an allocator that counts allocations into a simulation's result.
+CFAllocatorRef softu2f_sim_allocator_create(softu2f_sim_result *result);
+
+// Allocate memory, counting it.
+void *softu2f_sim_allocate(CFIndex size, CFOptionFlags hint, void *info);
+
+// Resize memory, counting it as a new allocation.
+void *softu2f_sim_reallocate(void *ptr, CFIndex size, CFOptionFlags hint, void *info);
+
+// Free memory, counting it.
+void softu2f_sim_deallocate(void *ptr, void *info);
+
+// Read a big-endian 32 bit value.
+uint32_t softu2f_be32_get(const uint8_t *p);
+
+// Write a big-endian 32 bit value.
+void softu2f_be32_put(uint8_t *p, uint32_t value);
+
+// Write a big-endian 16 bit value.
+void softu2f_be16_put(uint8_t *p, uint16_t value);
 
 // Log a message if logging is enabled.
 void softu2f_log(softu2f_ctx *ctx, char *fmt, ...);
@@ -97,4 +1202,8 @@ void softu2f_async_callback(void *refcon, IOReturn result, io_user_reference_t*
 // Called periodically in our runloop.
 void softu2f_async_timer_callback(CFRunLoopTimerRef timer, void* info);
 
+// Fire the run loop's timer after the given seconds, if it would fire later.
+// Returns false if the run loop isn't running.
+bool softu2f_async_timer_wake(softu2f_engine *engine, double seconds);
+
 #endif /* internal_h */
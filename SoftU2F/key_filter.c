@@ -0,0 +1,126 @@
+//
+//  key_filter.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+
+// Remember a key handle the device issued for an application.
+bool softu2f_key_handle_add(softu2f_ctx *ctx, const uint8_t *app_id, const uint8_t *key_handle, uint8_t key_handle_len) {
+  uint64_t hash = softu2f_key_filter_hash(app_id, key_handle, key_handle_len);
+  uint32_t bit;
+  unsigned int i;
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+
+  if (!ctx->key_filter) {
+    ctx->key_filter = (uint8_t *)calloc(SOFTU2F_KEY_FILTER_BITS / 8, 1);
+    if (!ctx->key_filter) {
+      softu2f_log(ctx, "No memory for key handle filter.\n");
+      pthread_mutex_unlock(&ctx->engine->mutex);
+      return false;
+    }
+  }
+
+  for (i = 0; i < SOFTU2F_KEY_FILTER_HASHES; i++) {
+    bit = softu2f_key_filter_bit(hash, i);
+    ctx->key_filter[bit / 8] |= 1 << (bit % 8);
+  }
+
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  return true;
+}
+
+// Forget all key handles.
+void softu2f_key_handle_clear(softu2f_ctx *ctx) {
+  pthread_mutex_lock(&ctx->engine->mutex);
+
+  if (ctx->key_filter) {
+    free(ctx->key_filter);
+    ctx->key_filter = NULL;
+  }
+
+  pthread_mutex_unlock(&ctx->engine->mutex);
+}
+
+// Answer a check-only AUTHENTICATE for a key handle the device didn't issue.
+bool softu2f_key_filter_check(softu2f_ctx *ctx, softu2f_hid_message *msg) {
+  const uint8_t *apdu = CFDataGetBytePtr(msg->data);
+  CFIndex len = CFDataGetLength(msg->data);
+  const U2F_AUTHENTICATE_REQ *req;
+  softu2f_hid_response *resp;
+  uint64_t hash;
+  CFIndex lc, off;
+  unsigned int i;
+  uint32_t bit;
+
+  // CLA INS P1 P2, then a short or extended Lc.
+  if (len < 5 || apdu[1] != U2F_AUTHENTICATE || apdu[2] != U2F_AUTH_CHECK_ONLY)
+    return false;
+
+  if (apdu[4]) {
+    lc = apdu[4];
+    off = 5;
+  } else {
+    if (len < 7)
+      return false;
+    lc = (CFIndex)apdu[5] << 8 | apdu[6];
+    off = 7;
+  }
+
+  // Leave malformed requests to the handler.
+  req = (const U2F_AUTHENTICATE_REQ *)(apdu + off);
+  if (lc > len - off || lc < U2F_CHAL_SIZE + U2F_APPID_SIZE + 1 || req->keyHandleLen > lc - (U2F_CHAL_SIZE + U2F_APPID_SIZE + 1))
+    return false;
+
+  hash = softu2f_key_filter_hash(req->appId, req->keyHandle, req->keyHandleLen);
+
+  for (i = 0; i < SOFTU2F_KEY_FILTER_HASHES; i++) {
+    bit = softu2f_key_filter_bit(hash, i);
+    if (!(ctx->key_filter[bit / 8] & (1 << (bit % 8))))
+      break;
+  }
+
+  // Might be ours.
+  if (i == SOFTU2F_KEY_FILTER_HASHES)
+    return false;
+
+  ctx->stats.probes_rejected++;
+
+  resp = softu2f_hid_resp_start(ctx, msg->cid, U2FHID_MSG);
+  if (!resp)
+    return false;
+
+  softu2f_hid_resp_append_u16(resp, U2F_SW_WRONG_DATA);
+  softu2f_hid_resp_send(ctx, resp);
+
+  return true;
+}
+
+// Hash an application ID and key handle (64 bit FNV-1a).
+uint64_t softu2f_key_filter_hash(const uint8_t *app_id, const uint8_t *key_handle, uint8_t key_handle_len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  unsigned int i;
+
+  for (i = 0; i < U2F_APPID_SIZE; i++) {
+    hash = (hash ^ app_id[i]) * 0x100000001b3ULL;
+  }
+
+  for (i = 0; i < key_handle_len; i++) {
+    hash = (hash ^ key_handle[i]) * 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+// Find the filter bit for one of a hash's probes.
+uint32_t softu2f_key_filter_bit(uint64_t hash, unsigned int probe) {
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+  return (h1 + probe * h2) & (SOFTU2F_KEY_FILTER_BITS - 1);
+}
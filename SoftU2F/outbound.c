@@ -0,0 +1,300 @@
+//
+//  outbound.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+
+// Take a free stream to queue a response in. If every stream is busy, queued
+// frames are sent now, paced, until one is done. Returns NULL if the
+// transport can't take them.
+softu2f_hid_stream *softu2f_hid_out_take(softu2f_ctx *ctx) {
+  softu2f_hid_stream *stream;
+
+  if (!ctx->out_free)
+    ctx->stats.out_overflows++;
+
+  while (!ctx->out_free) {
+    if (!softu2f_hid_out_next(ctx, true)) {
+      softu2f_log(ctx, "No room to queue a response.\n");
+      return NULL;
+    }
+  }
+
+  stream = ctx->out_free;
+
+  // Frames are allocated the first time a stream is used and kept after,
+  // through the engine's allocator so they can be counted.
+  if (!stream->frames) {
+    stream->frames = (uint8_t *)CFAllocatorAllocate(ctx->engine->allocator, SOFTU2F_MAX_FRAMES * ctx->layout.rpt_size, 0);
+    if (!stream->frames) {
+      softu2f_log(ctx, "No memory for outbound frames.\n");
+      return NULL;
+    }
+
+    memset(stream->frames, 0, SOFTU2F_MAX_FRAMES * ctx->layout.rpt_size);
+  }
+
+  ctx->out_free = stream->next;
+  stream->next = NULL;
+  stream->waiting = NULL;
+  stream->sent = 0;
+  stream->open = false;
+
+  return stream;
+}
+
+// Queue the INIT frame of a response whose CONT frames will follow with
+// softu2f_hid_out_extend as they become available, such as a streamed PING
+// echo. Each frame goes out once it has been added and its turn comes.
+bool softu2f_hid_out_open(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  softu2f_hid_stream *stream;
+  unsigned int len = MSG_LEN(*frame);
+
+  if (len > ctx->layout.max_msg)
+    return false;
+
+  stream = softu2f_hid_out_take(ctx);
+  if (!stream)
+    return false;
+
+  stream->total = 1;
+  if (len > ctx->layout.init_payload)
+    stream->total += (len - ctx->layout.init_payload + ctx->layout.cont_payload - 1) / ctx->layout.cont_payload;
+
+  stream->open = stream->total > 1;
+
+  memcpy(stream->frames, frame, ctx->layout.rpt_size);
+  softu2f_hid_out_queue(ctx, stream, 1);
+
+  return true;
+}
+
+// Add the next CONT frame to a channel's open response. Returns false if the
+// channel has none.
+bool softu2f_hid_out_extend(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  softu2f_hid_stream *stream;
+  bool idle;
+
+  stream = softu2f_hid_out_find_open(ctx, frame->cid);
+  if (!stream)
+    return false;
+
+  // A stream that has sent everything it had is in no queue.
+  idle = stream->sent == stream->nframes;
+
+  memcpy(SOFTU2F_FRAME_AT(stream->frames, stream->nframes, ctx->layout.rpt_size), frame, ctx->layout.rpt_size);
+  if (++stream->nframes == stream->total)
+    stream->open = false;
+
+  if (idle) {
+    softu2f_hid_out_append(ctx, stream);
+    softu2f_hid_out_pump(ctx);
+  }
+
+  return true;
+}
+
+// Cut a channel's open response short, sending what it has. Responses queued
+// behind it go out after, the next time the queue is pumped.
+void softu2f_hid_out_close(softu2f_ctx *ctx, uint32_t cid) {
+  softu2f_hid_stream *stream;
+
+  stream = softu2f_hid_out_find_open(ctx, cid);
+  if (!stream)
+    return;
+
+  stream->open = false;
+
+  if (stream->sent == stream->nframes)
+    softu2f_hid_out_release(ctx, stream);
+}
+
+// Find a channel's open response.
+softu2f_hid_stream *softu2f_hid_out_find_open(softu2f_ctx *ctx, uint32_t cid) {
+  unsigned int i;
+
+  for (i = 0; i < SOFTU2F_OUT_STREAMS; i++) {
+    if (ctx->streams[i].nframes && ctx->streams[i].open && ctx->streams[i].cid == cid)
+      return &ctx->streams[i];
+  }
+
+  return NULL;
+}
+
+// Queue a response whose frames have been written to a stream, and send what
+// can be sent now. Responses on a channel go out in the order they're queued.
+void softu2f_hid_out_queue(softu2f_ctx *ctx, softu2f_hid_stream *stream, unsigned int nframes) {
+  U2FHID_FRAME *frame = SOFTU2F_FRAME_AT(stream->frames, 0, ctx->layout.rpt_size);
+  softu2f_hid_stream *other;
+  unsigned int i;
+
+  stream->cid = frame->cid;
+  stream->cls = softu2f_hid_out_class(frame->init.cmd);
+  stream->nframes = nframes;
+
+  // Queue behind a response already going out on this channel.
+  for (i = 0; i < SOFTU2F_OUT_STREAMS; i++) {
+    other = &ctx->streams[i];
+    if (other == stream || other->nframes == 0 || other->cid != stream->cid)
+      continue;
+
+    while (other->waiting) {
+      other = other->waiting;
+    }
+
+    other->waiting = stream;
+    softu2f_hid_out_pump(ctx);
+    return;
+  }
+
+  softu2f_hid_out_append(ctx, stream);
+  softu2f_hid_out_pump(ctx);
+}
+
+// Add a stream to the back of its class's queue.
+void softu2f_hid_out_append(softu2f_ctx *ctx, softu2f_hid_stream *stream) {
+  stream->next = NULL;
+
+  if (ctx->out_tail[stream->cls])
+    ctx->out_tail[stream->cls]->next = stream;
+  else
+    ctx->out_queue[stream->cls] = stream;
+
+  ctx->out_tail[stream->cls] = stream;
+}
+
+// Get the priority class of a response.
+uint8_t softu2f_hid_out_class(uint8_t cmd) {
+  switch (cmd) {
+  case U2FHID_ERROR:
+    return SOFTU2F_OUT_ERROR;
+  case U2FHID_KEEPALIVE:
+    return SOFTU2F_OUT_KEEPALIVE;
+  case U2FHID_INIT:
+  case U2FHID_SYNC:
+  case U2FHID_LOCK:
+  case U2FHID_WINK:
+    return SOFTU2F_OUT_CONTROL;
+  default:
+    return SOFTU2F_OUT_BULK;
+  }
+}
+
+// Send queued frames as long as the transport can take them.
+void softu2f_hid_out_pump(softu2f_ctx *ctx) {
+  while (softu2f_hid_out_next(ctx, false))
+    ;
+}
+
+// Send the next queued frame. It comes from the most urgent class with
+// anything queued, taking turns between the channels in it. If it isn't time
+// for it yet, waits when told to or when nothing will call us back. Returns
+// false if nothing was sent.
+bool softu2f_hid_out_next(softu2f_ctx *ctx, bool wait) {
+  softu2f_hid_stream *stream;
+  double now;
+  uint8_t cls;
+
+restart:
+  for (cls = 0; cls < SOFTU2F_OUT_CLASSES && !ctx->out_queue[cls]; cls++)
+    ;
+
+  if (cls == SOFTU2F_OUT_CLASSES)
+    return false;
+
+  if (ctx->send_ready && !ctx->send_ready(ctx))
+    return false;
+
+  now = softu2f_time_now(ctx);
+  if (now < ctx->out_next) {
+    if (!wait && softu2f_hid_out_wake(ctx, ctx->out_next - now))
+      return false;
+
+    softu2f_time_sleep(ctx, &softu2f_poll_interval);
+    goto restart;
+  }
+
+  stream = ctx->out_queue[cls];
+  ctx->out_queue[cls] = stream->next;
+  if (!ctx->out_queue[cls])
+    ctx->out_tail[cls] = NULL;
+
+  ctx->out_next = now + ctx->out_interval;
+
+  if (!softu2f_hid_frame_send(ctx, SOFTU2F_FRAME_AT(stream->frames, stream->sent, ctx->layout.rpt_size))) {
+    softu2f_log(ctx, "Dropping response on CID: 0x%08x\n", stream->cid);
+    stream->open = false;
+    softu2f_hid_out_release(ctx, stream);
+    return true;
+  }
+
+  // An open stream that has sent everything it has waits for more frames.
+  if (++stream->sent < stream->nframes)
+    softu2f_hid_out_append(ctx, stream);
+  else if (!stream->open)
+    softu2f_hid_out_release(ctx, stream);
+
+  return true;
+}
+
+// Free a stream that is done, starting the next response on its channel.
+void softu2f_hid_out_release(softu2f_ctx *ctx, softu2f_hid_stream *stream) {
+  if (stream->waiting)
+    softu2f_hid_out_append(ctx, stream->waiting);
+
+  stream->nframes = 0;
+  stream->waiting = NULL;
+  stream->next = ctx->out_free;
+  ctx->out_free = stream;
+}
+
+// Have softu2f_hid_handle_messages called again after the given seconds, so
+// the rest of the queue goes out. Returns false if nothing will call it.
+bool softu2f_hid_out_wake(softu2f_ctx *ctx, double seconds) {
+  if (ctx->wake) {
+    ctx->wake(ctx, seconds);
+    return true;
+  }
+
+  return softu2f_async_timer_wake(ctx->engine, seconds);
+}
+
+// Set a device's outbound streams up, all of them free.
+void softu2f_hid_out_init(softu2f_ctx *ctx) {
+  unsigned int i;
+
+  for (i = 0; i < SOFTU2F_OUT_STREAMS; i++) {
+    ctx->streams[i].next = ctx->out_free;
+    ctx->out_free = &ctx->streams[i];
+  }
+
+  ctx->out_interval = softu2f_poll_interval.tv_sec + softu2f_poll_interval.tv_nsec / 1000000000.0;
+}
+
+// Free a device's outbound frames. Anything still queued is dropped.
+void softu2f_hid_out_free(softu2f_ctx *ctx) {
+  unsigned int i;
+
+  for (i = 0; i < SOFTU2F_OUT_STREAMS; i++) {
+    if (ctx->streams[i].frames)
+      CFAllocatorDeallocate(ctx->engine->allocator, ctx->streams[i].frames);
+  }
+}
+
+// Send a single frame response, queued like any other.
+bool softu2f_hid_out_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  softu2f_hid_stream *stream;
+
+  stream = softu2f_hid_out_take(ctx);
+  if (!stream)
+    return false;
+
+  memcpy(stream->frames, frame, ctx->layout.rpt_size);
+  softu2f_hid_out_queue(ctx, stream, 1);
+
+  return true;
+}
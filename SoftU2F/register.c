@@ -0,0 +1,148 @@
+//
+//  register.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+#include <CommonCrypto/CommonDigest.h>
+
+// Set the attestation certificate included in REGISTER responses.
+bool softu2f_attestation_cert_set(softu2f_ctx *ctx, const uint8_t *cert, size_t len) {
+  uint8_t *copy;
+
+  if (!softu2f_der_cert_valid(cert, len)) {
+    softu2f_log(ctx, "Invalid attestation certificate.\n");
+    return false;
+  }
+
+  copy = (uint8_t *)malloc(len);
+  if (!copy) {
+    softu2f_log(ctx, "No memory for attestation certificate.\n");
+    return false;
+  }
+
+  memcpy(copy, cert, len);
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+
+  if (ctx->att_cert)
+    free(ctx->att_cert);
+
+  ctx->att_cert = copy;
+  ctx->att_cert_len = (uint16_t)len;
+
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  return true;
+}
+
+// Hash the data a REGISTER signature covers.
+void softu2f_register_digest(const uint8_t *app_id, const uint8_t *chal, const uint8_t *key_handle, uint8_t key_handle_len, const uint8_t *pub_key, uint8_t *digest) {
+  uint8_t hash_id = U2F_REGISTER_HASH_ID;
+  CC_SHA256_CTX sha;
+
+  // Hashed field by field, without copying them together first.
+  CC_SHA256_Init(&sha);
+  CC_SHA256_Update(&sha, &hash_id, 1);
+  CC_SHA256_Update(&sha, app_id, U2F_APPID_SIZE);
+  CC_SHA256_Update(&sha, chal, U2F_CHAL_SIZE);
+  CC_SHA256_Update(&sha, key_handle, key_handle_len);
+  CC_SHA256_Update(&sha, pub_key, U2F_EC_POINT_SIZE);
+  CC_SHA256_Final(digest, &sha);
+}
+
+// Send a successful REGISTER response.
+bool softu2f_register_resp_send(softu2f_ctx *ctx, uint32_t cid, const uint8_t *pub_key, const uint8_t *key_handle, uint8_t key_handle_len, const uint8_t *sig, size_t sig_len) {
+  softu2f_hid_response *resp;
+  bool ret = false;
+
+  if (pub_key[0] != U2F_POINT_UNCOMPRESSED || key_handle_len > U2F_MAX_KH_SIZE || sig_len > U2F_MAX_EC_SIG_SIZE) {
+    softu2f_log(ctx, "Invalid REGISTER response fields.\n");
+    return false;
+  }
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+
+  if (!ctx->att_cert) {
+    softu2f_log(ctx, "No attestation certificate set.\n");
+    goto done;
+  }
+
+  resp = softu2f_hid_resp_start(ctx, cid, U2FHID_MSG);
+  if (!resp)
+    goto done;
+
+  // The certificate is copied straight from the validated copy into frames.
+  softu2f_hid_resp_append_byte(resp, U2F_REGISTER_ID);
+  softu2f_hid_resp_append(resp, pub_key, U2F_EC_POINT_SIZE);
+  softu2f_hid_resp_append_byte(resp, key_handle_len);
+  softu2f_hid_resp_append(resp, key_handle, key_handle_len);
+  softu2f_hid_resp_append(resp, ctx->att_cert, ctx->att_cert_len);
+  softu2f_hid_resp_append(resp, sig, sig_len);
+
+  if (!softu2f_hid_resp_append_u16(resp, U2F_SW_NO_ERROR)) {
+    softu2f_log(ctx, "REGISTER response too large.\n");
+    softu2f_hid_resp_discard(ctx, resp);
+    goto done;
+  }
+
+  ret = softu2f_hid_resp_send(ctx, resp);
+
+done:
+  pthread_mutex_unlock(&ctx->engine->mutex);
+  return ret;
+}
+
+// Check that a certificate is a single DER SEQUENCE of a TBSCertificate
+// SEQUENCE, an AlgorithmIdentifier SEQUENCE and a signature BIT STRING.
+// Clients find where the signature starts from its outer length.
+bool softu2f_der_cert_valid(const uint8_t *cert, size_t len) {
+  size_t hdr, body, off;
+
+  if (len > U2F_MAX_ATT_CERT_SIZE)
+    return false;
+
+  if (!softu2f_der_read(cert, len, 0x30, &hdr, &body) || hdr + body != len)
+    return false;
+
+  off = hdr;
+
+  if (!softu2f_der_read(cert + off, len - off, 0x30, &hdr, &body))
+    return false;
+  off += hdr + body;
+
+  if (!softu2f_der_read(cert + off, len - off, 0x30, &hdr, &body))
+    return false;
+  off += hdr + body;
+
+  if (!softu2f_der_read(cert + off, len - off, 0x03, &hdr, &body))
+    return false;
+  off += hdr + body;
+
+  return off == len;
+}
+
+// Read the header of a DER element with the given tag. Lengths are definite
+// and at most two bytes long.
+bool softu2f_der_read(const uint8_t *p, size_t len, uint8_t tag, size_t *hdr, size_t *body) {
+  if (len < 2 || p[0] != tag)
+    return false;
+
+  if (p[1] < 0x80) {
+    *hdr = 2;
+    *body = p[1];
+  } else if (p[1] == 0x81 && len >= 3 && p[2] >= 0x80) {
+    *hdr = 3;
+    *body = p[2];
+  } else if (p[1] == 0x82 && len >= 4 && p[2] != 0) {
+    *hdr = 4;
+    *body = (size_t)p[2] << 8 | p[3];
+  } else {
+    return false;
+  }
+
+  return *body <= len - *hdr;
+}
@@ -0,0 +1,247 @@
+//
+//  retry.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+#include <CommonCrypto/CommonDigest.h>
+
+// Replay responses to U2F requests resent on the same channel within the
+// given seconds, or 0 to stop.
+void softu2f_retry_window_set(softu2f_ctx *ctx, double seconds) {
+  unsigned int i;
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+
+  ctx->retry_window = seconds;
+
+  // Forget what was cached under the old window.
+  for (i = 0; i < SOFTU2F_RETRY_ENTRIES; i++) {
+    ctx->retry[i].state = SOFTU2F_RETRY_FREE;
+  }
+
+  pthread_mutex_unlock(&ctx->engine->mutex);
+}
+
+// Answer a U2F request from the retry cache if it repeats the last one on its
+// channel. Otherwise, note the request so its response can be cached. Returns
+// true if the request was answered.
+bool softu2f_retry_check(softu2f_ctx *ctx, softu2f_hid_message *msg) {
+  uint8_t hash[CC_SHA256_DIGEST_LENGTH];
+  softu2f_retry_entry *entry;
+  softu2f_hid_response *resp;
+  double now;
+
+  if (ctx->retry_window <= 0 || msg->cmd != U2FHID_MSG)
+    return false;
+
+  now = softu2f_time_now(ctx);
+
+  // Requests that completed together were hashed together.
+  if (msg->hashed)
+    memcpy(hash, msg->hash, sizeof(hash));
+  else
+    CC_SHA256(CFDataGetBytePtr(msg->data), (CC_LONG)CFDataGetLength(msg->data), hash);
+
+  entry = softu2f_retry_find(ctx, msg->cid);
+  if (entry && entry->state == SOFTU2F_RETRY_STORED && now < entry->expires && !memcmp(entry->hash, hash, sizeof(hash))) {
+    resp = softu2f_hid_resp_start(ctx, msg->cid, U2FHID_MSG);
+    if (!resp)
+      return false;
+
+    if (!softu2f_hid_resp_append(resp, entry->data, entry->len)) {
+      softu2f_hid_resp_discard(ctx, resp);
+      return false;
+    }
+
+    softu2f_log(ctx, "Replaying cached response on CID: 0x%08x\n", msg->cid);
+    ctx->stats.retries_replayed++;
+    softu2f_hid_resp_send(ctx, resp);
+    return true;
+  }
+
+  // A different request replaces whatever the channel had cached.
+  if (!softu2f_retry_cacheable(msg)) {
+    if (entry)
+      entry->state = SOFTU2F_RETRY_FREE;
+    return false;
+  }
+
+  if (!entry)
+    entry = softu2f_retry_evict(ctx);
+
+  entry->cid = msg->cid;
+  entry->state = SOFTU2F_RETRY_ARMED;
+  entry->expires = now;
+  memcpy(entry->hash, hash, sizeof(hash));
+
+  return false;
+}
+
+// Hash the U2F requests waiting to be handled, all at once, so they can be
+// looked up in the retry cache.
+void softu2f_retry_hash_ready(softu2f_ctx *ctx) {
+  softu2f_sha256_job jobs[SOFTU2F_SHA256_LANES];
+  softu2f_hid_message *msg;
+  size_t count = 0;
+
+  if (ctx->retry_window <= 0 || ctx->workers)
+    return;
+
+  for (msg = ctx->ready_list; msg; msg = msg->next) {
+    if (msg->cmd != U2FHID_MSG || msg->hashed)
+      continue;
+
+    jobs[count].data = CFDataGetBytePtr(msg->buf);
+    jobs[count].len = CFDataGetLength(msg->buf);
+    jobs[count].digest = msg->hash;
+    msg->hashed = true;
+
+    if (++count == SOFTU2F_SHA256_LANES) {
+      softu2f_sha256_batch(jobs, count);
+      count = 0;
+    }
+  }
+
+  if (count)
+    softu2f_sha256_batch(jobs, count);
+}
+
+// Whether the response to a U2F request may be replayed. REGISTER and signing
+// AUTHENTICATEs are cached: a replay hands the client the key or signature
+// made for that exact challenge instead of making another, so the counter
+// only moves once. Check-only AUTHENTICATEs, VERSION and vendor commands are
+// cheap and not cached.
+bool softu2f_retry_cacheable(softu2f_hid_message *msg) {
+  const uint8_t *apdu = CFDataGetBytePtr(msg->data);
+
+  // CLA INS P1 P2, then Lc.
+  if (CFDataGetLength(msg->data) < 5)
+    return false;
+
+  switch (apdu[1]) {
+  case U2F_REGISTER:
+    return true;
+  case U2F_AUTHENTICATE:
+    return apdu[2] == U2F_AUTH_ENFORCE || apdu[2] == U2F_AUTH_DONT_ENFORCE;
+  default:
+    return false;
+  }
+}
+
+// Cache a response built with softu2f_hid_resp_start, if its channel is
+// waiting for one.
+void softu2f_retry_store_resp(softu2f_ctx *ctx, softu2f_hid_response *resp) {
+  softu2f_retry_entry *entry;
+  unsigned int avail, n;
+  uint16_t offset;
+  uint8_t *src;
+
+  entry = softu2f_retry_waiting(ctx, resp->cid, resp->cmd);
+  if (!entry)
+    return;
+
+  for (offset = 0; offset < resp->len; offset += n) {
+    src = softu2f_hid_resp_payload(resp, offset, &avail);
+    n = resp->len - offset < avail ? resp->len - offset : avail;
+    memcpy(entry->data + offset, src, n);
+  }
+
+  softu2f_retry_stored(ctx, entry, resp->len);
+}
+
+// Cache a response sent with softu2f_hid_msg_send, if its channel is waiting
+// for one.
+void softu2f_retry_store_msg(softu2f_ctx *ctx, softu2f_hid_message *msg) {
+  softu2f_retry_entry *entry;
+  CFIndex len = CFDataGetLength(msg->data);
+
+  entry = softu2f_retry_waiting(ctx, msg->cid, msg->cmd);
+  if (!entry || len > ctx->layout.max_msg)
+    return;
+
+  memcpy(entry->data, CFDataGetBytePtr(msg->data), len);
+  softu2f_retry_stored(ctx, entry, (uint16_t)len);
+}
+
+// Get the entry of a channel waiting for a U2F response, with room for the
+// response. Returns NULL if the response isn't to be cached.
+softu2f_retry_entry *softu2f_retry_waiting(softu2f_ctx *ctx, uint32_t cid, uint8_t cmd) {
+  softu2f_retry_entry *entry;
+
+  if (ctx->retry_window <= 0 || cmd != U2FHID_MSG)
+    return NULL;
+
+  entry = softu2f_retry_find(ctx, cid);
+  if (!entry || entry->state != SOFTU2F_RETRY_ARMED)
+    return NULL;
+
+  // Only the first response to a request is cached.
+  entry->state = SOFTU2F_RETRY_FREE;
+
+  // The buffer is allocated the first time an entry is used and kept after,
+  // through the engine's allocator so it can be counted.
+  if (!entry->data) {
+    entry->data = (uint8_t *)CFAllocatorAllocate(ctx->engine->allocator, ctx->layout.max_msg, 0);
+    if (!entry->data) {
+      softu2f_log(ctx, "No memory for cached response.\n");
+      return NULL;
+    }
+  }
+
+  return entry;
+}
+
+// Keep a response copied into an entry if it succeeded. Anything else, such
+// as a missing test of user presence, has to be retried for real.
+void softu2f_retry_stored(softu2f_ctx *ctx, softu2f_retry_entry *entry, uint16_t len) {
+  // The status word ends the response.
+  if (len < 2 || (entry->data[len - 2] << 8 | entry->data[len - 1]) != U2F_SW_NO_ERROR)
+    return;
+
+  entry->len = len;
+  entry->expires = softu2f_time_now(ctx) + ctx->retry_window;
+  entry->state = SOFTU2F_RETRY_STORED;
+}
+
+// Find a channel's retry cache entry.
+softu2f_retry_entry *softu2f_retry_find(softu2f_ctx *ctx, uint32_t cid) {
+  unsigned int i;
+
+  for (i = 0; i < SOFTU2F_RETRY_ENTRIES; i++) {
+    if (ctx->retry[i].state != SOFTU2F_RETRY_FREE && ctx->retry[i].cid == cid)
+      return &ctx->retry[i];
+  }
+
+  return NULL;
+}
+
+// Get an entry for another channel, taking a free one or the one that
+// expires soonest.
+softu2f_retry_entry *softu2f_retry_evict(softu2f_ctx *ctx) {
+  softu2f_retry_entry *entry = &ctx->retry[0];
+  unsigned int i;
+
+  for (i = 0; i < SOFTU2F_RETRY_ENTRIES; i++) {
+    if (ctx->retry[i].state == SOFTU2F_RETRY_FREE)
+      return &ctx->retry[i];
+
+    if (ctx->retry[i].expires < entry->expires)
+      entry = &ctx->retry[i];
+  }
+
+  return entry;
+}
+
+// Free the retry cache's buffers.
+void softu2f_retry_free(softu2f_ctx *ctx) {
+  unsigned int i;
+
+  for (i = 0; i < SOFTU2F_RETRY_ENTRIES; i++) {
+    if (ctx->retry[i].data)
+      CFAllocatorDeallocate(ctx->engine->allocator, ctx->retry[i].data);
+  }
+}
@@ -0,0 +1,54 @@
+//
+//  scratch.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+
+// Allocate memory for handling a message, aligned for any type. It is all
+// freed at once when the handler returns. Returns NULL once the request's
+// SOFTU2F_SCRATCH_SIZE bytes are used up.
+void *softu2f_hid_msg_scratch(softu2f_hid_message *msg, size_t len) {
+  softu2f_scratch *scratch = msg->scratch;
+  void *ptr;
+
+  // Only messages being handled have scratch memory.
+  if (!scratch)
+    return NULL;
+
+  // The memory is allocated the first time it's used and kept after. It
+  // comes from the engine's allocator, so it can be counted.
+  if (!scratch->base) {
+    scratch->base = (uint8_t *)CFAllocatorAllocate(scratch->ctx->engine->allocator, SOFTU2F_SCRATCH_SIZE, 0);
+    if (!scratch->base) {
+      softu2f_log(scratch->ctx, "No memory for scratch space.\n");
+      return NULL;
+    }
+  }
+
+  if (len > SOFTU2F_SCRATCH_SIZE - scratch->used) {
+    softu2f_log(scratch->ctx, "Out of scratch space on CID: 0x%08x\n", msg->cid);
+    scratch->ctx->stats.scratch_refused++;
+    return NULL;
+  }
+
+  ptr = scratch->base + scratch->used;
+
+  // Keep the next allocation aligned. The size is a multiple of the
+  // alignment, so this can't pass the end.
+  scratch->used += (len + SOFTU2F_SCRATCH_ALIGN - 1) & ~(size_t)(SOFTU2F_SCRATCH_ALIGN - 1);
+
+  return ptr;
+}
+
+// Free a request's scratch memory once it has been handled.
+void softu2f_scratch_reset(softu2f_ctx *ctx, softu2f_hid_message *msg) {
+  if (ctx->scratch.used > ctx->stats.scratch_max)
+    ctx->stats.scratch_max = ctx->scratch.used;
+
+  ctx->scratch.used = 0;
+  msg->scratch = NULL;
+}
@@ -0,0 +1,159 @@
+//
+//  sha256.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+#include <CommonCrypto/CommonDigest.h>
+
+// SHA-256 round constants.
+const uint32_t softu2f_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+// SHA-256 initial hash value.
+const uint32_t softu2f_sha256_h0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                       0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+// Hash several messages at once.
+void softu2f_sha256_batch(const softu2f_sha256_job *jobs, size_t count) {
+  size_t n;
+
+  while (count > 0) {
+    n = count < SOFTU2F_SHA256_LANES ? count : SOFTU2F_SHA256_LANES;
+
+    // A lone message is faster through CommonCrypto's single-buffer code.
+    if (n == 1)
+      CC_SHA256(jobs->data, (CC_LONG)jobs->len, jobs->digest);
+    else
+      softu2f_sha256_lanes(jobs, n);
+
+    jobs += n;
+    count -= n;
+  }
+}
+
+// Hash up to SOFTU2F_SHA256_LANES messages, one per vector lane.
+void softu2f_sha256_lanes(const softu2f_sha256_job *jobs, size_t count) {
+  softu2f_u32x8 state[8], w[16], mask;
+  uint8_t block[64];
+  size_t nblocks[SOFTU2F_SHA256_LANES];
+  size_t max_blocks = 0, b, lane;
+  unsigned int i;
+
+  for (i = 0; i < 8; i++) {
+    state[i] = (softu2f_u32x8){0} + softu2f_sha256_h0[i];
+  }
+
+  for (lane = 0; lane < count; lane++) {
+    nblocks[lane] = (jobs[lane].len + 9 + 63) / 64;
+    if (nblocks[lane] > max_blocks)
+      max_blocks = nblocks[lane];
+  }
+
+  for (b = 0; b < max_blocks; b++) {
+    mask = (softu2f_u32x8){0};
+    memset(w, 0, sizeof(w));
+
+    // Lanes whose messages have run out keep their state.
+    for (lane = 0; lane < count; lane++) {
+      if (b >= nblocks[lane])
+        continue;
+
+      softu2f_sha256_block_get(jobs[lane].data, jobs[lane].len, b, block);
+
+      for (i = 0; i < 16; i++) {
+        w[i][lane] = softu2f_be32_get(block + 4 * i);
+      }
+
+      mask[lane] = 0xffffffff;
+    }
+
+    softu2f_sha256_lanes_compress(state, w, &mask);
+  }
+
+  for (lane = 0; lane < count; lane++) {
+    for (i = 0; i < 8; i++) {
+      softu2f_be32_put(jobs[lane].digest + 4 * i, state[i][lane]);
+    }
+  }
+}
+
+// Run one block through every lane whose mask is set.
+void softu2f_sha256_lanes_compress(softu2f_u32x8 *state, softu2f_u32x8 *w, const softu2f_u32x8 *mask) {
+  softu2f_u32x8 a, b, c, d, e, f, g, h, s0, s1, t1, t2;
+  unsigned int i;
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+  f = state[5];
+  g = state[6];
+  h = state[7];
+
+  for (i = 0; i < 64; i++) {
+    // Extend the message schedule in place.
+    if (i >= 16) {
+      s0 = SOFTU2F_ROTR32(w[(i + 1) & 15], 7) ^ SOFTU2F_ROTR32(w[(i + 1) & 15], 18) ^ (w[(i + 1) & 15] >> 3);
+      s1 = SOFTU2F_ROTR32(w[(i + 14) & 15], 17) ^ SOFTU2F_ROTR32(w[(i + 14) & 15], 19) ^ (w[(i + 14) & 15] >> 10);
+      w[i & 15] += s0 + w[(i + 9) & 15] + s1;
+    }
+
+    t1 = h + (SOFTU2F_ROTR32(e, 6) ^ SOFTU2F_ROTR32(e, 11) ^ SOFTU2F_ROTR32(e, 25)) + ((e & f) ^ (~e & g)) +
+         softu2f_sha256_k[i] + w[i & 15];
+    t2 = (SOFTU2F_ROTR32(a, 2) ^ SOFTU2F_ROTR32(a, 13) ^ SOFTU2F_ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  state[0] += a & *mask;
+  state[1] += b & *mask;
+  state[2] += c & *mask;
+  state[3] += d & *mask;
+  state[4] += e & *mask;
+  state[5] += f & *mask;
+  state[6] += g & *mask;
+  state[7] += h & *mask;
+}
+
+// Get a padded block of a message.
+void softu2f_sha256_block_get(const void *data, size_t len, size_t index, uint8_t *block) {
+  size_t off = index * 64;
+  size_t n = 0;
+  uint64_t bits;
+
+  if (off < len) {
+    n = len - off < 64 ? len - off : 64;
+    memcpy(block, (const uint8_t *)data + off, n);
+  }
+
+  memset(block + n, 0, 64 - n);
+
+  if (n < 64 && off <= len)
+    block[n] = 0x80;
+
+  // The length goes at the end of the last block.
+  if (index == (len + 9 + 63) / 64 - 1) {
+    bits = (uint64_t)len * 8;
+    softu2f_be32_put(block + 56, (uint32_t)(bits >> 32));
+    softu2f_be32_put(block + 60, (uint32_t)bits);
+  }
+}
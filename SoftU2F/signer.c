@@ -0,0 +1,339 @@
+//
+//  signer.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Forward U2FHID_MSG requests to a signing daemon.
+bool softu2f_signer_connect(softu2f_ctx *ctx, const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (ctx->signer) {
+    softu2f_log(ctx, "Signer already connected.\n");
+    return false;
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    softu2f_log(ctx, "Signer socket path too long.\n");
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    softu2f_log(ctx, "Error creating signer socket: %s\n", strerror(errno));
+    return false;
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un))) {
+    softu2f_log(ctx, "Error connecting to signer at %s: %s\n", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  if (!softu2f_signer_connect_with_socket(ctx, fd)) {
+    close(fd);
+    return false;
+  }
+
+  return true;
+}
+
+// Forward U2FHID_MSG requests to a signing daemon already connected on fd.
+bool softu2f_signer_connect_with_socket(softu2f_ctx *ctx, int fd) {
+  softu2f_signer *signer = NULL;
+  int err;
+
+  if (ctx->signer) {
+    softu2f_log(ctx, "Signer already connected.\n");
+    return false;
+  }
+
+  signer = (softu2f_signer *)calloc(1, sizeof(softu2f_signer));
+  if (!signer) {
+    softu2f_log(ctx, "No memory for signer.\n");
+    return false;
+  }
+
+  signer->fd = fd;
+
+  signer->out = CFDataCreateMutable(NULL, 0);
+  if (!signer->out) {
+    softu2f_log(ctx, "No memory for signer requests.\n");
+    goto fail;
+  }
+
+  // Writes happen on the run loop's thread with the engine locked, so they
+  // mustn't block. Reads happen on the signer's own thread and may.
+  pthread_mutex_lock(&ctx->engine->mutex);
+  ctx->signer = signer;
+  softu2f_hid_msg_async_handler_register(ctx, U2FHID_MSG, softu2f_hid_msg_handle_signer, NULL);
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  err = pthread_create(&signer->thread, NULL, softu2f_signer_thread, ctx);
+  if (err) {
+    softu2f_log(ctx, "Error creating signer thread: %d\n", err);
+
+    pthread_mutex_lock(&ctx->engine->mutex);
+    ctx->signer = NULL;
+    softu2f_hid_msg_async_handler_register(ctx, U2FHID_MSG, NULL, NULL);
+    pthread_mutex_unlock(&ctx->engine->mutex);
+
+    goto fail;
+  }
+
+  return true;
+
+fail:
+  // The caller still has the connection.
+  signer->fd = -1;
+  softu2f_signer_free(signer);
+  return false;
+}
+
+// Stop forwarding requests to the signing daemon.
+void softu2f_signer_disconnect(softu2f_ctx *ctx) {
+  softu2f_signer *signer = ctx->signer;
+
+  if (!signer)
+    return;
+
+  // The reader thread fails outstanding requests once the socket closes.
+  shutdown(signer->fd, SHUT_RDWR);
+  pthread_join(signer->thread, NULL);
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+  ctx->signer = NULL;
+  if (ctx->async_handlers[SOFTU2F_CMD_INDEX(U2FHID_MSG)].handler == softu2f_hid_msg_handle_signer)
+    softu2f_hid_msg_async_handler_register(ctx, U2FHID_MSG, NULL, NULL);
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  softu2f_signer_free(signer);
+}
+
+// Free a signer connection.
+void softu2f_signer_free(softu2f_signer *signer) {
+  if (signer->fd >= 0)
+    close(signer->fd);
+
+  if (signer->out)
+    CFRelease(signer->out);
+
+  free(signer);
+}
+
+// Queue a U2F request for the signing daemon. It's answered when the signer
+// responds, and has a deadline and KEEPALIVEs like any deferred request.
+void softu2f_hid_msg_handle_signer(softu2f_ctx *ctx, softu2f_hid_pending *pending, softu2f_hid_message *req, void *info) {
+  softu2f_signer *signer = ctx->signer;
+  uint8_t hdr[SOFTU2F_SIGNER_HDR_SIZE];
+  CFIndex len;
+  int index;
+
+  if (!signer || signer->closed) {
+    softu2f_log(ctx, "Signer not connected.\n");
+    softu2f_hid_pending_fail(pending, ERR_OTHER);
+    return;
+  }
+
+  // Make room by forgetting the oldest request nobody is waiting for.
+  if (signer->npending == SOFTU2F_SIGNER_MAX_PENDING) {
+    index = softu2f_signer_abandoned_find(signer);
+    if (index < 0) {
+      softu2f_log(ctx, "Signer busy.\n");
+      softu2f_hid_pending_fail(pending, ERR_CHANNEL_BUSY);
+      return;
+    }
+
+    softu2f_signer_pending_remove(signer, index);
+  }
+
+  len = CFDataGetLength(req->data);
+
+  softu2f_be32_put(hdr, req->cid);
+  softu2f_be16_put(hdr + 4, len);
+
+  // Written along with any other requests in this batch by softu2f_signer_flush.
+  CFDataAppendBytes(signer->out, hdr, SOFTU2F_SIGNER_HDR_SIZE);
+  CFDataAppendBytes(signer->out, CFDataGetBytePtr(req->data), len);
+
+  signer->pending[signer->npending].cid = req->cid;
+  signer->pending[signer->npending].pending = pending;
+  signer->npending++;
+
+  softu2f_hid_pending_on_cancel(pending, softu2f_signer_cancelled, pending);
+}
+
+// Forget a signer request the channel gave up on, such as one past its
+// deadline. The signer's answer is dropped when it comes.
+void softu2f_signer_cancelled(softu2f_ctx *ctx, void *info) {
+  softu2f_signer *signer = ctx->signer;
+  softu2f_hid_pending *pending = (softu2f_hid_pending *)info;
+  unsigned int i;
+
+  for (i = 0; signer && i < signer->npending; i++) {
+    if (signer->pending[i].pending == pending)
+      signer->pending[i].pending = NULL;
+  }
+
+  // Already detached from the channel, so this only frees it.
+  softu2f_hid_pending_fail(pending, ERR_OTHER);
+}
+
+// Write queued requests to the signing daemon without blocking. Whatever the
+// socket can't take yet is written on a later pass.
+void softu2f_signer_flush(softu2f_ctx *ctx) {
+  softu2f_signer *signer = ctx->signer;
+  const uint8_t *buf;
+  CFIndex len;
+  ssize_t n;
+
+  len = CFDataGetLength(signer->out);
+  if (len == 0 || signer->closed)
+    return;
+
+  buf = CFDataGetBytePtr(signer->out);
+
+  while (signer->out_sent < len) {
+    n = send(signer->fd, buf + signer->out_sent, len - signer->out_sent, MSG_DONTWAIT);
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    // The signer is busy writing answers back. Try again shortly rather than
+    // holding the lock its reader thread needs.
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      softu2f_async_timer_wake(ctx->engine, softu2f_poll_interval.tv_sec + softu2f_poll_interval.tv_nsec / 1000000000.0);
+      return;
+    }
+
+    if (n < 0) {
+      softu2f_log(ctx, "Error writing to signer: %s\n", strerror(errno));
+
+      // The reader thread fails outstanding requests.
+      shutdown(signer->fd, SHUT_RDWR);
+      break;
+    }
+
+    signer->out_sent += n;
+  }
+
+  CFDataSetLength(signer->out, 0);
+  signer->out_sent = 0;
+}
+
+// Read responses from the signing daemon. Run on its own thread.
+void *softu2f_signer_thread(void *arg) {
+  softu2f_ctx *ctx = (softu2f_ctx *)arg;
+  softu2f_signer *signer = ctx->signer;
+  softu2f_hid_pending *pending;
+  ssize_t n;
+
+  while (1) {
+    n = read(signer->fd, signer->in + signer->nin, sizeof(signer->in) - signer->nin);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+
+    signer->nin += n;
+
+    // Complete every response that arrived in this read at once.
+    pthread_mutex_lock(&ctx->engine->mutex);
+    softu2f_signer_complete(ctx);
+    pthread_mutex_unlock(&ctx->engine->mutex);
+  }
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+
+  softu2f_log(ctx, "Signer connection closed.\n");
+  signer->closed = true;
+
+  while (signer->npending > 0) {
+    pending = signer->pending[--signer->npending].pending;
+    if (pending)
+      softu2f_hid_pending_fail(pending, ERR_OTHER);
+  }
+
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  return NULL;
+}
+
+// Send responses read from the signing daemon to their channels.
+void softu2f_signer_complete(softu2f_ctx *ctx) {
+  softu2f_signer *signer = ctx->signer;
+  softu2f_hid_pending *pending;
+  uint8_t *rec = signer->in;
+  uint32_t cid;
+  uint16_t len;
+  int index;
+
+  while (signer->nin - (rec - signer->in) >= SOFTU2F_SIGNER_HDR_SIZE) {
+    cid = softu2f_be32_get(rec);
+    len = (uint16_t)rec[4] << 8 | rec[5];
+
+    if (signer->nin - (rec - signer->in) < SOFTU2F_SIGNER_HDR_SIZE + (size_t)len)
+      break;
+
+    // Responses to different channels can come back in any order.
+    index = softu2f_signer_pending_find(signer, cid);
+    if (index < 0) {
+      softu2f_log(ctx, "Unexpected signer response for CID: 0x%08x\n", cid);
+    } else {
+      pending = signer->pending[index].pending;
+      softu2f_signer_pending_remove(signer, index);
+
+      if (pending)
+        softu2f_hid_pending_respond(pending, rec + SOFTU2F_SIGNER_HDR_SIZE, len);
+      else
+        softu2f_log(ctx, "Dropping signer response for abandoned request on CID: 0x%08x\n", cid);
+    }
+
+    rec += SOFTU2F_SIGNER_HDR_SIZE + len;
+  }
+
+  // Keep the start of a partial response for the next read.
+  signer->nin -= rec - signer->in;
+  memmove(signer->in, rec, signer->nin);
+}
+
+// Find a channel's oldest outstanding signer request.
+int softu2f_signer_pending_find(softu2f_signer *signer, uint32_t cid) {
+  unsigned int i;
+
+  for (i = 0; i < signer->npending; i++) {
+    if (signer->pending[i].cid == cid)
+      return i;
+  }
+
+  return -1;
+}
+
+// Find the oldest signer request nobody is waiting for.
+int softu2f_signer_abandoned_find(softu2f_signer *signer) {
+  unsigned int i;
+
+  for (i = 0; i < signer->npending; i++) {
+    if (!signer->pending[i].pending)
+      return i;
+  }
+
+  return -1;
+}
+
+// Remove an outstanding signer request, keeping the rest in order.
+void softu2f_signer_pending_remove(softu2f_signer *signer, unsigned int index) {
+  signer->npending--;
+  memmove(&signer->pending[index], &signer->pending[index + 1], (signer->npending - index) * sizeof(softu2f_signer_req));
+}
@@ -0,0 +1,630 @@
+//
+//  sim.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+#include <math.h>
+
+// Run a discrete-event simulation of clients using a device, on a simulated
+// clock.
+bool softu2f_sim_run(const softu2f_sim_config *config, softu2f_sim_result *result) {
+  softu2f_engine *engine = NULL;
+  CFAllocatorRef allocator = NULL, previous = NULL;
+  softu2f_sim_event event;
+  softu2f_sim sim;
+  unsigned int i;
+  bool ret = false;
+
+  memset(result, 0, sizeof(softu2f_sim_result));
+  memset(&sim, 0, sizeof(softu2f_sim));
+  sim.config = config;
+  sim.result = result;
+
+  // Spread small seeds over the generator's state, which can't be zero.
+  sim.rand = (config->seed + 1) * 2654435761u;
+  if (!sim.rand)
+    sim.rand = 1;
+
+  sim.clients = (softu2f_sim_client *)calloc(config->clients + 1, sizeof(softu2f_sim_client));
+  if (!sim.clients)
+    goto done;
+
+  sim.ndevices = config->devices ? config->devices : 1;
+  sim.devices = (softu2f_ctx **)calloc(sim.ndevices, sizeof(softu2f_ctx *));
+  if (!sim.devices)
+    goto done;
+
+  allocator = softu2f_sim_allocator_create(result);
+  if (!allocator)
+    goto done;
+
+  engine = softu2f_engine_create(0);
+  if (!engine)
+    goto done;
+
+  // Count the engine's messages and deferred requests.
+  CFRelease(engine->allocator);
+  engine->allocator = (CFAllocatorRef)CFRetain(allocator);
+
+  for (i = 0; i < sim.ndevices; i++) {
+    sim.devices[i] = softu2f_sim_device_create(&sim, sim.ctx ? sim.ctx->engine : engine);
+    if (!sim.devices[i])
+      goto done;
+
+    // The engine is freed along with its last device from here on.
+    sim.ctx = sim.devices[i];
+    engine = NULL;
+  }
+
+  pthread_mutex_lock(&sim.ctx->engine->mutex);
+
+  for (i = 0; i < config->clients; i++) {
+    sim.clients[i].cid = i + 1;
+    sim.clients[i].bulk = i < config->bulk_clients;
+    if (config->arrival_rate > 0)
+      softu2f_sim_schedule(&sim, -log(softu2f_sim_random(&sim)) / config->arrival_rate, SOFTU2F_SIM_ARRIVAL, i, NULL);
+  }
+
+  softu2f_sim_schedule(&sim, 0, SOFTU2F_SIM_TICK, 0, NULL);
+  if (sim.ndevices > 1 && config->detach > 0)
+    softu2f_sim_schedule(&sim, config->detach, SOFTU2F_SIM_DETACH, 0, NULL);
+
+  // Count the CFData and other objects the engine creates while it handles
+  // events.
+  previous = (CFAllocatorRef)CFRetain(CFAllocatorGetDefault());
+  CFAllocatorSetDefault(allocator);
+
+  while (!sim.failed && softu2f_sim_next(&sim, &event)) {
+    if (config->stop > 0 && event.time > config->stop) {
+      free(event.frame);
+      break;
+    }
+
+    if (event.time > result->elapsed)
+      result->elapsed = event.time;
+
+    softu2f_sim_event_handle(&sim, &event);
+    free(event.frame);
+  }
+
+  CFAllocatorSetDefault(previous);
+  CFRelease(previous);
+
+  if (sim.now > result->elapsed)
+    result->elapsed = sim.now;
+
+  if (result->responses)
+    result->latency_mean = sim.latency_sum / result->responses;
+  if (sim.small_responses)
+    result->small_latency_mean = sim.small_latency_sum / sim.small_responses;
+
+  result->stats = sim.ctx->stats;
+  ret = !sim.failed;
+
+  pthread_mutex_unlock(&sim.ctx->engine->mutex);
+
+done:
+  // Tear the devices down with whatever they're still doing.
+  for (i = 0; sim.devices && i < sim.ndevices; i++) {
+    if (sim.devices[i])
+      softu2f_deinit(sim.devices[i]);
+  }
+
+  // Requests still deferred if the run stopped early. Nothing is sent for
+  // them now, but they have to be freed.
+  while (sim.deferred_head < sim.ndeferred) {
+    softu2f_hid_pending_fail(sim.deferred[sim.deferred_head++], ERR_OTHER);
+  }
+
+  while (softu2f_sim_next(&sim, &event)) {
+    free(event.frame);
+  }
+
+  free(sim.deferred);
+  free(sim.events);
+  free(sim.devices);
+  free(sim.clients);
+
+  if (engine)
+    softu2f_engine_free(engine);
+  if (allocator)
+    CFRelease(allocator);
+
+  return ret;
+}
+
+// Create a simulated device and add it to the engine.
+softu2f_ctx *softu2f_sim_device_create(softu2f_sim *sim, softu2f_engine *engine) {
+  const softu2f_sim_config *config = sim->config;
+  softu2f_ctx *ctx;
+
+  ctx = softu2f_ctx_create(0, config->rpt_size ? config->rpt_size : HID_RPT_SIZE);
+  if (!ctx)
+    return NULL;
+
+  ctx->engine = engine;
+  ctx->next_device = engine->devices;
+  engine->devices = ctx;
+
+  ctx->send_frame = softu2f_sim_frame_send;
+  ctx->wake = softu2f_sim_wake;
+  ctx->user_data = sim;
+  ctx->clock.now = softu2f_sim_clock_now;
+  ctx->clock.sleep = softu2f_sim_clock_sleep;
+  ctx->clock.info = sim;
+  ctx->limits = config->limits;
+
+  if (!config->default_handler && config->deferred) {
+    softu2f_hid_msg_async_handler_register(ctx, config->cmd, softu2f_sim_handle_async, sim);
+    if (config->bulk_clients)
+      softu2f_hid_msg_async_handler_register(ctx, config->bulk_cmd, softu2f_sim_handle_async, sim);
+  } else if (!config->default_handler) {
+    softu2f_hid_msg_handler_register(ctx, config->cmd, softu2f_sim_handle);
+    if (config->bulk_clients)
+      softu2f_hid_msg_handler_register(ctx, config->bulk_cmd, softu2f_sim_handle);
+  }
+
+  if (config->setup)
+    config->setup(ctx, config->info);
+
+  return ctx;
+}
+
+// Schedule an event. A copy of frame is kept, if there is one.
+bool softu2f_sim_schedule(softu2f_sim *sim, double time, uint8_t type, unsigned int client, const void *frame) {
+  softu2f_sim_event *events, event;
+  size_t i, parent, cap;
+
+  if (sim->nevents == sim->cap) {
+    cap = sim->cap ? sim->cap * 2 : 64;
+    events = (softu2f_sim_event *)realloc(sim->events, cap * sizeof(softu2f_sim_event));
+    if (!events)
+      goto fail;
+
+    sim->events = events;
+    sim->cap = cap;
+  }
+
+  event.time = time;
+  event.seq = sim->seq++;
+  event.type = type;
+  event.client = client;
+  event.frame = NULL;
+
+  if (frame) {
+    event.frame = (uint8_t *)malloc(sim->ctx->layout.rpt_size);
+    if (!event.frame)
+      goto fail;
+
+    memcpy(event.frame, frame, sim->ctx->layout.rpt_size);
+  }
+
+  // Sift up from the end of the heap.
+  for (i = sim->nevents++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (!SOFTU2F_SIM_BEFORE(event, sim->events[parent]))
+      break;
+
+    sim->events[i] = sim->events[parent];
+  }
+
+  sim->events[i] = event;
+  return true;
+
+fail:
+  softu2f_log(sim->ctx, "No memory for simulator event.\n");
+  sim->failed = true;
+  return false;
+}
+
+// Take the earliest event.
+bool softu2f_sim_next(softu2f_sim *sim, softu2f_sim_event *event) {
+  softu2f_sim_event last;
+  size_t i, child;
+
+  if (sim->nevents == 0)
+    return false;
+
+  *event = sim->events[0];
+  last = sim->events[--sim->nevents];
+
+  // Sift the last event down from the root.
+  for (i = 0; (child = 2 * i + 1) < sim->nevents; i = child) {
+    if (child + 1 < sim->nevents && SOFTU2F_SIM_BEFORE(sim->events[child + 1], sim->events[child]))
+      child++;
+
+    if (!SOFTU2F_SIM_BEFORE(sim->events[child], last))
+      break;
+
+    sim->events[i] = sim->events[child];
+  }
+
+  sim->events[i] = last;
+  return true;
+}
+
+// Handle an event.
+void softu2f_sim_event_handle(softu2f_sim *sim, softu2f_sim_event *event) {
+  const softu2f_sim_config *config = sim->config;
+  softu2f_sim_client *client = &sim->clients[event->client];
+  softu2f_ctx *device;
+  double next;
+
+  switch (event->type) {
+  case SOFTU2F_SIM_ARRIVAL:
+    sim->result->requests++;
+    client->arrived++;
+
+    if (client->count == SOFTU2F_SIM_QUEUE) {
+      sim->result->dropped++;
+    } else {
+      client->arrivals[(client->head + client->count) % SOFTU2F_SIM_QUEUE] = event->time;
+      client->count++;
+
+      if (!client->busy)
+        softu2f_sim_client_send(sim, event->client, event->time);
+    }
+
+    if (client->bulk && config->bulk_requests && client->arrived == config->bulk_requests)
+      break;
+
+    // Arrivals are a Poisson process.
+    next = event->time - log(softu2f_sim_random(sim)) / config->arrival_rate;
+    if (next < config->duration)
+      softu2f_sim_schedule(sim, next, SOFTU2F_SIM_ARRIVAL, event->client, NULL);
+    break;
+
+  case SOFTU2F_SIM_FRAME_IN:
+    // Frames wait while the device is busy.
+    if (sim->now < event->time)
+      sim->now = event->time;
+
+    // Nothing reads frames sent to a detached device.
+    device = sim->devices[event->client % sim->ndevices];
+    if (!device)
+      break;
+
+    sim->result->transport_calls++;
+    softu2f_hid_frames_read(device, (U2FHID_FRAME *)event->frame, 1);
+    break;
+
+  case SOFTU2F_SIM_FRAME_OUT:
+    softu2f_sim_client_read(sim, event->client, (U2FHID_FRAME *)event->frame, event->time);
+    break;
+
+  case SOFTU2F_SIM_TICK:
+    if (sim->now < event->time)
+      sim->now = event->time;
+
+    for (device = sim->ctx->engine->devices; device; device = device->next_device) {
+      softu2f_hid_handle_messages(device);
+    }
+
+    if (softu2f_sim_busy(sim))
+      softu2f_sim_schedule(sim, event->time + SOFTU2F_KEEPALIVE_INTERVAL, SOFTU2F_SIM_TICK, 0, NULL);
+    break;
+
+  case SOFTU2F_SIM_SEND:
+    if (sim->now < event->time)
+      sim->now = event->time;
+
+    // One event serves every device that asked to be woken.
+    sim->send_at = 0;
+    for (device = sim->ctx->engine->devices; device; device = device->next_device) {
+      softu2f_calls_run(device);
+      softu2f_hid_out_pump(device);
+    }
+    break;
+
+  case SOFTU2F_SIM_COMPLETE:
+    if (sim->now < event->time)
+      sim->now = event->time;
+
+    // Every request takes the same time, so they're answered in the order
+    // they were deferred. Those already abandoned are just freed.
+    softu2f_hid_pending_respond(sim->deferred[sim->deferred_head++], NULL, 0);
+    if (sim->deferred_head == sim->ndeferred)
+      sim->deferred_head = sim->ndeferred = 0;
+    break;
+
+  case SOFTU2F_SIM_DETACH:
+    if (sim->now < event->time)
+      sim->now = event->time;
+
+    softu2f_deinit(sim->devices[0]);
+    sim->devices[0] = NULL;
+    break;
+  }
+}
+
+// Send a client's oldest waiting request.
+void softu2f_sim_client_send(softu2f_sim *sim, unsigned int index, double time) {
+  const softu2f_sim_config *config = sim->config;
+  softu2f_frame_layout *layout = &sim->ctx->layout;
+  softu2f_sim_client *client = &sim->clients[index];
+  uint8_t buf[kSoftU2FMaxReportSize];
+  U2FHID_FRAME *frame = (U2FHID_FRAME *)buf;
+  uint8_t cmd = client->bulk ? config->bulk_cmd : config->cmd;
+  uint16_t bcnt = client->bulk ? config->bulk_bcnt : config->bcnt;
+  unsigned int sent, n;
+  uint8_t seq = 0;
+
+  client->busy = true;
+  client->receiving = false;
+
+  time += config->latency;
+
+  memset(buf, 0, layout->rpt_size);
+  frame->cid = client->cid;
+  frame->init.cmd = cmd;
+  frame->init.bcnth = bcnt >> 8;
+  frame->init.bcntl = bcnt & 0xff;
+
+  sent = bcnt < layout->init_payload ? bcnt : layout->init_payload;
+  if (config->data)
+    memcpy(frame->init.data, config->data, sent);
+
+  softu2f_sim_schedule(sim, time, SOFTU2F_SIM_FRAME_IN, index, buf);
+
+  while (sent < bcnt) {
+    time += config->frame_interval;
+
+    memset(buf, 0, layout->rpt_size);
+    frame->cid = client->cid;
+    frame->cont.seq = seq++;
+
+    n = bcnt - sent;
+    if (n > layout->cont_payload)
+      n = layout->cont_payload;
+
+    if (config->data)
+      memcpy(frame->cont.data, config->data + sent, n);
+
+    sent += n;
+    softu2f_sim_schedule(sim, time, SOFTU2F_SIM_FRAME_IN, index, buf);
+  }
+
+  if (config->cancel_after > 0) {
+    memset(buf, 0, layout->rpt_size);
+    frame->cid = client->cid;
+    frame->init.cmd = U2FHID_CANCEL;
+    softu2f_sim_schedule(sim, time + config->cancel_after, SOFTU2F_SIM_FRAME_IN, index, buf);
+  }
+}
+
+// Read a response frame on a client.
+void softu2f_sim_client_read(softu2f_sim *sim, unsigned int index, U2FHID_FRAME *frame, double time) {
+  softu2f_frame_layout *layout = &sim->ctx->layout;
+  softu2f_sim_client *client = &sim->clients[index];
+  softu2f_sim_result *result = sim->result;
+
+  if (!client->busy)
+    return;
+
+  if (FRAME_TYPE(*frame) == TYPE_INIT) {
+    if (frame->init.cmd == U2FHID_KEEPALIVE) {
+      result->keepalives++;
+      return;
+    }
+
+    result->reply_cmd = frame->init.cmd;
+    result->reply_bcnt = MSG_LEN(*frame);
+    softu2f_sim_reply_copy(result, 0, frame->init.data, layout->init_payload);
+
+    if (frame->init.cmd == U2FHID_ERROR) {
+      softu2f_sim_client_done(sim, index, time, true);
+      return;
+    }
+
+    client->receiving = true;
+    client->resp_bcnt = MSG_LEN(*frame);
+    client->resp_len = layout->init_payload;
+  } else if (client->receiving) {
+    softu2f_sim_reply_copy(result, client->resp_len, frame->cont.data, layout->cont_payload);
+    client->resp_len += layout->cont_payload;
+  } else {
+    return;
+  }
+
+  if (client->resp_len >= client->resp_bcnt)
+    softu2f_sim_client_done(sim, index, time, false);
+}
+
+// Copy part of an answer into the result, as far as it fits.
+void softu2f_sim_reply_copy(softu2f_sim_result *result, unsigned int off, const uint8_t *data, unsigned int len) {
+  if (off >= sizeof(result->reply))
+    return;
+
+  if (len > sizeof(result->reply) - off)
+    len = sizeof(result->reply) - off;
+
+  memcpy(result->reply + off, data, len);
+}
+
+// Finish a client's request and send the next one.
+void softu2f_sim_client_done(softu2f_sim *sim, unsigned int index, double time, bool error) {
+  softu2f_sim_client *client = &sim->clients[index];
+  softu2f_sim_result *result = sim->result;
+  double latency = time - client->arrivals[client->head];
+
+  result->responses++;
+  if (error)
+    result->errors++;
+
+  sim->latency_sum += latency;
+  if (latency > result->latency_max)
+    result->latency_max = latency;
+
+  if (!client->bulk) {
+    sim->small_responses++;
+    sim->small_latency_sum += latency;
+    if (latency > result->small_latency_max)
+      result->small_latency_max = latency;
+  }
+
+  client->head = (client->head + 1) % SOFTU2F_SIM_QUEUE;
+  client->count--;
+  client->busy = false;
+  client->receiving = false;
+
+  if (client->count > 0)
+    softu2f_sim_client_send(sim, index, time);
+}
+
+// Whether anything is still going on in the simulation.
+bool softu2f_sim_busy(softu2f_sim *sim) {
+  softu2f_ctx *device;
+
+  if (sim->nevents > 0)
+    return true;
+
+  for (device = sim->ctx->engine->devices; device; device = device->next_device) {
+    if (device->msg_list || device->pending_list || device->calls)
+      return true;
+  }
+
+  return false;
+}
+
+// Answer a request after the configured service time.
+bool softu2f_sim_handle(softu2f_ctx *ctx, softu2f_hid_message *req) {
+  softu2f_sim *sim = (softu2f_sim *)ctx->user_data;
+  softu2f_hid_response *resp;
+
+  softu2f_sim_clock_sleep(sim, sim->config->service_time);
+
+  // A real handler would give up the same way.
+  if (sim->config->scratch && !softu2f_hid_msg_scratch(req, sim->config->scratch))
+    return softu2f_hid_err_send(ctx, req->cid, ERR_OTHER);
+
+  resp = softu2f_hid_resp_start(ctx, req->cid, req->cmd);
+  if (!resp)
+    return false;
+
+  if (!softu2f_hid_resp_append(resp, CFDataGetBytePtr(req->data), req->bcnt)) {
+    softu2f_hid_resp_discard(ctx, resp);
+    return false;
+  }
+
+  return softu2f_hid_resp_send(ctx, resp);
+}
+
+// Defer a request, to be answered after the configured service time.
+void softu2f_sim_handle_async(softu2f_ctx *ctx, softu2f_hid_pending *pending, softu2f_hid_message *req, void *info) {
+  softu2f_sim *sim = (softu2f_sim *)info;
+  softu2f_hid_pending **deferred;
+  size_t cap;
+
+  if (sim->ndeferred == sim->deferred_cap) {
+    cap = sim->deferred_cap ? sim->deferred_cap * 2 : 16;
+    deferred = (softu2f_hid_pending **)realloc(sim->deferred, cap * sizeof(softu2f_hid_pending *));
+    if (!deferred) {
+      softu2f_log(ctx, "No memory for deferred request.\n");
+      sim->failed = true;
+      softu2f_hid_pending_fail(pending, ERR_OTHER);
+      return;
+    }
+
+    sim->deferred = deferred;
+    sim->deferred_cap = cap;
+  }
+
+  sim->deferred[sim->ndeferred++] = pending;
+  softu2f_sim_schedule(sim, sim->now + sim->config->service_time, SOFTU2F_SIM_COMPLETE, req->cid - 1, NULL);
+}
+
+// Send a frame out of a simulated device.
+bool softu2f_sim_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  softu2f_sim *sim = (softu2f_sim *)ctx->user_data;
+
+  sim->result->transport_calls++;
+
+  // Only the clients' own CIDs have anyone listening.
+  if (frame->cid == 0 || frame->cid > sim->config->clients)
+    return true;
+
+  return softu2f_sim_schedule(sim, sim->now + sim->config->latency, SOFTU2F_SIM_FRAME_OUT, frame->cid - 1, frame);
+}
+
+// Schedule the device to send its next queued frame or make a scheduled call.
+void softu2f_sim_wake(softu2f_ctx *ctx, double seconds) {
+  softu2f_sim *sim = (softu2f_sim *)ctx->user_data;
+  double time = sim->now + seconds;
+
+  if (sim->send_at && sim->send_at <= time)
+    return;
+
+  if (softu2f_sim_schedule(sim, time, SOFTU2F_SIM_SEND, 0, NULL))
+    sim->send_at = time;
+}
+
+// Read the simulated clock.
+double softu2f_sim_clock_now(void *info) {
+  return ((softu2f_sim *)info)->now;
+}
+
+// Advance the simulated clock.
+void softu2f_sim_clock_sleep(void *info, double seconds) {
+  ((softu2f_sim *)info)->now += seconds;
+}
+
+// Get a random number in (0, 1].
+double softu2f_sim_random(softu2f_sim *sim) {
+  uint32_t x = sim->rand;
+
+  // xorshift32.
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  sim->rand = x;
+
+  return (x + 1.0) / 4294967296.0;
+}
+
+// Create an allocator that counts allocations into a simulation's result.
+CFAllocatorRef softu2f_sim_allocator_create(softu2f_sim_result *result) {
+  CFAllocatorContext context;
+
+  memset(&context, 0, sizeof(CFAllocatorContext));
+  context.info = result;
+  context.allocate = softu2f_sim_allocate;
+  context.reallocate = softu2f_sim_reallocate;
+  context.deallocate = softu2f_sim_deallocate;
+
+  // The allocator itself comes from the system's.
+  return CFAllocatorCreate(kCFAllocatorSystemDefault, &context);
+}
+
+// Allocate memory, counting it.
+void *softu2f_sim_allocate(CFIndex size, CFOptionFlags hint, void *info) {
+  softu2f_sim_result *result = (softu2f_sim_result *)info;
+
+  result->allocations++;
+  result->alloc_bytes += size;
+
+  return malloc(size);
+}
+
+// Resize memory, counting it as a new allocation.
+void *softu2f_sim_reallocate(void *ptr, CFIndex size, CFOptionFlags hint, void *info) {
+  softu2f_sim_result *result = (softu2f_sim_result *)info;
+
+  result->allocations++;
+  result->alloc_bytes += size;
+  if (ptr)
+    result->frees++;
+
+  return realloc(ptr, size);
+}
+
+// Free memory, counting it.
+void softu2f_sim_deallocate(void *ptr, void *info) {
+  softu2f_sim_result *result = (softu2f_sim_result *)info;
+
+  result->frees++;
+  free(ptr);
+}
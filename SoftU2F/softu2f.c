@@ -8,29 +8,101 @@
 
 #include "softu2f.h"
 #include "internal.h"
-#include <sys/time.h>
+
+struct timespec softu2f_poll_interval = {0, 1000000L}; // 1ms. Spec says 5ms...
 
 // Initialize libSoftU2F before usage.
 softu2f_ctx *softu2f_init(softu2f_init_flags flags) {
+  return softu2f_init_with_report_size(flags, HID_RPT_SIZE);
+}
+
+// Initialize libSoftU2F with a device using the given HID report size.
+softu2f_ctx *softu2f_init_with_report_size(softu2f_init_flags flags, uint16_t rpt_size) {
+  softu2f_engine *engine = NULL;
   softu2f_ctx *ctx = NULL;
-  io_service_t service = IO_OBJECT_NULL;
-  kern_return_t ret;
-  int err;
 
-  // Allocate a new context.
-  ctx = (softu2f_ctx *)calloc(1, sizeof(softu2f_ctx));
-  if (!ctx)
+  engine = softu2f_engine_create(flags);
+  if (!engine)
     return NULL;
 
-  // Apply init flags.
-  ctx->debug = (flags & SOFTU2F_DEBUG) == 1;
+  // The engine is freed along with its last device.
+  ctx = softu2f_device_add_to_engine(engine, flags, rpt_size);
+  if (!ctx) {
+    softu2f_engine_free(engine);
+    return NULL;
+  }
+
+  return ctx;
+}
+
+// Allocate an engine without any devices.
+softu2f_engine *softu2f_engine_create(softu2f_init_flags flags) {
+  softu2f_engine *engine = NULL;
+  pthread_mutexattr_t attr;
+  int err;
+
+  // Allocate a new engine.
+  engine = (softu2f_engine *)calloc(1, sizeof(softu2f_engine));
+  if (!engine)
+    return NULL;
 
-  err = pthread_mutex_init(&ctx->mutex, NULL);
+  // Recursive, so handlers can complete requests and read counters.
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  err = pthread_mutex_init(&engine->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
   if (err) {
-    softu2f_log(ctx, "Error creating mutex.\n");
-    goto fail;
+    if (flags & SOFTU2F_DEBUG)
+      fprintf(stderr, "Error creating mutex.\n");
+    free(engine);
+    return NULL;
+  }
+
+  // Messages and deferred requests are allocated and freed through the same
+  // allocator, whatever the default is on the thread that frees them.
+  engine->allocator = (CFAllocatorRef)CFRetain(CFAllocatorGetDefault());
+
+  return engine;
+}
+
+// Free an engine and its message pool.
+void softu2f_engine_free(softu2f_engine *engine) {
+  softu2f_hid_message *msg;
+
+  pthread_mutex_destroy(&engine->mutex);
+
+  while ((msg = engine->msg_pool)) {
+    engine->msg_pool = msg->next;
+    CFAllocatorDeallocate(engine->allocator, msg);
   }
 
+  CFRelease(engine->allocator);
+  free(engine);
+}
+
+// Add another device, served by the same run loop and threads as ctx.
+softu2f_ctx *softu2f_device_add(softu2f_ctx *ctx, softu2f_init_flags flags, uint16_t rpt_size) {
+  softu2f_ctx *device;
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+  device = softu2f_device_add_to_engine(ctx->engine, flags, rpt_size);
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  return device;
+}
+
+// Create a device and add it to an engine.
+softu2f_ctx *softu2f_device_add_to_engine(softu2f_engine *engine, softu2f_init_flags flags, uint16_t rpt_size) {
+  softu2f_ctx *ctx = NULL;
+  io_service_t service = IO_OBJECT_NULL;
+  kern_return_t ret;
+
+  ctx = softu2f_ctx_create(flags, rpt_size);
+  if (!ctx)
+    return NULL;
+
+  ctx->send_frame = softu2f_kext_frame_send;
+
   // Find driver.
   service = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching(kSoftU2FDriverClassName));
   if (!service) {
@@ -38,8 +110,9 @@ softu2f_ctx *softu2f_init(softu2f_init_flags flags) {
     goto fail;
   }
 
-  // Open connection to user client.
-  ret = IOServiceOpen(service, mach_task_self(), 0, &ctx->con);
+  // Open connection to user client. The connection type is our report size.
+  // Each connection gets its own device from the driver.
+  ret = IOServiceOpen(service, mach_task_self(), rpt_size, &ctx->con);
   if (ret != KERN_SUCCESS) {
     softu2f_log(ctx, "Error connecting to SoftU2F.kext: %d\n", ret);
     goto fail;
@@ -47,6 +120,17 @@ softu2f_ctx *softu2f_init(softu2f_init_flags flags) {
   IOObjectRelease(service);
   service = IO_OBJECT_NULL;
 
+  // Join the engine.
+  ctx->engine = engine;
+  ctx->next_device = engine->devices;
+  engine->devices = ctx;
+
+  // Start getting frames right away if the run loop is already going.
+  if (engine->notification_port && !softu2f_device_notify(ctx)) {
+    softu2f_deinit(ctx);
+    return NULL;
+  }
+
   return ctx;
 
 fail:
@@ -57,10 +141,72 @@ fail:
   return NULL;
 }
 
+// Allocate a context with frame geometry for the given report size.
+softu2f_ctx *softu2f_ctx_create(softu2f_init_flags flags, uint16_t rpt_size) {
+  softu2f_ctx *ctx = NULL;
+
+  // Allocate a new context.
+  ctx = (softu2f_ctx *)calloc(1, sizeof(softu2f_ctx));
+  if (!ctx)
+    return NULL;
+
+  // Apply init flags.
+  ctx->debug = (flags & SOFTU2F_DEBUG) == 1;
+  ctx->stream_ping = (flags & SOFTU2F_STREAM_PING) != 0;
+
+  if (!kSoftU2FReportSizeSupported(rpt_size)) {
+    softu2f_log(ctx, "Unsupported report size: %u.\n", rpt_size);
+    goto fail;
+  }
+
+  softu2f_frame_layout_init(&ctx->layout, rpt_size);
+  softu2f_hid_out_init(ctx);
+  ctx->deadline = SOFTU2F_DEADLINE_DEFAULT;
+  ctx->scratch.ctx = ctx;
+
+  // Frames for the response builder.
+  ctx->resp.layout = ctx->layout;
+  ctx->resp.frames = (uint8_t *)calloc(SOFTU2F_MAX_FRAMES, rpt_size);
+  if (!ctx->resp.frames) {
+    softu2f_log(ctx, "No memory for response frames.\n");
+    goto fail;
+  }
+
+  ctx->frame_allocator = softu2f_frame_allocator_create(ctx);
+  if (!ctx->frame_allocator) {
+    softu2f_log(ctx, "No memory for frame allocator.\n");
+    goto fail;
+  }
+
+  return ctx;
+
+fail:
+  if (ctx->resp.frames)
+    free(ctx->resp.frames);
+  free(ctx);
+  return NULL;
+}
+
 // Cleanup after using libSoftU2F.
 void softu2f_deinit(softu2f_ctx *ctx) {
+  softu2f_engine *engine = ctx->engine;
+  softu2f_hid_message *msg;
+  softu2f_ctx **device;
+  bool last = false;
   kern_return_t ret;
 
+  // Stop handing requests to worker processes.
+  if (ctx->workers)
+    softu2f_workers_stop(ctx);
+
+  // Disconnect from the signing daemon.
+  if (ctx->signer)
+    softu2f_signer_disconnect(ctx);
+
+  // Stop exporting the device over USB/IP.
+  if (ctx->usbip)
+    softu2f_usbip_stop(ctx);
+
   // Close user client connection.
   if (ctx->con) {
     ret = IOServiceClose(ctx->con);
@@ -68,7 +214,73 @@ void softu2f_deinit(softu2f_ctx *ctx) {
       softu2f_log(ctx, "Error closing connection to SoftU2F.kext: %d.\n", ret);
   }
 
-  pthread_mutex_destroy(&ctx->mutex);
+  // Leave the engine. Its timer may be visiting devices on another thread,
+  // so the device is cleaned up under the lock too.
+  if (engine) {
+    pthread_mutex_lock(&engine->mutex);
+
+    device = &engine->devices;
+    while (*device && *device != ctx) {
+      device = &(*device)->next_device;
+    }
+
+    if (*device)
+      *device = ctx->next_device;
+
+    // Hold on to the engine while the device is cleaned up, in case the last
+    // deferred request is freed in the meantime.
+    engine->npending++;
+  }
+
+  // Free messages still in progress.
+  while (ctx->msg_list)
+    softu2f_hid_msg_list_remove(ctx, ctx->msg_list);
+
+  // Free messages that were complete but not yet handled.
+  while ((msg = ctx->ready_list)) {
+    ctx->ready_list = msg->next;
+    softu2f_hid_msg_release(ctx, msg);
+  }
+  ctx->ready_tail = NULL;
+
+  // Deferred requests completed from now on are dropped.
+  while (ctx->pending_list)
+    softu2f_hid_pending_detach(ctx, ctx->pending_list);
+
+  // Scheduled calls are made now rather than after the device is freed.
+  softu2f_calls_close(ctx);
+
+  if (engine)
+    pthread_mutex_unlock(&engine->mutex);
+
+  if (ctx->resp.frames)
+    free(ctx->resp.frames);
+
+  if (ctx->frame_allocator)
+    CFRelease(ctx->frame_allocator);
+
+  softu2f_hid_out_free(ctx);
+  softu2f_retry_free(ctx);
+
+  if (ctx->scratch.base)
+    CFAllocatorDeallocate(engine->allocator, ctx->scratch.base);
+
+  if (ctx->key_filter)
+    free(ctx->key_filter);
+
+  if (ctx->att_cert)
+    free(ctx->att_cert);
+
+  // Last device out cleans up the engine. Deferred requests still out there
+  // keep it until they're freed.
+  if (engine) {
+    pthread_mutex_lock(&engine->mutex);
+    last = --engine->npending == 0 && !engine->devices;
+    pthread_mutex_unlock(&engine->mutex);
+  }
+
+  if (last)
+    softu2f_engine_free(engine);
 
   // Cleanup
   free(ctx);
@@ -76,53 +288,85 @@ void softu2f_deinit(softu2f_ctx *ctx) {
 
 // Read HID messages from device in loop.
 void softu2f_run(softu2f_ctx *ctx) {
-  IONotificationPortRef notification_port;
-  mach_port_t mnotification_port;
+  softu2f_engine *engine = ctx->engine;
   CFRunLoopSourceRef run_loop_source;
   CFRunLoopTimerRef run_loop_timer;
   CFRunLoopTimerContext timer_ctx;
-  io_async_ref64_t async_ref;
-  kern_return_t ret;
+  softu2f_ctx *device;
 
-  if (ctx->run_loop) {
+  if (engine->run_loop) {
     softu2f_log(ctx, "Can't start softu2f run loop. Already running.\n");
     return;
   }
 
   // Create port to listen for kernel notifications on.
-  notification_port = IONotificationPortCreate(kIOMasterPortDefault);
-  if (!notification_port) {
+  engine->notification_port = IONotificationPortCreate(kIOMasterPortDefault);
+  if (!engine->notification_port) {
     softu2f_log(ctx, "Error getting notification port.\n");
     return;
   }
 
-  // Get lower level mach port from notification port.
-  mnotification_port = IONotificationPortGetMachPort(notification_port);
-  if (!mnotification_port) {
-    softu2f_log(ctx, "Error getting mach notification port.\n");
-    return;
-  }
-
   // Create a run loop source from our notification port so we can add the port to our run loop.
-  run_loop_source = IONotificationPortGetRunLoopSource(notification_port);
+  run_loop_source = IONotificationPortGetRunLoopSource(engine->notification_port);
   if (run_loop_source == NULL) {
     softu2f_log(ctx, "Error getting run loop source.\n");
-    return;
+    goto done;
   }
 
-  // Create a timer to run periodically.
+  // Create a timer to run periodically, often enough to send KEEPALIVEs.
   memset(&timer_ctx, 0, sizeof(CFRunLoopTimerContext));
-  timer_ctx.info = ctx;
-  run_loop_timer = CFRunLoopTimerCreate(NULL, 0, 0.2, 0, 0, softu2f_async_timer_callback, &timer_ctx);
-  if (run_loop_source == NULL) {
+  timer_ctx.info = engine;
+  run_loop_timer = CFRunLoopTimerCreate(NULL, 0, SOFTU2F_KEEPALIVE_INTERVAL, 0, 0, softu2f_async_timer_callback, &timer_ctx);
+  if (run_loop_timer == NULL) {
     softu2f_log(ctx, "Error creating timer.\n");
-    return;
+    goto done;
   }
 
   // Add the notification port and timer to the run loop.
   CFRunLoopAddSource(CFRunLoopGetCurrent(), run_loop_source, kCFRunLoopDefaultMode);
   CFRunLoopAddTimer(CFRunLoopGetCurrent(), run_loop_timer, kCFRunLoopDefaultMode);
 
+  // Tell the kernel how to notify us about each device.
+  pthread_mutex_lock(&engine->mutex);
+  for (device = engine->devices; device; device = device->next_device) {
+    if (device->con && !softu2f_device_notify(device)) {
+      pthread_mutex_unlock(&engine->mutex);
+      goto done_timer;
+    }
+  }
+  pthread_mutex_unlock(&engine->mutex);
+
+  // Blocks until the run loop is stopped in our callback.
+  softu2f_log(ctx, "Starting softu2f async run loop.\n");
+  engine->run_loop = CFRunLoopGetCurrent();
+  engine->run_loop_timer = run_loop_timer;
+  CFRunLoopRun();
+  engine->run_loop = NULL;
+  engine->run_loop_timer = NULL;
+
+done_timer:
+  CFRunLoopTimerInvalidate(run_loop_timer);
+  CFRelease(run_loop_timer);
+
+done:
+  // Clean up.
+  IONotificationPortDestroy(engine->notification_port);
+  engine->notification_port = NULL;
+}
+
+// Register for frame notifications from a device's connection.
+bool softu2f_device_notify(softu2f_ctx *ctx) {
+  mach_port_t mnotification_port;
+  io_async_ref64_t async_ref;
+  kern_return_t ret;
+
+  // Get lower level mach port from notification port.
+  mnotification_port = IONotificationPortGetMachPort(ctx->engine->notification_port);
+  if (!mnotification_port) {
+    softu2f_log(ctx, "Error getting mach notification port.\n");
+    return false;
+  }
+
   // Params to pass to the kernel.
   async_ref[kIOAsyncCalloutFuncIndex] = (uint64_t)softu2f_async_callback;
   async_ref[kIOAsyncCalloutRefconIndex] = (uint64_t)ctx;
@@ -131,29 +375,39 @@ void softu2f_run(softu2f_ctx *ctx) {
   ret = IOConnectCallAsyncScalarMethod(ctx->con, kSoftU2FUserClientNotifyFrame, mnotification_port, async_ref, kIOAsyncCalloutCount, NULL, 0, NULL, 0);
   if (ret != kIOReturnSuccess) {
     softu2f_log(ctx, "Error registering for setFrame notifications.\n");
-    return;
+    return false;
   }
 
-  // Blocks until the run loop is stopped in our callback.
-  softu2f_log(ctx, "Starting softu2f async run loop.\n");
-  ctx->run_loop = CFRunLoopGetCurrent();
-  CFRunLoopRun();
-  ctx->run_loop = NULL;
-
-  // Clean up.
-  IONotificationPortDestroy(notification_port);
+  return true;
 }
 
 // Shutdown the run loop.
 void softu2f_shutdown(softu2f_ctx *ctx) {
-  if (ctx->run_loop) {
+  if (ctx->engine->run_loop) {
     softu2f_log(ctx, "Shutting down softu2f run loop.\n");
-    CFRunLoopStop(ctx->run_loop);
+    CFRunLoopStop(ctx->engine->run_loop);
   } else {
     softu2f_log(ctx, "Error shutting down softu2f run loop.\n");
   }
 }
 
+// Set data for handlers to find on the device, such as its credentials.
+void softu2f_set_user_data(softu2f_ctx *ctx, void *data) {
+  ctx->user_data = data;
+}
+
+// Get data set with softu2f_set_user_data.
+void *softu2f_get_user_data(softu2f_ctx *ctx) {
+  return ctx->user_data;
+}
+
+// Get a snapshot of a device's counters.
+void softu2f_stats_get(softu2f_ctx *ctx, softu2f_stats *stats) {
+  pthread_mutex_lock(&ctx->engine->mutex);
+  *stats = ctx->stats;
+  pthread_mutex_unlock(&ctx->engine->mutex);
+}
+
 // Send a HID message to the device.
 bool softu2f_hid_msg_send(softu2f_ctx *ctx, softu2f_hid_message *msg) {
   uint8_t *src;
@@ -161,22 +415,32 @@ bool softu2f_hid_msg_send(softu2f_ctx *ctx, softu2f_hid_message *msg) {
   uint8_t *dst;
   uint8_t *dst_end;
   uint8_t seq = 0x00;
-  U2FHID_FRAME frame;
-  kern_return_t ret;
+  U2FHID_FRAME *frame;
+  softu2f_hid_stream *stream;
+  unsigned int nframes = 0;
 
-  memset(&frame, 0, HID_RPT_SIZE);
+  softu2f_retry_store_msg(ctx, msg);
+
+  // Build the frames in a stream to go out in turn with other responses.
+  stream = softu2f_hid_out_take(ctx);
+  if (!stream)
+    return false;
+
+  frame = SOFTU2F_FRAME_AT(stream->frames, 0, ctx->layout.rpt_size);
+  memset(frame, 0, ctx->layout.rpt_size);
 
   // Init frame.
-  frame.cid = msg->cid;
-  frame.type |= TYPE_INIT;
-  frame.init.cmd |= msg->cmd;
-  frame.init.bcnth = CFDataGetLength(msg->data) >> 8;
-  frame.init.bcntl = CFDataGetLength(msg->data) & 0xff;
+  frame->cid = msg->cid;
+  frame->type |= TYPE_INIT;
+  frame->init.cmd |= msg->cmd;
+  frame->init.bcnth = CFDataGetLength(msg->data) >> 8;
+  frame->init.bcntl = CFDataGetLength(msg->data) & 0xff;
 
   src = (uint8_t *)CFDataGetBytePtr(msg->data);
   src_end = src + CFDataGetLength(msg->data);
-  dst = frame.init.data;
-  dst_end = dst + sizeof(frame.init.data);
+  ctx->stats.bytes_copied += src_end - src;
+  dst = frame->init.data;
+  dst_end = dst + ctx->layout.init_payload;
 
   while (1) {
     if (src_end - src > dst_end - dst) {
@@ -187,45 +451,420 @@ bool softu2f_hid_msg_send(softu2f_ctx *ctx, softu2f_hid_message *msg) {
       src += src_end - src;
     }
 
-    // Send frame.
-    softu2f_debug_frame(ctx, &frame, false);
-    ret = IOConnectCallStructMethod(ctx->con, kSoftU2FUserClientSendFrame, &frame, HID_RPT_SIZE, NULL, NULL);
-    if (ret != kIOReturnSuccess) {
-      softu2f_log(ctx, "Error calling kSoftU2FUserClientSendFrame: 0x%08x\n", ret);
-      return false;
-    }
+    nframes++;
 
     // No more frames.
     if (src >= src_end)
       break;
 
-    // Sleep for a bit.
-    nanosleep(&softu2f_poll_interval, NULL);
+    frame = SOFTU2F_FRAME_AT(stream->frames, nframes, ctx->layout.rpt_size);
+    frame->cid = msg->cid;
 
     // Cont frame.
-    dst = frame.cont.data;
-    dst_end = dst + sizeof(frame.cont.data);
-    frame.cont.seq = seq++;
-    memset(frame.cont.data, 0, sizeof(frame.cont.data));
+    dst = frame->cont.data;
+    dst_end = dst + ctx->layout.cont_payload;
+    frame->cont.seq = seq++;
+    memset(frame->cont.data, 0, ctx->layout.cont_payload);
   }
 
+  softu2f_hid_out_queue(ctx, stream, nframes);
+
   return true;
 }
 
 // Send a HID error to the device.
 bool softu2f_hid_err_send(softu2f_ctx *ctx, uint32_t cid, uint8_t code) {
-  softu2f_hid_message msg;
+  uint8_t buf[kSoftU2FMaxReportSize];
+  U2FHID_FRAME *frame = (U2FHID_FRAME *)buf;
+
+  memset(buf, 0, ctx->layout.rpt_size);
+
+  frame->cid = cid;
+  frame->init.cmd = U2FHID_ERROR;
+  frame->init.bcntl = 1;
+  frame->init.data[0] = code;
+
+  ctx->stats.errors_sent++;
+
+  return softu2f_hid_out_frame_send(ctx, frame);
+}
+
+// Send an individual HID frame to the device.
+bool softu2f_hid_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  softu2f_debug_frame(ctx, frame, false);
+
+  if (!ctx->send_frame(ctx, frame))
+    return false;
+
+  ctx->stats.frames_sent++;
+
+  return true;
+}
+
+// Send an individual HID frame to the driver.
+bool softu2f_kext_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  kern_return_t ret;
+
+  ret = IOConnectCallStructMethod(ctx->con, kSoftU2FUserClientSendFrame, frame, ctx->layout.rpt_size, NULL, NULL);
+  if (ret != kIOReturnSuccess) {
+    softu2f_log(ctx, "Error calling kSoftU2FUserClientSendFrame: 0x%08x\n", ret);
+    return false;
+  }
+
+  return true;
+}
+
+// Start building a response directly in outbound frames.
+softu2f_hid_response *softu2f_hid_resp_start(softu2f_ctx *ctx, uint32_t cid, uint8_t cmd) {
+  softu2f_hid_response *resp = &ctx->resp;
+
+  if (resp->busy) {
+    softu2f_log(ctx, "Can't start response. Another response is being built.\n");
+    return NULL;
+  }
+
+  resp->busy = true;
+  resp->overflow = false;
+  resp->cid = cid;
+  resp->cmd = cmd;
+  resp->len = 0;
+
+  return resp;
+}
+
+// Append bytes to a response.
+bool softu2f_hid_resp_append(softu2f_hid_response *resp, const void *data, size_t len) {
+  const uint8_t *src = (const uint8_t *)data;
+  uint8_t *dst;
+  unsigned int avail;
+
+  if (resp->overflow || len > resp->layout.max_msg - resp->len) {
+    resp->overflow = true;
+    return false;
+  }
+
+  while (len > 0) {
+    dst = softu2f_hid_resp_payload(resp, resp->len, &avail);
+    if (avail > len)
+      avail = (unsigned int)len;
+
+    memcpy(dst, src, avail);
+    resp->len += avail;
+    src += avail;
+    len -= avail;
+  }
+
+  return true;
+}
+
+// Append a single byte to a response.
+bool softu2f_hid_resp_append_byte(softu2f_hid_response *resp, uint8_t byte) {
+  return softu2f_hid_resp_append(resp, &byte, 1);
+}
+
+// Append a big-endian 16 bit value, such as a status word, to a response.
+bool softu2f_hid_resp_append_u16(softu2f_hid_response *resp, uint16_t value) {
+  uint8_t bytes[2] = {value >> 8, value & 0xff};
+
+  return softu2f_hid_resp_append(resp, bytes, sizeof(bytes));
+}
+
+// Find where the payload byte at the given message offset lives in the
+// response's frames, and how many bytes are left in that frame.
+uint8_t *softu2f_hid_resp_payload(softu2f_hid_response *resp, uint16_t offset, unsigned int *avail) {
+  softu2f_frame_layout *layout = &resp->layout;
+  unsigned int index;
+
+  if (offset < layout->init_payload) {
+    *avail = layout->init_payload - offset;
+    return SOFTU2F_FRAME_AT(resp->frames, 0, layout->rpt_size)->init.data + offset;
+  }
+
+  offset -= layout->init_payload;
+  index = 1 + offset / layout->cont_payload;
+  offset %= layout->cont_payload;
+
+  *avail = layout->cont_payload - offset;
+  return SOFTU2F_FRAME_AT(resp->frames, index, layout->rpt_size)->cont.data + offset;
+}
+
+// Send a response, patching in its frame headers, and release the builder.
+bool softu2f_hid_resp_send(softu2f_ctx *ctx, softu2f_hid_response *resp) {
+  softu2f_frame_layout *layout = &resp->layout;
+  unsigned int nframes, avail, i;
+  softu2f_hid_stream *stream;
+  U2FHID_FRAME *frame;
+  uint8_t *tail, *frames;
+
+  if (resp->overflow) {
+    softu2f_log(ctx, "Response too large. Not sending.\n");
+    resp->busy = false;
+    return false;
+  }
+
+  // Length header.
+  frame = SOFTU2F_FRAME_AT(resp->frames, 0, layout->rpt_size);
+  frame->cid = resp->cid;
+  frame->init.cmd = resp->cmd | TYPE_INIT;
+  frame->init.bcnth = resp->len >> 8;
+  frame->init.bcntl = resp->len & 0xff;
+
+  // The payload was copied into the frames as it was appended.
+  ctx->stats.bytes_copied += resp->len;
+
+  // Cont frame headers.
+  nframes = 1;
+  if (resp->len > layout->init_payload)
+    nframes += (resp->len - layout->init_payload + layout->cont_payload - 1) / layout->cont_payload;
+
+  for (i = 1; i < nframes; i++) {
+    frame = SOFTU2F_FRAME_AT(resp->frames, i, layout->rpt_size);
+    frame->cid = resp->cid;
+    frame->cont.seq = i - 1;
+  }
+
+  // Clear whatever is left of the last frame.
+  if (resp->len < layout->init_payload || (resp->len - layout->init_payload) % layout->cont_payload) {
+    tail = softu2f_hid_resp_payload(resp, resp->len, &avail);
+    memset(tail, 0, avail);
+  }
+
+  softu2f_retry_store_resp(ctx, resp);
+
+  // Queue the frames, giving the builder the stream's frames in exchange.
+  stream = softu2f_hid_out_take(ctx);
+  if (!stream) {
+    resp->busy = false;
+    return false;
+  }
+
+  frames = stream->frames;
+  stream->frames = resp->frames;
+  resp->frames = frames;
+  resp->busy = false;
+
+  softu2f_hid_out_queue(ctx, stream, nframes);
+
+  return true;
+}
+
+// Discard a response without sending it and release the builder.
+void softu2f_hid_resp_discard(softu2f_ctx *ctx, softu2f_hid_response *resp) {
+  resp->busy = false;
+}
+
+// Release the response builder if a handler returned without sending or
+// discarding its response, so later responses can use it. Returns true if it
+// had to.
+bool softu2f_hid_resp_release(softu2f_ctx *ctx) {
+  if (!ctx->resp.busy)
+    return false;
+
+  softu2f_log(ctx, "Handler left a response unsent on CID: 0x%08x\n", ctx->resp.cid);
+  softu2f_hid_resp_discard(ctx, &ctx->resp);
+
+  return true;
+}
+
+// Read frames queued by the driver and handle them in batches.
+void softu2f_hid_frames_fetch(softu2f_ctx *ctx) {
+  uint8_t frames[kSoftU2FReadFramesSize];
+  size_t size;
+  kern_return_t ret;
+
+  do {
+    size = sizeof(frames);
+    ret = IOConnectCallStructMethod(ctx->con, kSoftU2FUserClientReadFrames, NULL, 0, frames, &size);
+    if (ret != kIOReturnSuccess) {
+      softu2f_log(ctx, "Error calling kSoftU2FUserClientReadFrames: 0x%08x\n", ret);
+      return;
+    }
+
+    softu2f_hid_frames_read(ctx, (U2FHID_FRAME *)frames, (unsigned int)(size / ctx->layout.rpt_size));
+  } while (size + ctx->layout.rpt_size > sizeof(frames));
+}
+
+// Compute frame geometry for a HID report size.
+void softu2f_frame_layout_init(softu2f_frame_layout *layout, uint16_t rpt_size) {
+  unsigned int max_msg;
+
+  layout->rpt_size = rpt_size;
+  layout->init_payload = rpt_size - 7;
+  layout->cont_payload = rpt_size - 5;
+
+  // BCNT is 16 bits, which caps messages before 128 CONT frames do for
+  // larger reports.
+  max_msg = layout->init_payload + (SOFTU2F_MAX_FRAMES - 1) * layout->cont_payload;
+  layout->max_msg = max_msg > 0xffff ? 0xffff : max_msg;
+}
+
+// Read a batch of HID frames into HID messages, handling messages as they
+// complete.
+void softu2f_hid_frames_read(softu2f_ctx *ctx, void *frames, unsigned int nframes) {
+  uint8_t classes[SOFTU2F_FRAME_BATCH];
+  unsigned int base, count, i;
+  softu2f_hid_message *msg = NULL;
+  U2FHID_FRAME *frame;
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+
+  // A message that timed out while no frames came in mustn't hold up other
+  // channels' INIT frames in this batch.
+  softu2f_hid_handle_timeouts(ctx);
 
-  msg.cmd = U2FHID_ERROR;
-  msg.cid = cid;
-  msg.bcnt = 1;
-  msg.data = CFDataCreateWithBytesNoCopy(NULL, &code, 1, NULL);
+  for (base = 0; base < nframes; base += count) {
+    count = nframes - base;
+    if (count > SOFTU2F_FRAME_BATCH)
+      count = SOFTU2F_FRAME_BATCH;
 
-  return softu2f_hid_msg_send(ctx, &msg);
+    // Classify the whole chunk before touching any messages.
+    softu2f_hid_frames_classify(frames, ctx->layout.rpt_size, base, count, classes);
+
+    for (i = 0; i < count; i++) {
+      frame = SOFTU2F_FRAME_AT(frames, base + i, ctx->layout.rpt_size);
+      softu2f_debug_frame(ctx, frame, true);
+      ctx->stats.frames_received++;
+
+      // A CONT frame continuing the message the previous frame was read into
+      // needs no lookup or validation beyond what classification did.
+      if (msg && (classes[i] & SOFTU2F_FRAME_CONTINUES)) {
+        msg->lastSeq++;
+        msg = softu2f_hid_msg_append_cont(ctx, msg, frame);
+      } else {
+        // A channel's next message, such as a CANCEL, can't overtake the
+        // one it sent before.
+        if ((classes[i] & SOFTU2F_FRAME_INIT) && softu2f_hid_ready_has(ctx, frame->cid))
+          softu2f_hid_handle_ready(ctx);
+
+        msg = softu2f_hid_frame_read(ctx, frame, classes[i]);
+      }
+    }
+
+    // Handle the messages the chunk completed together, so their hashes are
+    // computed together. Handlers can free messages, so look the next one up.
+    if (ctx->ready_list) {
+      softu2f_hid_handle_ready(ctx);
+      msg = NULL;
+    }
+  }
+
+  softu2f_hid_handle_timeouts(ctx);
+
+  // Send the batch's signing requests together.
+  if (ctx->signer)
+    softu2f_signer_flush(ctx);
+
+  pthread_mutex_unlock(&ctx->engine->mutex);
+}
+
+// Classify frames[base..base+count) by type, CID and sequence continuity.
+void softu2f_hid_frames_classify(U2FHID_FRAME *frames, uint16_t rpt_size, unsigned int base, unsigned int count, uint8_t *classes) {
+  U2FHID_FRAME *frame, *prev;
+  unsigned int i;
+  uint8_t expected;
+
+  // Branch-free over the fixed frame layout so the compiler can vectorize it.
+  for (i = 0; i < count; i++) {
+    frame = SOFTU2F_FRAME_AT(frames, base + i, rpt_size);
+    prev = (base + i > 0) ? SOFTU2F_FRAME_AT(frames, base + i - 1, rpt_size) : frame;
+    expected = FRAME_TYPE(*prev) == TYPE_INIT ? 0 : FRAME_SEQ(*prev) + 1;
+
+    classes[i] = (FRAME_TYPE(*frame) == TYPE_INIT ? SOFTU2F_FRAME_INIT : 0) |
+                 (frame->cid == 0x00000000 ? SOFTU2F_FRAME_CID_ZERO : 0) |
+                 (frame->cid == CID_BROADCAST ? SOFTU2F_FRAME_CID_BROADCAST : 0) |
+                 ((prev != frame && FRAME_TYPE(*frame) == TYPE_CONT && frame->cid == prev->cid && FRAME_SEQ(*frame) == expected) ? SOFTU2F_FRAME_CONTINUES : 0);
+  }
+}
+
+// Append the payload of a CONT frame to a message's read buffer. Returns the
+// message if it is still waiting for more frames.
+softu2f_hid_message *softu2f_hid_msg_append_cont(softu2f_ctx *ctx, softu2f_hid_message *msg, U2FHID_FRAME *frame) {
+  unsigned int ndata;
+
+  if (msg->stream)
+    return softu2f_hid_msg_echo_cont(ctx, msg, frame);
+
+  if (CFDataGetLength(msg->buf) + ctx->layout.cont_payload > msg->bcnt) {
+    ndata = msg->bcnt - (uint16_t)CFDataGetLength(msg->buf);
+  } else {
+    ndata = ctx->layout.cont_payload;
+  }
+
+  return softu2f_hid_msg_append(ctx, msg, frame->cont.data, ndata);
+}
+
+// Append data to a message's read buffer, moving it to the ready queue once
+// it is complete. Returns the message if it is still waiting for more frames.
+softu2f_hid_message *softu2f_hid_msg_append(softu2f_ctx *ctx, softu2f_hid_message *msg, uint8_t *data, unsigned int ndata) {
+  CFDataAppendBytes(msg->buf, data, ndata);
+  ctx->stats.bytes_copied += ndata;
+
+  if (!softu2f_hid_msg_is_complete(ctx, msg))
+    return msg;
+
+  softu2f_hid_msg_list_unlink(ctx, msg);
+
+  if (ctx->ready_tail) {
+    ctx->ready_tail->next = msg;
+  } else {
+    ctx->ready_list = msg;
+  }
+  ctx->ready_tail = msg;
+
+  return NULL;
+}
+
+// Start echoing a PING as its frames arrive. Returns the message tracking the
+// rest of the echo.
+softu2f_hid_message *softu2f_hid_msg_echo_init(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  softu2f_hid_message *msg;
+
+  msg = softu2f_hid_msg_list_create(ctx, frame->cid);
+  if (!msg)
+    return NULL;
+
+  msg->cmd = frame->init.cmd;
+  msg->bcnt = MSG_LEN(*frame);
+  msg->stream = true;
+
+  // The response INIT frame is identical to the request's. The rest of the
+  // echo is added to the same outbound stream as it arrives.
+  if (!softu2f_hid_out_open(ctx, frame)) {
+    softu2f_hid_msg_list_remove(ctx, msg);
+    return NULL;
+  }
+
+  return msg;
 }
 
-// Read an individual HID frame from the device into a HID message.
-void softu2f_hid_frame_read(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+// Echo a CONT frame of a streamed PING. Returns the message if it is still
+// waiting for more frames.
+softu2f_hid_message *softu2f_hid_msg_echo_cont(softu2f_ctx *ctx, softu2f_hid_message *msg, U2FHID_FRAME *frame) {
+  uint8_t buf[kSoftU2FMaxReportSize];
+  U2FHID_FRAME *resp = (U2FHID_FRAME *)buf;
+  unsigned int offset;
+
+  // Payload offset of the byte following this frame. lastSeq has already
+  // been advanced past this frame's SEQ.
+  offset = ctx->layout.init_payload + msg->lastSeq * ctx->layout.cont_payload;
+
+  memcpy(buf, frame, ctx->layout.rpt_size);
+
+  // Don't echo whatever the client padded the last frame with.
+  if (offset > msg->bcnt)
+    memset(resp->cont.data + ctx->layout.cont_payload - (offset - msg->bcnt), 0, offset - msg->bcnt);
+
+  if (!softu2f_hid_out_extend(ctx, resp) || offset >= msg->bcnt) {
+    softu2f_hid_msg_list_remove(ctx, msg);
+    return NULL;
+  }
+
+  return msg;
+}
+
+// Read an individual HID frame, classified by softu2f_hid_frames_classify,
+// into a HID message. Returns the message the frame was read into, if any.
+softu2f_hid_message *softu2f_hid_frame_read(softu2f_ctx *ctx, U2FHID_FRAME *frame, uint8_t cls) {
   uint8_t *data;
   unsigned int ndata;
   softu2f_hid_message *msg;
@@ -233,14 +872,19 @@ void softu2f_hid_frame_read(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
   // See if there's already a message in progress for this channel.
   msg = softu2f_hid_msg_list_find(ctx, frame->cid);
 
-  if (frame->cid == 0x00000000) {
+  if (cls & SOFTU2F_FRAME_CID_ZERO) {
     softu2f_log(ctx, "Frame with CID 0.\n");
     softu2f_hid_err_send(ctx, frame->cid, ERR_INVALID_CID);
-    return;
+    return NULL;
   }
 
-  switch (FRAME_TYPE(*frame)) {
-  case TYPE_INIT:
+  if (cls & SOFTU2F_FRAME_INIT) {
+    if (softu2f_hid_locked_out(ctx, frame))
+      return NULL;
+
+    if (!softu2f_admit_init(ctx, frame))
+      return NULL;
+
     if (msg) {
       if (frame->init.cmd == U2FHID_INIT) {
         softu2f_log(ctx, "U2FHID_INIT while waiting for CONT. Resetting.\n");
@@ -249,214 +893,420 @@ void softu2f_hid_frame_read(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
         softu2f_log(ctx, "INIT frame out of order. Bailing.\n");
         softu2f_hid_err_send(ctx, frame->cid, ERR_INVALID_SEQ);
         softu2f_hid_msg_list_remove(ctx, msg);
-        return;
+        return NULL;
       }
     } else if (frame->init.cmd == U2FHID_SYNC) {
       softu2f_log(ctx, "SYNC frame out of order. Bailing.\n");
       softu2f_hid_err_send(ctx, frame->cid, ERR_INVALID_CMD);
-      return;
+      return NULL;
     } else if (frame->init.cmd != U2FHID_INIT && softu2f_hid_msg_list_count(ctx) > 0) {
       softu2f_log(ctx, "INIT frame while waiting for CONT on other CID.\n");
       softu2f_hid_err_send(ctx, frame->cid, ERR_CHANNEL_BUSY);
-      return;
+      return NULL;
     }
 
-    if (frame->cid == CID_BROADCAST && frame->init.cmd != U2FHID_INIT) {
+    if ((cls & SOFTU2F_FRAME_CID_BROADCAST) && frame->init.cmd != U2FHID_INIT) {
       softu2f_log(ctx, "Non U2FHID_INIT message on broadcast CID.\n");
       softu2f_hid_err_send(ctx, frame->cid, ERR_INVALID_CID);
-      return;
+      return NULL;
+    }
+
+    // Messages that fit in the INIT frame skip reassembly entirely.
+    if (MSG_LEN(*frame) <= ctx->layout.init_payload) {
+      softu2f_hid_frame_dispatch(ctx, frame);
+      return NULL;
     }
 
-    msg = softu2f_hid_msg_list_create(ctx);
+    // Echo PINGs frame by frame rather than waiting for the whole message.
+    if (frame->init.cmd == U2FHID_PING && ctx->stream_ping && !ctx->handlers[SOFTU2F_CMD_INDEX(U2FHID_PING)] && MSG_LEN(*frame) <= ctx->layout.max_msg)
+      return softu2f_hid_msg_echo_init(ctx, frame);
+
+    msg = softu2f_hid_msg_list_create(ctx, frame->cid);
     if (!msg)
-      return;
+      return NULL;
 
     msg->cmd = frame->init.cmd;
-    msg->cid = frame->cid;
     msg->bcnt = MSG_LEN(*frame);
 
     // From the spec: With a packet size of 64 bytes (max for full-speed
     // devices), this means that the maximum message payload length is
     // 64 - 7 + 128 * (64 - 5) = 7609 bytes.
-    if (msg->bcnt > 7609) {
+    if (msg->bcnt > ctx->layout.max_msg) {
       softu2f_log(ctx, "BCNT too large (%u). Bailing.\n", msg->bcnt);
       softu2f_hid_err_send(ctx, msg->cid, ERR_INVALID_LEN);
       softu2f_hid_msg_list_remove(ctx, msg);
-      return;
+      return NULL;
     }
 
     msg->buf = CFDataCreateMutable(NULL, msg->bcnt);
 
     data = frame->init.data;
 
-    if (msg->bcnt > sizeof(frame->init.data)) {
-      ndata = sizeof(frame->init.data);
+    if (msg->bcnt > ctx->layout.init_payload) {
+      ndata = ctx->layout.init_payload;
     } else {
       ndata = msg->bcnt;
     }
-
-    break;
-  case TYPE_CONT:
+  } else {
     if (!msg) {
       softu2f_log(ctx, "CONT frame out of order. Ignoring\n");
-      return;
+      return NULL;
     }
 
     if (FRAME_SEQ(*frame) != msg->lastSeq++) {
       softu2f_log(ctx, "Bad SEQ in CONT frame (%d). Bailing\n", FRAME_SEQ(*frame));
       softu2f_hid_msg_list_remove(ctx, msg);
       softu2f_hid_err_send(ctx, frame->cid, ERR_INVALID_SEQ);
-      return;
+      return NULL;
     }
 
-    data = frame->cont.data;
+    return softu2f_hid_msg_append_cont(ctx, msg, frame);
+  }
 
-    if (CFDataGetLength(msg->buf) + sizeof(frame->cont.data) > msg->bcnt) {
-      ndata = msg->bcnt - (uint16_t)CFDataGetLength(msg->buf);
-    } else {
-      ndata = sizeof(frame->cont.data);
-    }
+  return softu2f_hid_msg_append(ctx, msg, data, ndata);
+}
 
-    break;
-  default:
-    softu2f_log(ctx, "Unknown frame type: 0x%08x\n", FRAME_TYPE(*frame));
+// Dispatch a message contained entirely in an INIT frame, without copying
+// its payload out of the frame.
+void softu2f_hid_frame_dispatch(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  softu2f_hid_message msg = {0};
+
+  msg.cmd = frame->init.cmd;
+  msg.cid = frame->cid;
+  msg.bcnt = MSG_LEN(*frame);
+
+  // The CFData object comes from the device's frame_data. A handler can
+  // dispatch another message while that's in use, which gets one allocated
+  // as usual.
+  msg.data = CFDataCreateWithBytesNoCopy(ctx->frame_allocator, frame->init.data, msg.bcnt, kCFAllocatorNull);
+  if (!msg.data)
+    msg.data = CFDataCreateWithBytesNoCopy(NULL, frame->init.data, msg.bcnt, kCFAllocatorNull);
+  if (!msg.data) {
+    softu2f_log(ctx, "No memory for new message.\n");
     return;
   }
 
-  CFDataAppendBytes(msg->buf, data, ndata);
+  softu2f_hid_msg_dispatch(ctx, &msg);
+  softu2f_scratch_reset(ctx, &msg);
+
+  CFRelease(msg.data);
+}
+
+// Create the allocator for the CFData wrapping single-frame messages.
+CFAllocatorRef softu2f_frame_allocator_create(softu2f_ctx *ctx) {
+  CFAllocatorContext context;
+
+  memset(&context, 0, sizeof(CFAllocatorContext));
+  context.info = ctx;
+  context.allocate = softu2f_frame_allocate;
+  context.deallocate = softu2f_frame_deallocate;
+
+  return CFAllocatorCreate(kCFAllocatorSystemDefault, &context);
+}
+
+// Allocate from the device's frame_data, if it's free and big enough.
+void *softu2f_frame_allocate(CFIndex size, CFOptionFlags hint, void *info) {
+  softu2f_ctx *ctx = (softu2f_ctx *)info;
+
+  if (ctx->frame_data_used || size > SOFTU2F_FRAME_DATA_SIZE)
+    return NULL;
+
+  ctx->frame_data_used = true;
+  return ctx->frame_data;
 }
 
-// Handle complete messages. Abort messages that timed out.
+// Give frame_data back.
+void softu2f_frame_deallocate(void *ptr, void *info) {
+  softu2f_ctx *ctx = (softu2f_ctx *)info;
+
+  if (ptr == ctx->frame_data)
+    ctx->frame_data_used = false;
+}
+
+// Handle complete messages. Abort messages that timed out, keep deferred
+// requests alive until their deadlines, make scheduled calls and send queued
+// frames.
 void softu2f_hid_handle_messages(softu2f_ctx *ctx) {
-  softu2f_hid_message *msg = NULL;
-  softu2f_hid_message *nextMsg = ctx->msg_list;
-  softu2f_hid_message_handler handler = NULL;
+  softu2f_hid_handle_ready(ctx);
+  softu2f_hid_handle_timeouts(ctx);
+  softu2f_hid_pending_watchdog(ctx);
+  softu2f_hid_pending_keepalive(ctx);
+  softu2f_calls_run(ctx);
+  softu2f_hid_out_pump(ctx);
+
+  if (ctx->signer)
+    softu2f_signer_flush(ctx);
+}
 
-  while (nextMsg) {
-    msg = nextMsg;
-    nextMsg = msg->next;
+// Dispatch and free messages on the ready queue.
+void softu2f_hid_handle_ready(softu2f_ctx *ctx) {
+  softu2f_hid_message *msg;
 
-    if (softu2f_hid_msg_is_complete(ctx, msg)) {
-      softu2f_hid_msg_finalize(ctx, msg);
-      handler = softu2f_hid_msg_handler(ctx, msg);
+  softu2f_retry_hash_ready(ctx);
 
-      if (handler) {
-        if (!handler(ctx, msg)) {
-          softu2f_log(ctx, "Error handling HID message\n");
-        }
-      } else {
-        softu2f_log(ctx, "No handler for HID message\n");
-        softu2f_hid_err_send(ctx, msg->cid, ERR_INVALID_CMD);
-      }
+  while ((msg = ctx->ready_list)) {
+    ctx->ready_list = msg->next;
+    if (!ctx->ready_list)
+      ctx->ready_tail = NULL;
+    msg->next = NULL;
 
-      softu2f_hid_msg_list_remove(ctx, msg);
-    } else if (softu2f_hid_msg_is_timed_out(ctx, msg)) {
-      softu2f_log(ctx, "Message timeout on CID: 0x%08x\n", msg->cid);
-      softu2f_hid_err_send(ctx, msg->cid, ERR_MSG_TIMEOUT);
-      softu2f_hid_msg_list_remove(ctx, msg);
+    softu2f_hid_msg_finalize(ctx, msg);
+    softu2f_hid_msg_dispatch(ctx, msg);
+    softu2f_scratch_reset(ctx, msg);
+    softu2f_hid_msg_release(ctx, msg);
+  }
+}
+
+// Check if a channel has a message waiting on the ready queue.
+bool softu2f_hid_ready_has(softu2f_ctx *ctx, uint32_t cid) {
+  softu2f_hid_message *msg;
+
+  for (msg = ctx->ready_list; msg; msg = msg->next) {
+    if (msg->cid == cid)
+      return true;
+  }
+
+  return false;
+}
+
+// Abort messages that timed out. The message list is in creation order and
+// every message has the same timeout, so only its head needs checking.
+void softu2f_hid_handle_timeouts(softu2f_ctx *ctx) {
+  softu2f_hid_message *msg;
+
+  while ((msg = ctx->msg_list) && softu2f_hid_msg_is_timed_out(ctx, msg)) {
+    softu2f_log(ctx, "Message timeout on CID: 0x%08x\n", msg->cid);
+    ctx->stats.timeouts++;
+    softu2f_hid_err_send(ctx, msg->cid, ERR_MSG_TIMEOUT);
+    softu2f_hid_msg_list_remove(ctx, msg);
+  }
+}
+
+// Call the handler for a complete message.
+void softu2f_hid_msg_dispatch(softu2f_ctx *ctx, softu2f_hid_message *msg) {
+  softu2f_hid_message_handler handler;
+  softu2f_async_handler *async;
+  softu2f_hid_pending *pending;
+  uint8_t cmd;
+  double start;
+
+  ctx->stats.messages_handled++;
+  msg->scratch = &ctx->scratch;
+
+  pending = softu2f_hid_pending_find(ctx, msg->cid);
+
+  // CANCEL gets no response, whether or not there's anything to cancel. A
+  // cancelled CTAP2 request is answered with CTAP2_ERR_KEEPALIVE_CANCEL.
+  if (msg->cmd == U2FHID_CANCEL) {
+    if (pending) {
+      // The cancel callback may free the request.
+      cmd = pending->cmd;
+      softu2f_hid_pending_cancel(ctx, pending);
+      if (cmd == U2FHID_CBOR)
+        softu2f_ctap_status_send(ctx, msg->cid, CTAP2_ERR_KEEPALIVE_CANCEL);
+    }
+    return;
+  }
+
+  // Channels handle one request at a time. INIT abandons a deferred request.
+  if (pending) {
+    if (msg->cmd != U2FHID_INIT) {
+      softu2f_hid_err_send(ctx, msg->cid, ERR_CHANNEL_BUSY);
+      return;
+    }
+
+    softu2f_hid_pending_cancel(ctx, pending);
+  }
+
+  // Turn away probes for other authenticators' key handles.
+  if (ctx->key_filter && msg->cmd == U2FHID_MSG && softu2f_key_filter_check(ctx, msg))
+    return;
+
+  // Answer a request resent after the client gave up on us.
+  if (!ctx->workers && softu2f_retry_check(ctx, msg))
+    return;
+
+  // U2F messages go to worker processes when there are any.
+  if (ctx->workers && msg->cmd == U2FHID_MSG) {
+    softu2f_workers_dispatch(ctx, msg);
+    return;
+  }
+
+  async = &ctx->async_handlers[SOFTU2F_CMD_INDEX(msg->cmd)];
+  if (async->handler) {
+    pending = softu2f_hid_pending_create(ctx, msg);
+    if (!pending) {
+      softu2f_hid_err_send(ctx, msg->cid, ERR_OTHER);
+      return;
     }
 
-    handler = NULL;
+    start = softu2f_time_now(ctx);
+    async->handler(ctx, pending, msg, async->info);
+    softu2f_hid_handler_done(ctx, msg, start);
+
+    // The request is still answered when it completes.
+    softu2f_hid_resp_release(ctx);
+    return;
+  }
+
+  handler = softu2f_hid_msg_handler(ctx, msg);
+
+  if (handler) {
+    start = softu2f_time_now(ctx);
+    if (!handler(ctx, msg)) {
+      softu2f_log(ctx, "Error handling HID message\n");
+    }
+    softu2f_hid_handler_done(ctx, msg, start);
+
+    if (softu2f_hid_resp_release(ctx))
+      softu2f_hid_err_send(ctx, msg->cid, ERR_OTHER);
+  } else {
+    softu2f_log(ctx, "No handler for HID message\n");
+    softu2f_hid_err_send(ctx, msg->cid, ERR_INVALID_CMD);
   }
 }
 
 // Register a handler for a message type.
 void softu2f_hid_msg_handler_register(softu2f_ctx *ctx, uint8_t type, softu2f_hid_message_handler handler) {
-  switch (type) {
-  case U2FHID_PING:
-    ctx->ping_handler = handler;
-    break;
-  case U2FHID_MSG:
-    ctx->msg_handler = handler;
-    break;
-  case U2FHID_INIT:
-    ctx->init_handler = handler;
-    break;
-  case U2FHID_WINK:
-    ctx->wink_handler = handler;
-    break;
-  case U2FHID_SYNC:
-    ctx->sync_handler = handler;
-    break;
-  }
+  ctx->handlers[SOFTU2F_CMD_INDEX(type)] = handler;
 }
 
 // Find a message handler for a message.
 softu2f_hid_message_handler softu2f_hid_msg_handler(softu2f_ctx *ctx, softu2f_hid_message *msg) {
-  switch (msg->cmd) {
-  case U2FHID_PING:
-    if (ctx->ping_handler)
-      return ctx->ping_handler;
-    break;
-  case U2FHID_MSG:
-    if (ctx->msg_handler)
-      return ctx->msg_handler;
-    break;
-  case U2FHID_INIT:
-    if (ctx->init_handler)
-      return ctx->init_handler;
-    break;
-  case U2FHID_WINK:
-    if (ctx->wink_handler)
-      return ctx->wink_handler;
-    break;
-  case U2FHID_SYNC:
-    if (ctx->sync_handler)
-      return ctx->sync_handler;
-    break;
-  }
+  softu2f_hid_message_handler handler = ctx->handlers[SOFTU2F_CMD_INDEX(msg->cmd)];
+
+  if (handler)
+    return handler;
 
   return softu2f_hid_msg_handler_default(ctx, msg);
 }
 
 // Find the default message handler for a message.
 softu2f_hid_message_handler softu2f_hid_msg_handler_default(softu2f_ctx *ctx, softu2f_hid_message *msg) {
-  switch (msg->cmd) {
-  case U2FHID_PING:
-    return softu2f_hid_msg_handle_ping;
-  case U2FHID_MSG:
-    return NULL;
-  case U2FHID_INIT:
-    return softu2f_hid_msg_handle_init;
-  case U2FHID_WINK:
-    return softu2f_hid_msg_handle_wink;
-  case U2FHID_SYNC:
-    return softu2f_hid_msg_handle_sync;
-  default:
-    return NULL;
+  return softu2f_hid_default_handlers[SOFTU2F_CMD_INDEX(msg->cmd)];
+}
+
+// Lock the device to a channel for a LOCK request.
+bool softu2f_hid_msg_handle_lock(softu2f_ctx *ctx, softu2f_hid_message *req) {
+  softu2f_hid_response *resp;
+  uint8_t seconds;
+
+  if (req->bcnt != 1) {
+    softu2f_hid_err_send(ctx, req->cid, ERR_INVALID_LEN);
+    return false;
+  }
+
+  seconds = *CFDataGetBytePtr(req->data);
+  if (seconds > SOFTU2F_LOCK_MAX) {
+    softu2f_hid_err_send(ctx, req->cid, ERR_INVALID_PAR);
+    return false;
+  }
+
+  // Zero seconds releases the lock.
+  if (seconds == 0) {
+    ctx->lock_cid = 0;
+  } else {
+    ctx->lock_cid = req->cid;
+    ctx->lock_until = softu2f_time_now(ctx) + seconds;
   }
+
+  resp = softu2f_hid_resp_start(ctx, req->cid, U2FHID_LOCK);
+  if (!resp)
+    return false;
+
+  return softu2f_hid_resp_send(ctx, resp);
 }
 
+// Check whether an INIT frame is shut out by another channel's LOCK. Shut out
+// frames get ERR_CHANNEL_BUSY.
+bool softu2f_hid_locked_out(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  if (ctx->lock_cid == 0 || ctx->lock_cid == frame->cid)
+    return false;
+
+  // Expired locks are dropped when next looked at.
+  if (softu2f_time_now(ctx) >= ctx->lock_until) {
+    ctx->lock_cid = 0;
+    return false;
+  }
+
+  softu2f_log(ctx, "CID 0x%08x locked out by CID 0x%08x\n", frame->cid, ctx->lock_cid);
+  ctx->stats.locked_out++;
+  softu2f_hid_err_send(ctx, frame->cid, ERR_CHANNEL_BUSY);
+  return true;
+}
+
+// Send the device's counters for a vendor STATS request.
+bool softu2f_hid_msg_handle_stats(softu2f_ctx *ctx, softu2f_hid_message *req) {
+  const uint64_t *counters = (const uint64_t *)&ctx->stats;
+  uint8_t hdr[2] = {SOFTU2F_STATS_VERSION, SOFTU2F_STATS_COUNT};
+  softu2f_hid_response *resp;
+  uint8_t value[8];
+  unsigned int i;
+
+  resp = softu2f_hid_resp_start(ctx, req->cid, SOFTU2F_VENDOR_STATS);
+  if (!resp)
+    return false;
+
+  softu2f_hid_resp_append(resp, hdr, sizeof(hdr));
+
+  // Counters in softu2f_stats order, big-endian.
+  for (i = 0; i < SOFTU2F_STATS_COUNT; i++) {
+    softu2f_be32_put(value, (uint32_t)(counters[i] >> 32));
+    softu2f_be32_put(value + 4, (uint32_t)counters[i]);
+    softu2f_hid_resp_append(resp, value, sizeof(value));
+  }
+
+  return softu2f_hid_resp_send(ctx, resp);
+}
+
+// Handlers used when none is registered, by command.
+const softu2f_hid_message_handler softu2f_hid_default_handlers[SOFTU2F_CMD_COUNT] = {
+    [SOFTU2F_CMD_INDEX(U2FHID_PING)] = softu2f_hid_msg_handle_ping,
+    [SOFTU2F_CMD_INDEX(U2FHID_INIT)] = softu2f_hid_msg_handle_init,
+    [SOFTU2F_CMD_INDEX(U2FHID_WINK)] = softu2f_hid_msg_handle_wink,
+    [SOFTU2F_CMD_INDEX(U2FHID_SYNC)] = softu2f_hid_msg_handle_sync,
+    [SOFTU2F_CMD_INDEX(U2FHID_LOCK)] = softu2f_hid_msg_handle_lock,
+    [SOFTU2F_CMD_INDEX(SOFTU2F_VENDOR_STATS)] = softu2f_hid_msg_handle_stats,
+};
+
 // Send an INIT response for a given request.
 bool softu2f_hid_msg_handle_init(softu2f_ctx *ctx, softu2f_hid_message *req) {
-  softu2f_hid_message resp;
-  U2FHID_INIT_RESP resp_data = {0};
+  softu2f_hid_response *resp;
   U2FHID_INIT_REQ *req_data;
+  uint32_t resp_cid, cid;
+  uint8_t versions[] = {
+      U2FHID_IF_VERSION,           // versionInterface
+      0,                           // versionMajor
+      0,                           // versionMinor
+      0,                           // versionBuild
+      CAPFLAG_WINK | CAPFLAG_LOCK, // capFlags
+  };
 
   req_data = (U2FHID_INIT_REQ *)CFDataGetBytePtr(req->data);
 
-  resp.cmd = U2FHID_INIT;
-  resp.bcnt = sizeof(U2FHID_INIT_RESP);
-  resp.data = CFDataCreateWithBytesNoCopy(NULL, (uint8_t *)&resp_data, resp.bcnt, NULL);
+  if (ctx->handlers[SOFTU2F_CMD_INDEX(U2FHID_CBOR)] || ctx->async_handlers[SOFTU2F_CMD_INDEX(U2FHID_CBOR)].handler)
+    versions[4] |= CAPFLAG_CBOR;
 
   if (req->cid == CID_BROADCAST) {
     // Allocate a new CID for the client and tell them about it.
-    resp.cid = CID_BROADCAST;
-    resp_data.cid = ++ctx->next_cid;
+    resp_cid = CID_BROADCAST;
+    cid = ++ctx->next_cid;
   } else {
     // Use whatever CID they wanted.
-    resp.cid = req->cid;
-    resp_data.cid = req->cid;
+    resp_cid = req->cid;
+    cid = req->cid;
   }
 
-  memcpy(resp_data.nonce, req_data->nonce, INIT_NONCE_SIZE);
-  resp_data.versionInterface = U2FHID_IF_VERSION;
-  resp_data.versionMajor = 0;
-  resp_data.versionMinor = 0;
-  resp_data.versionBuild = 0;
-  resp_data.capFlags |= CAPFLAG_WINK;
+  // Fields are appended in U2FHID_INIT_RESP order.
+  resp = softu2f_hid_resp_start(ctx, resp_cid, U2FHID_INIT);
+  if (!resp)
+    return false;
 
-  return softu2f_hid_msg_send(ctx, &resp);
+  softu2f_hid_resp_append(resp, req_data->nonce, INIT_NONCE_SIZE);
+  softu2f_hid_resp_append(resp, &cid, sizeof(cid));
+  softu2f_hid_resp_append(resp, versions, sizeof(versions));
+
+  return softu2f_hid_resp_send(ctx, resp);
 }
 
 // Send a PING response for a given request.
@@ -496,39 +1346,44 @@ bool softu2f_hid_msg_handle_sync(softu2f_ctx *ctx, softu2f_hid_message *req) {
 }
 
 // Create a new message and add it to the list.
-softu2f_hid_message *softu2f_hid_msg_list_create(softu2f_ctx *ctx) {
+softu2f_hid_message *softu2f_hid_msg_list_create(softu2f_ctx *ctx, uint32_t cid) {
   softu2f_hid_message *msg;
-  softu2f_hid_message *last_msg = NULL;
+  softu2f_hid_message **bucket;
 
   msg = softu2f_hid_msg_alloc(ctx);
   if (!msg)
     return NULL;
 
-  // No messages in list. Start a new list.
-  if (!ctx->msg_list) {
-    ctx->msg_list = msg;
-    return msg;
-  }
+  msg->cid = cid;
 
   // Add new message to end of list.
-  last_msg = ctx->msg_list;
-  while (last_msg->next) {
-    last_msg = last_msg->next;
+  msg->prev = ctx->msg_list_tail;
+  if (ctx->msg_list_tail) {
+    ctx->msg_list_tail->next = msg;
+  } else {
+    ctx->msg_list = msg;
   }
-  last_msg->next = msg;
+  ctx->msg_list_tail = msg;
+
+  // Add new message to its CID bucket.
+  bucket = &ctx->msg_table[cid % SOFTU2F_MSG_TABLE_SIZE];
+  msg->cid_next = *bucket;
+  *bucket = msg;
+
+  ctx->msg_count++;
 
   return msg;
 }
 
 // Find a message with the given cid.
 softu2f_hid_message *softu2f_hid_msg_list_find(softu2f_ctx *ctx, uint32_t cid) {
-  softu2f_hid_message *msg = ctx->msg_list;
+  softu2f_hid_message *msg = ctx->msg_table[cid % SOFTU2F_MSG_TABLE_SIZE];
 
   while (msg) {
     if (msg->cid == cid)
       break;
 
-    msg = msg->next;
+    msg = msg->cid_next;
   }
 
   return msg;
@@ -536,48 +1391,67 @@ softu2f_hid_message *softu2f_hid_msg_list_find(softu2f_ctx *ctx, uint32_t cid) {
 
 // Get size of message list.
 unsigned int softu2f_hid_msg_list_count(softu2f_ctx *ctx) {
-  softu2f_hid_message *msg = ctx->msg_list;
-  unsigned int count = 0;
-
-  while (msg) {
-    count++;
-    msg = msg->next;
-  }
-
-  return count;
+  return ctx->msg_count;
 }
 
 // Remove a message from the list and free it.
 void softu2f_hid_msg_list_remove(softu2f_ctx *ctx, softu2f_hid_message *msg) {
-  softu2f_hid_message *previous;
+  // Send what a PING echo cut short has, so responses queued behind it go.
+  if (msg->stream)
+    softu2f_hid_out_close(ctx, msg->cid);
+
+  softu2f_hid_msg_list_unlink(ctx, msg);
+  softu2f_hid_msg_release(ctx, msg);
+}
+
+// Remove a message from the list without freeing it.
+void softu2f_hid_msg_list_unlink(softu2f_ctx *ctx, softu2f_hid_message *msg) {
+  softu2f_hid_message **bucket;
 
-  // msg is first.
-  if (msg == ctx->msg_list) {
+  // Remove msg from list.
+  if (msg->prev) {
+    msg->prev->next = msg->next;
+  } else {
     ctx->msg_list = msg->next;
-    softu2f_hid_msg_free(msg);
-    return;
   }
 
-  // find previous msg.
-  previous = ctx->msg_list;
-  while (previous && previous->next != msg) {
-    previous = previous->next;
+  if (msg->next) {
+    msg->next->prev = msg->prev;
+  } else {
+    ctx->msg_list_tail = msg->prev;
   }
 
-  // msg not in list.
-  if (!previous)
-    return;
+  // Remove msg from its CID bucket.
+  bucket = &ctx->msg_table[msg->cid % SOFTU2F_MSG_TABLE_SIZE];
+  while (*bucket && *bucket != msg) {
+    bucket = &(*bucket)->cid_next;
+  }
 
-  // Remove msg from list.
-  previous->next = msg->next;
-  softu2f_hid_msg_free(msg);
+  if (*bucket)
+    *bucket = msg->cid_next;
+
+  msg->next = NULL;
+  msg->prev = NULL;
+  msg->cid_next = NULL;
+  ctx->msg_count--;
 }
 
 // Allocate memory for a new message.
 softu2f_hid_message *softu2f_hid_msg_alloc(softu2f_ctx *ctx) {
+  softu2f_engine *engine = ctx->engine;
   softu2f_hid_message *msg;
 
-  msg = (softu2f_hid_message *)calloc(1, sizeof(softu2f_hid_message));
+  // Reuse a message from the engine's pool if there is one.
+  if ((msg = engine->msg_pool)) {
+    engine->msg_pool = msg->next;
+    engine->msg_pool_count--;
+    memset(msg, 0, sizeof(softu2f_hid_message));
+  } else {
+    // Through the engine's allocator, so it can be counted.
+    msg = (softu2f_hid_message *)CFAllocatorAllocate(engine->allocator, sizeof(softu2f_hid_message), 0);
+    if (msg)
+      memset(msg, 0, sizeof(softu2f_hid_message));
+  }
 
   if (!msg) {
     softu2f_log(ctx, "No memory for new message.\n");
@@ -585,21 +1459,16 @@ softu2f_hid_message *softu2f_hid_msg_alloc(softu2f_ctx *ctx) {
   }
 
   // Make note of when message was created.
-  gettimeofday(&msg->start, NULL);
+  msg->start = softu2f_time_now(ctx);
 
   return msg;
 }
 
 // Check if the message has timed out.
 bool softu2f_hid_msg_is_timed_out(softu2f_ctx *ctx, softu2f_hid_message *msg) {
-  struct timeval now, delta;
-  gettimeofday(&now, NULL);
-
-  timersub(&now, &msg->start, &delta);
-
   // Spec says 3 seconds (U2FHID_TRANS_TIMEOUT)
   // Conformance test expects 0.5 seconds though.
-  return delta.tv_usec > 500000L;
+  return softu2f_time_now(ctx) - msg->start > 0.5;
 }
 
 // Check if we've read the whole message.
@@ -616,18 +1485,40 @@ bool softu2f_hid_msg_is_complete(softu2f_ctx *ctx, softu2f_hid_message *msg) {
 // Initialize the message's data with the contents of its read buffer.
 void softu2f_hid_msg_finalize(softu2f_ctx *ctx, softu2f_hid_message *msg) {
   msg->data = CFDataCreateCopy(NULL, msg->buf);
+  ctx->stats.bytes_copied += msg->bcnt;
   CFRelease(msg->buf);
   msg->buf = NULL;
 }
 
+// Free a message's data and return it to the engine's pool.
+void softu2f_hid_msg_release(softu2f_ctx *ctx, softu2f_hid_message *msg) {
+  softu2f_engine *engine = ctx->engine;
+
+  if (engine->msg_pool_count >= SOFTU2F_MSG_POOL_SIZE) {
+    softu2f_hid_msg_free(engine, msg);
+    return;
+  }
+
+  if (msg->data)
+    CFRelease(msg->data);
+  if (msg->buf)
+    CFRelease(msg->buf);
+
+  msg->data = NULL;
+  msg->buf = NULL;
+  msg->next = engine->msg_pool;
+  engine->msg_pool = msg;
+  engine->msg_pool_count++;
+}
+
 // Free a HID message and associated data.
-void softu2f_hid_msg_free(softu2f_hid_message *msg) {
+void softu2f_hid_msg_free(softu2f_engine *engine, softu2f_hid_message *msg) {
   if (msg) {
     if (msg->data)
       CFRelease(msg->data);
     if (msg->buf)
       CFRelease(msg->buf);
-    free(msg);
+    CFAllocatorDeallocate(engine->allocator, msg);
   }
 }
 
@@ -661,7 +1552,7 @@ void softu2f_debug_frame(softu2f_ctx *ctx, U2FHID_FRAME *frame, bool recv) {
     softu2f_log(ctx, "\tBCNTH: 0x%02x\n", frame->init.bcnth);
     softu2f_log(ctx, "\tBCNTL: 0x%02x\n", frame->init.bcntl);
     data = frame->init.data;
-    dlen = HID_RPT_SIZE - 7;
+    dlen = ctx->layout.init_payload;
 
     break;
 
@@ -669,7 +1560,7 @@ void softu2f_debug_frame(softu2f_ctx *ctx, U2FHID_FRAME *frame, bool recv) {
     softu2f_log(ctx, "\tTYPE: CONT\n");
     softu2f_log(ctx, "\tSEQ: 0x%02x\n", frame->cont.seq);
     data = frame->cont.data;
-    dlen = HID_RPT_SIZE - 5;
+    dlen = ctx->layout.cont_payload;
 
     break;
   }
@@ -694,23 +1585,27 @@ void softu2f_async_callback(void *refcon, IOReturn result, io_user_reference_t*
 
   ctx = (softu2f_ctx *)refcon;
 
-  if (numArgs * sizeof(io_user_reference_t) != sizeof(U2FHID_FRAME)) {
+  // Reports too large to pass inline are queued by the driver.
+  if (numArgs == 0 && ctx->layout.rpt_size > kSoftU2FInlineReportSize) {
+    pthread_mutex_lock(&ctx->engine->mutex);
+    softu2f_hid_frames_fetch(ctx);
+    pthread_mutex_unlock(&ctx->engine->mutex);
+    return;
+  }
+
+  if (numArgs * sizeof(io_user_reference_t) != ctx->layout.rpt_size) {
     softu2f_log(ctx, "Unexpected argument count in softu2f_async_callback.\n");
     goto stop;
   }
 
   frame = (U2FHID_FRAME *)args;
-  softu2f_debug_frame(ctx, frame, true);
-
-  pthread_mutex_lock(&ctx->mutex);
 
-  // Read frame into a HID message.
-  softu2f_hid_frame_read(ctx, frame);
+  pthread_mutex_lock(&ctx->engine->mutex);
 
-  // Handle any completed messages.
-  softu2f_hid_handle_messages(ctx);
+  // Read frame into a HID message and handle any completed messages.
+  softu2f_hid_frames_read(ctx, frame, 1);
 
-  pthread_mutex_unlock(&ctx->mutex);
+  pthread_mutex_unlock(&ctx->engine->mutex);
 
   return;
 
@@ -723,23 +1618,36 @@ stop:
 
 // Called periodically in our runloop.
 void softu2f_async_timer_callback(CFRunLoopTimerRef timer, void* info) {
-  softu2f_ctx *ctx = (softu2f_ctx *)info;
+  softu2f_engine *engine = (softu2f_engine *)info;
+  softu2f_ctx *device;
 
-  if (!ctx)
-    goto stop;
+  if (!engine) {
+    printf("Unexpected call to softu2f_async_timer_callback.\n");
+    CFRunLoopStop(CFRunLoopGetCurrent());
+    return;
+  }
 
-  pthread_mutex_lock(&ctx->mutex);
+  pthread_mutex_lock(&engine->mutex);
 
   // Handle any completed messages (checking for timeouts).
-  softu2f_hid_handle_messages(ctx);
+  for (device = engine->devices; device; device = device->next_device) {
+    softu2f_hid_handle_messages(device);
+  }
+
+  pthread_mutex_unlock(&engine->mutex);
+}
 
-  pthread_mutex_unlock(&ctx->mutex);
+// Fire the run loop's timer after the given seconds, if it would fire later.
+// Returns false if the run loop isn't running.
+bool softu2f_async_timer_wake(softu2f_engine *engine, double seconds) {
+  CFAbsoluteTime fire;
 
-  return;
+  if (!engine->run_loop_timer)
+    return false;
 
-stop:
-  if (ctx)
-    softu2f_log(ctx, "Shutting down softu2f async run loop because of error.\n");
+  fire = CFAbsoluteTimeGetCurrent() + seconds;
+  if (fire < CFRunLoopTimerGetNextFireDate(engine->run_loop_timer))
+    CFRunLoopTimerSetNextFireDate(engine->run_loop_timer, fire);
 
-  CFRunLoopStop(CFRunLoopGetCurrent());
+  return true;
 }
@@ -13,11 +13,22 @@
 
 typedef struct softu2f_ctx softu2f_ctx;
 typedef struct softu2f_hid_message softu2f_hid_message;
+typedef struct softu2f_hid_response softu2f_hid_response;
+typedef struct softu2f_hid_pending softu2f_hid_pending;
+typedef struct softu2f_scratch softu2f_scratch;
 
 // Handler function for HID message.
 typedef bool (*softu2f_hid_message_handler)(softu2f_ctx *ctx, softu2f_hid_message *req);
 
-// U2FHID message.
+// Handler function for HID message that responds later through pending, from
+// any thread. Other channels keep being served in the meantime.
+typedef void (*softu2f_hid_message_async_handler)(softu2f_ctx *ctx, softu2f_hid_pending *pending, softu2f_hid_message *req, void *info);
+
+// Function called on the run loop's thread.
+typedef void (*softu2f_callback)(softu2f_ctx *ctx, void *info);
+
+// U2FHID message. The data is only valid until the handler returns. Retain a
+// copy to use it afterwards.
 struct softu2f_hid_message {
   uint8_t cmd;
   uint16_t bcnt;
@@ -25,35 +36,494 @@ struct softu2f_hid_message {
   CFDataRef data;
   CFMutableDataRef buf;
   uint8_t lastSeq;
-  struct timeval start;
+  bool stream;
+  bool hashed; // hash holds the SHA-256 of the request, for the retry cache.
+  uint8_t hash[32];
+  double start;
+  softu2f_scratch *scratch; // Memory for the handler. See softu2f_hid_msg_scratch.
   softu2f_hid_message *next;
+  softu2f_hid_message *prev;
+  softu2f_hid_message *cid_next;
 };
 
 typedef enum softu2f_init_flags {
-  SOFTU2F_DEBUG = 1 << 0
+  SOFTU2F_DEBUG = 1 << 0,
+
+  // Echo PING frames as they arrive instead of after the whole message has
+  // been read. Only applies while no PING handler is registered.
+  SOFTU2F_STREAM_PING = 1 << 1
 } softu2f_init_flags;
 
+// Time source for a device. now returns seconds and sleep waits for the given
+// number of seconds. Either can be NULL to use the system's.
+typedef struct softu2f_clock {
+  double (*now)(void *info);
+  void (*sleep)(void *info, double seconds);
+  void *info;
+} softu2f_clock;
+
+// Per-device counters.
+typedef struct softu2f_stats {
+  uint64_t frames_received;
+  uint64_t frames_sent;
+  uint64_t messages_handled;
+  uint64_t errors_sent;
+  uint64_t timeouts;
+  uint64_t probes_rejected;
+  uint64_t rate_limited;
+  uint64_t handler_usec;     // Time spent in handlers.
+  uint64_t handler_usec_max; // Longest a handler took.
+  uint64_t locked_out;       // INIT frames refused during another channel's LOCK.
+  uint64_t stalls;           // Requests that overran their deadline.
+  uint64_t bytes_copied;     // Message payload bytes copied by the engine.
+  uint64_t out_overflows;    // Responses that waited for queued ones to go out.
+  uint64_t retries_replayed; // Resent U2F requests answered from the retry cache.
+  uint64_t scratch_max;      // Most scratch memory one request used, in bytes.
+  uint64_t scratch_refused;  // Scratch allocations refused for lack of room.
+} softu2f_stats;
+
+// A request that overran its deadline.
+typedef struct softu2f_stall {
+  uint32_t cid;
+  uint8_t cmd;
+  double elapsed; // Seconds since the request was dispatched.
+  bool deferred;  // Whether it was abandoned, rather than late.
+} softu2f_stall;
+
+// Function told about stalled requests, on the run loop's thread.
+typedef void (*softu2f_stall_handler)(softu2f_ctx *ctx, const softu2f_stall *stall);
+
+// Vendor command answered with the device's counters. The response is a
+// format version byte (1), a count byte and that many big-endian 64 bit
+// counters in softu2f_stats order. New counters are only added at the end.
+#define SOFTU2F_VENDOR_STATS U2FHID_VENDOR_FIRST
+
+// Admission limits. Rates are per second and bursts are how many can come at
+// once. A rate of zero means no limit.
+typedef struct softu2f_limits {
+  double cid_rate;          // Messages started on each CID.
+  double cid_burst;
+  double global_rate;       // Messages started on all CIDs together.
+  double global_burst;
+  double alloc_rate;        // CIDs allocated by broadcast INITs.
+  double alloc_burst;
+} softu2f_limits;
+
+// Load for softu2f_sim_run. Each client has its own CID and sends requests
+// as they arrive, one at a time, queueing any that arrive while it waits.
+typedef struct softu2f_sim_config {
+  unsigned int clients;
+  double arrival_rate;   // Requests per second from each client, on average.
+  double latency;        // Seconds for a frame to cross the transport.
+  double frame_interval; // Seconds between a client's frames.
+  double service_time;   // Seconds the handler takes per request.
+  uint8_t cmd;           // Command sent, answered by echoing its data.
+  uint16_t bcnt;         // Bytes of data per request.
+  double duration;       // Seconds requests arrive for.
+  uint16_t rpt_size;     // HID report size, or 0 for HID_RPT_SIZE.
+  uint32_t seed;         // Same seed, same run.
+  bool default_handler;  // Answer with the engine's own handler for cmd.
+  softu2f_limits limits; // Admission limits for the device.
+
+  // The first bulk_clients clients send bulk_cmd with bulk_bcnt bytes of data
+  // instead, to see how they hold up the others. Each sends at most
+  // bulk_requests requests, if it isn't 0.
+  unsigned int bulk_clients;
+  uint8_t bulk_cmd;
+  uint16_t bulk_bcnt;
+  unsigned int bulk_requests;
+
+  // Bytes of scratch memory the handler takes per request, as a real one
+  // would for its temporaries.
+  size_t scratch;
+
+  // Defer requests instead, as a handler waiting for a touch would, and
+  // answer them with no data once service_time has passed.
+  bool deferred;
+
+  // Data sent with each request, at least as many bytes as the larger of
+  // bcnt and bulk_bcnt, or NULL to send zeros.
+  const uint8_t *data;
+
+  // Called with the device before any requests arrive, to set it up through
+  // the public API as an application would.
+  void (*setup)(softu2f_ctx *ctx, void *info);
+  void *info;
+
+  // Seconds after which the device is torn down, whatever it's still doing,
+  // or 0 to run until every request is answered.
+  double stop;
+
+  // Devices sharing one engine, or 0 for one. Clients are given to each in
+  // turn. With detach set, the first device is deinitialized after that many
+  // seconds, while the others keep serving.
+  unsigned int devices;
+  double detach;
+
+  // Seconds after sending a request that its client sends CANCEL for it, or 0
+  // to wait for the answer. A cancelled request that gets no answer is never
+  // counted as answered.
+  double cancel_after;
+} softu2f_sim_config;
+
+// Outcome of softu2f_sim_run. Times are simulated seconds.
+typedef struct softu2f_sim_result {
+  uint64_t requests;    // Requests that arrived.
+  uint64_t dropped;     // Requests a client had no room to queue.
+  uint64_t responses;   // Requests answered.
+  uint64_t errors;      // Requests answered with U2FHID_ERROR.
+  uint64_t keepalives;  // KEEPALIVEs clients got while they waited.
+  double latency_mean;  // From arrival to the end of the answer, queueing
+  double latency_max;   // included.
+  double small_latency_mean; // The same, for clients that aren't bulk
+  double small_latency_max;  // clients.
+  double elapsed;       // Until the simulation ran out of events.
+  softu2f_stats stats;  // The last device's counters.
+
+  // Work done by the engine, not counting the simulator's own. Allocations
+  // are those made through the engine's allocator, for messages and deferred
+  // requests, and through CoreFoundation's default allocator while the
+  // simulation runs, for CFData and other objects.
+  uint64_t allocations;
+  uint64_t alloc_bytes;
+  uint64_t frees; // Including what's freed when the device is torn down.
+  uint64_t transport_calls; // Frames sent plus batches of frames read.
+
+  // The last answer a client got: its command, its length and as much of its
+  // data as fits. Meant for runs with one client.
+  uint8_t reply_cmd;
+  uint16_t reply_bcnt;
+  uint8_t reply[256];
+} softu2f_sim_result;
+
+// A message to hash with softu2f_sha256_batch.
+typedef struct softu2f_sha256_job {
+  const void *data;
+  size_t len;
+  uint8_t *digest; // 32 bytes.
+} softu2f_sha256_job;
+
+// Reads CBOR items in place from a buffer, such as a U2FHID_CBOR request's
+// data. Once a read fails, every later read fails too.
+typedef struct softu2f_cbor_reader {
+  const uint8_t *p;
+  const uint8_t *end;
+  bool error;
+  bool mismatch; // An item had the wrong type.
+} softu2f_cbor_reader;
+
+// excludeList or allowList of a CTAP2 request, read with
+// softu2f_ctap_credential_next.
+typedef struct softu2f_ctap_credential_list {
+  softu2f_cbor_reader items;
+  size_t count;
+} softu2f_ctap_credential_list;
+
+// authenticatorMakeCredential parameters. Pointers are into the request.
+typedef struct softu2f_ctap_make_credential {
+  const uint8_t *client_data_hash; // 32 bytes.
+  const uint8_t *rp_id;            // Not NUL terminated.
+  size_t rp_id_len;
+  const uint8_t *user_id;
+  size_t user_id_len;
+  bool es256; // ES256 public keys are acceptable.
+  softu2f_ctap_credential_list exclude_list;
+  bool rk;
+  bool uv;
+  const uint8_t *pin_auth;
+  size_t pin_auth_len;
+  uint64_t pin_protocol;
+} softu2f_ctap_make_credential;
+
+// authenticatorGetAssertion parameters. Pointers are into the request.
+typedef struct softu2f_ctap_get_assertion {
+  const uint8_t *rp_id; // Not NUL terminated.
+  size_t rp_id_len;
+  const uint8_t *client_data_hash; // 32 bytes.
+  softu2f_ctap_credential_list allow_list;
+  bool up;
+  bool uv;
+  const uint8_t *pin_auth;
+  size_t pin_auth_len;
+  uint64_t pin_protocol;
+} softu2f_ctap_get_assertion;
+
 // Initialization
 softu2f_ctx *softu2f_init(softu2f_init_flags flags);
 
-// Deinitialization
+// Initialization with a device using a larger HID report size (64, 128, 256,
+// 512 or 1024 bytes). Hosts must support the size to talk to the device.
+softu2f_ctx *softu2f_init_with_report_size(softu2f_init_flags flags, uint16_t rpt_size);
+
+// Initialization with a device exported over USB/IP instead of through the
+// driver, so hosts such as Linux VMs can attach it with vhci-hcd. Listens on
+// addr (loopback if NULL) and port (normally 3240). Run it with softu2f_run.
+softu2f_ctx *softu2f_usbip_init(softu2f_init_flags flags, const char *addr, uint16_t port);
+
+// Initialization with a device exported over USB/IP to a host that's already
+// connected on fd, such as a socket handed over by launchd or one end of a
+// socketpair. The device serves only that host and closes fd when it hangs up.
+softu2f_ctx *softu2f_usbip_init_with_socket(softu2f_init_flags flags, int fd);
+
+// Add another device, served by the same run loop and threads as ctx. Each
+// device has its own CIDs, handlers, user data and counters. Devices can be
+// added while the run loop is going.
+softu2f_ctx *softu2f_device_add(softu2f_ctx *ctx, softu2f_init_flags flags, uint16_t rpt_size);
+
+// Deinitialization. Removes the device from its run loop. The run loop's
+// resources are freed with its last device.
 void softu2f_deinit(softu2f_ctx *ctx);
 
-// Read HID messages from the device.
+// Read HID messages from all of ctx's devices.
 void softu2f_run(softu2f_ctx *ctx);
 
+// Read a batch of HID frames into HID messages, handling messages as they
+// complete. frames holds nframes reports of the device's report size back to
+// back, as the driver hands them over. Frames are classified a chunk at a
+// time before any message is looked up.
+void softu2f_hid_frames_read(softu2f_ctx *ctx, void *frames, unsigned int nframes);
+
 // Shutdown the run loop.
 void softu2f_shutdown(softu2f_ctx *ctx);
 
+// Set data for handlers to find on the device, such as its credentials.
+void softu2f_set_user_data(softu2f_ctx *ctx, void *data);
+
+// Get data set with softu2f_set_user_data.
+void *softu2f_get_user_data(softu2f_ctx *ctx);
+
+// Get a snapshot of a device's counters.
+void softu2f_stats_get(softu2f_ctx *ctx, softu2f_stats *stats);
+
+// Limit how fast clients can start messages and allocate CIDs, so one
+// misbehaving client can't starve the others. INIT frames over a limit are
+// answered with ERR_CHANNEL_BUSY before anything is allocated for them.
+// Devices start without limits.
+void softu2f_limits_set(softu2f_ctx *ctx, const softu2f_limits *limits);
+
+// Run a discrete-event simulation of clients using a device, on a simulated
+// clock. Frames go through the same reassembly and dispatch code as a real
+// device, and a simulated second takes far less than a real one. Needs no
+// driver.
+bool softu2f_sim_run(const softu2f_sim_config *config, softu2f_sim_result *result);
+
+// Use another time source for a device, or the system's if clock is NULL.
+// Timeouts, deadlines, rate limits and the pauses between sent frames all go
+// through it.
+void softu2f_clock_set(softu2f_ctx *ctx, const softu2f_clock *clock);
+
+// Set how many seconds a request can take, or 0 for no limit. Deferred
+// requests that overrun are abandoned: the client gets ERR_MSG_TIMEOUT, the
+// cancel callback is called and the channel is free again. Handlers that
+// respond right away hold up every channel and can't be interrupted, so they
+// are only reported once they return. Defaults to 30 seconds.
+void softu2f_deadline_set(softu2f_ctx *ctx, double seconds);
+
+// Register a function told about requests that overrun their deadline.
+void softu2f_stall_handler_register(softu2f_ctx *ctx, softu2f_stall_handler handler);
+
+// Replay responses to U2F requests resent on the same channel within the
+// given seconds, or 0 to stop. Only successful REGISTERs and signing
+// AUTHENTICATEs are replayed, so a client that timed out and asks again gets
+// the signature already made instead of a second one. Off by default.
+void softu2f_retry_window_set(softu2f_ctx *ctx, double seconds);
+
+// Hand U2FHID_MSG requests to worker processes over shared memory with the
+// given name (at most 31 characters, starting with '/'). Requests are routed
+// by CID, so a channel always reaches the same worker. Workers are started
+// separately and attach with softu2f_worker_run. Requests queued for a worker
+// that exits are failed with ERR_OTHER and its slot can be attached again.
+bool softu2f_workers_start(softu2f_ctx *ctx, const char *name, unsigned int nworkers);
+
+// Stop handing requests to workers. Attached workers return.
+void softu2f_workers_stop(softu2f_ctx *ctx);
+
+// Serve U2FHID_MSG requests as worker number index for the front process that
+// created the shared memory with the given name. Responses sent from handler
+// are passed back to the front process. Returns true once the front process
+// stops or exits, and false if the worker couldn't attach.
+bool softu2f_worker_run(const char *name, unsigned int index, softu2f_hid_message_handler handler, void *user_data, softu2f_init_flags flags);
+
+// Forward U2FHID_MSG requests to a signing daemon listening on the Unix
+// socket at path. Requests and responses are records of a 4 byte CID, a 2
+// byte length and that many bytes of APDU, all big-endian. Requests arriving
+// together are written together without waiting for earlier responses, and
+// the signer can answer them in any order.
+bool softu2f_signer_connect(softu2f_ctx *ctx, const char *path);
+
+// Forward U2FHID_MSG requests to a signing daemon already connected on fd,
+// such as one end of a socketpair. The device closes fd when it disconnects,
+// and leaves it open if this fails.
+bool softu2f_signer_connect_with_socket(softu2f_ctx *ctx, int fd);
+
+// Stop forwarding requests to the signing daemon. Outstanding requests fail.
+void softu2f_signer_disconnect(softu2f_ctx *ctx);
+
+// Remember a key handle the device issued for an application (32 byte
+// application parameter). Once any are added, check-only AUTHENTICATE
+// requests for other key handles are answered with U2F_SW_WRONG_DATA before
+// reaching the U2FHID_MSG handler, workers or signer. The filter can let
+// foreign key handles through, but never turns away one that was added.
+bool softu2f_key_handle_add(softu2f_ctx *ctx, const uint8_t *app_id, const uint8_t *key_handle, uint8_t key_handle_len);
+
+// Forget all key handles, so check-only requests reach the handler again.
+// Re-add the remaining key handles after deleting a credential.
+void softu2f_key_handle_clear(softu2f_ctx *ctx);
+
+// Set the attestation certificate (DER) for REGISTER responses. It is
+// checked once here, so a malformed certificate fails now rather than in
+// every client that registers.
+bool softu2f_attestation_cert_set(softu2f_ctx *ctx, const uint8_t *cert, size_t len);
+
+// Hash the data a REGISTER signature covers into a 32 byte digest: the
+// application and challenge parameters, the key handle and the 65 byte
+// uncompressed public key.
+void softu2f_register_digest(const uint8_t *app_id, const uint8_t *chal, const uint8_t *key_handle, uint8_t key_handle_len, const uint8_t *pub_key, uint8_t *digest);
+
+// Send a successful REGISTER response with the public key, key handle and
+// DER signature filled in around the attestation certificate. Can be called
+// from any thread.
+bool softu2f_register_resp_send(softu2f_ctx *ctx, uint32_t cid, const uint8_t *pub_key, const uint8_t *key_handle, uint8_t key_handle_len, const uint8_t *sig, size_t sig_len);
+
+// Hash several messages at once, such as the application, challenge and
+// signed data hashes of every request in a batch. Messages are hashed eight
+// at a time in SIMD lanes, which beats hashing them one by one once there
+// are a few. Safe to call from any thread.
+void softu2f_sha256_batch(const softu2f_sha256_job *jobs, size_t count);
+
+// Start reading CBOR items from a buffer.
+void softu2f_cbor_reader_init(softu2f_cbor_reader *reader, const void *data, size_t len);
+
+// Check whether every item has been read without errors.
+bool softu2f_cbor_reader_done(softu2f_cbor_reader *reader);
+
+// Get the major type of the next item without reading it, or -1.
+int softu2f_cbor_peek(softu2f_cbor_reader *reader);
+
+// Read an unsigned integer.
+bool softu2f_cbor_read_uint(softu2f_cbor_reader *reader, uint64_t *value);
+
+// Read an integer, positive or negative.
+bool softu2f_cbor_read_int(softu2f_cbor_reader *reader, int64_t *value);
+
+// Read a byte string in place.
+bool softu2f_cbor_read_bytes(softu2f_cbor_reader *reader, const uint8_t **data, size_t *len);
+
+// Read a text string in place. It isn't NUL terminated.
+bool softu2f_cbor_read_text(softu2f_cbor_reader *reader, const uint8_t **data, size_t *len);
+
+// Read the start of an array. Its items are read next.
+bool softu2f_cbor_read_array(softu2f_cbor_reader *reader, size_t *count);
+
+// Read the start of a map. Its keys and values are read next, alternately.
+bool softu2f_cbor_read_map(softu2f_cbor_reader *reader, size_t *count);
+
+// Read a boolean.
+bool softu2f_cbor_read_bool(softu2f_cbor_reader *reader, bool *value);
+
+// Skip an item, along with anything nested in it.
+bool softu2f_cbor_skip(softu2f_cbor_reader *reader);
+
+// Check whether a text string read in place equals a C string.
+bool softu2f_cbor_text_eq(const uint8_t *data, size_t len, const char *str);
+
+// Append CBOR items to a response, straight into its frames. Maps and arrays
+// are written as their count followed by their items.
+bool softu2f_cbor_write_uint(softu2f_hid_response *resp, uint64_t value);
+bool softu2f_cbor_write_int(softu2f_hid_response *resp, int64_t value);
+bool softu2f_cbor_write_bytes(softu2f_hid_response *resp, const void *data, size_t len);
+bool softu2f_cbor_write_text(softu2f_hid_response *resp, const char *str);
+bool softu2f_cbor_write_array(softu2f_hid_response *resp, size_t count);
+bool softu2f_cbor_write_map(softu2f_hid_response *resp, size_t count);
+bool softu2f_cbor_write_bool(softu2f_hid_response *resp, bool value);
+
+// Parse authenticatorMakeCredential parameters (the request after its
+// command byte) without copying them. Returns a CTAP2 status code.
+uint8_t softu2f_ctap_make_credential_parse(const void *data, size_t len, softu2f_ctap_make_credential *req);
+
+// Parse authenticatorGetAssertion parameters without copying them. Returns a
+// CTAP2 status code.
+uint8_t softu2f_ctap_get_assertion_parse(const void *data, size_t len, softu2f_ctap_get_assertion *req);
+
+// Read the next credential ID from an excludeList or allowList. Returns false
+// at the end of the list or if the list is malformed.
+bool softu2f_ctap_credential_next(softu2f_ctap_credential_list *list, const uint8_t **id, size_t *id_len);
+
+// Send a U2FHID_CBOR response with only a status code.
+bool softu2f_ctap_status_send(softu2f_ctx *ctx, uint32_t cid, uint8_t status);
+
 // Send a HID message to the device.
 bool softu2f_hid_msg_send(softu2f_ctx *ctx, softu2f_hid_message *msg);
 
 // Send a HID error to the device.
 bool softu2f_hid_err_send(softu2f_ctx *ctx, uint32_t cid, uint8_t code);
 
-// Register a handler for a message type.
+// Start building a response directly in outbound frames. Only one response
+// can be built at a time. Returns NULL if another response is being built.
+softu2f_hid_response *softu2f_hid_resp_start(softu2f_ctx *ctx, uint32_t cid, uint8_t cmd);
+
+// Append bytes to a response. Returns false if the response would be too large.
+bool softu2f_hid_resp_append(softu2f_hid_response *resp, const void *data, size_t len);
+
+// Append a single byte to a response.
+bool softu2f_hid_resp_append_byte(softu2f_hid_response *resp, uint8_t byte);
+
+// Append a big-endian 16 bit value, such as a status word, to a response.
+bool softu2f_hid_resp_append_u16(softu2f_hid_response *resp, uint16_t value);
+
+// Send a response, patching in its frame headers, and release the builder.
+bool softu2f_hid_resp_send(softu2f_ctx *ctx, softu2f_hid_response *resp);
+
+// Discard a response without sending it and release the builder.
+void softu2f_hid_resp_discard(softu2f_ctx *ctx, softu2f_hid_response *resp);
+
+// Bytes of scratch memory each request gets.
+#define SOFTU2F_SCRATCH_SIZE 16384
+
+// Allocate memory for handling a message, aligned for any type. It is all
+// freed at once when the handler returns, so there's nothing to free. Each
+// request gets SOFTU2F_SCRATCH_SIZE bytes. Returns NULL once they're used up.
+void *softu2f_hid_msg_scratch(softu2f_hid_message *msg, size_t len);
+
+// Register a handler for a message type, any command from 0x80 to 0xff,
+// including U2FHID_VENDOR_FIRST to U2FHID_VENDOR_LAST. Pass NULL to go back
+// to the default handler.
 void softu2f_hid_msg_handler_register(softu2f_ctx *ctx, uint8_t type, softu2f_hid_message_handler handler);
 
+// Register a handler for a message type that responds to requests later.
+// Takes precedence over a handler registered with
+// softu2f_hid_msg_handler_register. Pass NULL to remove it.
+void softu2f_hid_msg_async_handler_register(softu2f_ctx *ctx, uint8_t type, softu2f_hid_message_async_handler handler, void *info);
+
+// Respond to a deferred request with a message of the request's type, and
+// free pending. Nothing is sent if the channel was reset or the device
+// deinitialized in the meantime, but pending must still be completed or
+// failed to free it.
+bool softu2f_hid_pending_complete(softu2f_hid_pending *pending, CFDataRef data);
+
+// Respond to a deferred request with a HID error, and free pending.
+bool softu2f_hid_pending_fail(softu2f_hid_pending *pending, uint8_t code);
+
+// Set the status reported in the KEEPALIVEs sent every 100ms while a request
+// is deferred, such as KEEPALIVE_UPNEEDED while waiting for a touch. Requests
+// start out KEEPALIVE_PROCESSING.
+void softu2f_hid_pending_status_set(softu2f_hid_pending *pending, uint8_t status);
+
+// Call a function on the run loop's thread if the client cancels a deferred
+// request with U2FHID_CANCEL or abandons it with U2FHID_INIT. The request
+// still has to be completed or failed, but nothing is sent for it.
+void softu2f_hid_pending_on_cancel(softu2f_hid_pending *pending, softu2f_callback callback, void *info);
+
+// Get the CID a deferred request came in on.
+uint32_t softu2f_hid_pending_cid(softu2f_hid_pending *pending);
+
+// Call a function on the run loop's thread after a delay in seconds on the
+// device's clock, under the engine's lock. Can be called from any thread
+// while the run loop is going. Calls still waiting when the device is
+// deinitialized are made then, and none can be scheduled after that, so
+// nothing is left waiting on a device that's gone.
+bool softu2f_call_after(softu2f_ctx *ctx, double seconds, softu2f_callback callback, void *info);
+
 // Find a message handler for a message.
 softu2f_hid_message_handler softu2f_hid_msg_handler_default(softu2f_ctx *ctx, softu2f_hid_message *msg);
 
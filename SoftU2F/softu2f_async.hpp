@@ -0,0 +1,172 @@
+//
+//  softu2f_async.hpp
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#ifndef softu2f_async_hpp
+#define softu2f_async_hpp
+
+// C++20 coroutine handlers, built on softu2f_hid_msg_async_handler_register.
+// Coroutines run on the run loop's thread and can co_await timers or any
+// callback-based operation while other channels are served.
+
+extern "C" {
+#include "softu2f.h"
+#include "u2f_hid.h"
+}
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+
+namespace softu2f {
+
+// Return type of coroutine handlers. Starts right away and cleans itself up
+// when it finishes.
+struct task {
+  struct promise_type {
+    task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+// Request being handled by a coroutine, with its own copy of the request
+// data. Fails the request with ERR_OTHER if it is dropped without a response,
+// or right away if the data couldn't be copied, leaving data() null.
+class request {
+public:
+  request(softu2f_ctx *ctx, softu2f_hid_pending *pending, softu2f_hid_message *msg)
+      : ctx_(ctx), pending_(pending), cid_(msg->cid), cmd_(msg->cmd), data_(CFDataCreateCopy(nullptr, msg->data)) {
+    if (!data_)
+      fail(ERR_OTHER);
+  }
+
+  request(request &&other) noexcept
+      : ctx_(other.ctx_), pending_(std::exchange(other.pending_, nullptr)), cid_(other.cid_), cmd_(other.cmd_),
+        data_(std::exchange(other.data_, nullptr)) {}
+
+  request(const request &) = delete;
+  request &operator=(const request &) = delete;
+
+  ~request() {
+    if (pending_)
+      softu2f_hid_pending_fail(pending_, ERR_OTHER);
+    if (data_)
+      CFRelease(data_);
+  }
+
+  softu2f_ctx *ctx() const { return ctx_; }
+  uint32_t cid() const { return cid_; }
+  uint8_t cmd() const { return cmd_; }
+  CFDataRef data() const { return data_; }
+
+  // Set the status reported in KEEPALIVEs, such as KEEPALIVE_UPNEEDED.
+  void status(uint8_t status) {
+    if (pending_)
+      softu2f_hid_pending_status_set(pending_, status);
+  }
+
+  // Respond with a message of the request's type.
+  bool respond(CFDataRef data) {
+    return pending_ && softu2f_hid_pending_complete(std::exchange(pending_, nullptr), data);
+  }
+
+  // Respond with a HID error.
+  bool fail(uint8_t code) {
+    return pending_ && softu2f_hid_pending_fail(std::exchange(pending_, nullptr), code);
+  }
+
+private:
+  softu2f_ctx *ctx_;
+  softu2f_hid_pending *pending_;
+  uint32_t cid_;
+  uint8_t cmd_;
+  CFDataRef data_;
+};
+
+// Resume a coroutine on the run loop's thread, or right here if the run loop
+// isn't going, so its frame and request aren't left behind.
+inline void resume_on_run_loop(softu2f_ctx *ctx, std::coroutine_handle<> handle) {
+  if (!softu2f_call_after(ctx, 0, [](softu2f_ctx *, void *info) { std::coroutine_handle<>::from_address(info).resume(); },
+                          handle.address()))
+    handle.resume();
+}
+
+// Awaitable that resumes after a delay in seconds.
+class sleep_for {
+public:
+  sleep_for(softu2f_ctx *ctx, double seconds) : ctx_(ctx), seconds_(seconds) {}
+
+  bool await_ready() const noexcept { return seconds_ <= 0; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    // Carry on right away if the run loop isn't going.
+    return softu2f_call_after(
+        ctx_, seconds_, [](softu2f_ctx *, void *info) { std::coroutine_handle<>::from_address(info).resume(); },
+        handle.address());
+  }
+
+  void await_resume() const noexcept {}
+
+private:
+  softu2f_ctx *ctx_;
+  double seconds_;
+};
+
+// Awaitable for a callback-based operation, such as a user presence check or
+// a signer reply. start is called with the operation when the coroutine
+// suspends. Whatever finishes the operation calls complete once, from any
+// thread, and the coroutine resumes on the run loop's thread with the value.
+// If the run loop has stopped, it resumes on the calling thread instead.
+template <typename T>
+class operation {
+public:
+  template <typename Start>
+  operation(softu2f_ctx *ctx, Start &&start) : ctx_(ctx), start_(std::forward<Start>(start)) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+    start_(this);
+  }
+
+  T await_resume() { return std::move(*value_); }
+
+  void complete(T value) {
+    value_.emplace(std::move(value));
+    resume_on_run_loop(ctx_, handle_);
+  }
+
+private:
+  softu2f_ctx *ctx_;
+  std::function<void(operation *)> start_;
+  std::coroutine_handle<> handle_;
+  std::optional<T> value_;
+};
+
+// Register a coroutine as the handler for a message type.
+template <task (*Handler)(request)>
+void register_handler(softu2f_ctx *ctx, uint8_t type) {
+  softu2f_hid_msg_async_handler_register(
+      ctx, type,
+      [](softu2f_ctx *ctx, softu2f_hid_pending *pending, softu2f_hid_message *msg, void *) {
+        request req(ctx, pending, msg);
+
+        // Already failed if the data couldn't be copied.
+        if (req.data())
+          Handler(std::move(req));
+      },
+      nullptr);
+}
+
+} // namespace softu2f
+
+#endif /* softu2f_async_hpp */
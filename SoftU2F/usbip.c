@@ -0,0 +1,721 @@
+//
+//  usbip.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// HID report descriptor of the exported device.
+const uint8_t softu2f_usbip_report_descriptor[] = kSoftU2FReportDescriptor;
+
+// Device descriptor of the exported device.
+const uint8_t softu2f_usbip_device_descriptor[] = {
+    18, 0x01,                                            // bLength, DEVICE
+    0x00, 0x02,                                          // bcdUSB 2.0
+    0x00, 0x00, 0x00,                                    // Class in interface
+    HID_RPT_SIZE,                                        // bMaxPacketSize0
+    kSoftU2FVendorID & 0xFF, kSoftU2FVendorID >> 8,      // idVendor
+    kSoftU2FProductID & 0xFF, kSoftU2FProductID >> 8,    // idProduct
+    0x00, 0x01,                                          // bcdDevice 1.0
+    0,                                                   // iManufacturer
+    SOFTU2F_USBIP_STRING_PRODUCT,                        // iProduct
+    SOFTU2F_USBIP_STRING_SERIAL,                         // iSerialNumber
+    1,                                                   // bNumConfigurations
+};
+
+// Configuration descriptor of the exported device, with its one HID
+// interface and interrupt endpoints.
+const uint8_t softu2f_usbip_config_descriptor[] = {
+    9, 0x02, 41, 0,    // bLength, CONFIGURATION, wTotalLength
+    1, 1, 0,           // bNumInterfaces, bConfigurationValue, iConfiguration
+    0x80, 50,          // Bus powered, 100mA
+    9, 0x04, 0, 0,     // bLength, INTERFACE, bInterfaceNumber, bAlternateSetting
+    2, 0x03, 0, 0, 0,  // bNumEndpoints, HID, no subclass or protocol, iInterface
+    9, 0x21,           // bLength, HID
+    0x11, 0x01, 0,     // bcdHID 1.11, bCountryCode
+    1, 0x22,           // bNumDescriptors, REPORT
+    sizeof(softu2f_usbip_report_descriptor), 0,
+    7, 0x05, 0x81,     // bLength, ENDPOINT, 1 IN
+    0x03,              // Interrupt
+    HID_RPT_SIZE, 0,   // wMaxPacketSize
+    SOFTU2F_USBIP_INTERVAL,
+    7, 0x05, 0x01,     // bLength, ENDPOINT, 1 OUT
+    0x03,              // Interrupt
+    HID_RPT_SIZE, 0,   // wMaxPacketSize
+    SOFTU2F_USBIP_INTERVAL,
+};
+
+// Export a device over USB/IP.
+softu2f_ctx *softu2f_usbip_init(softu2f_init_flags flags, const char *addr, uint16_t port) {
+  return softu2f_usbip_create(flags, addr, port, -1);
+}
+
+// Export a device over USB/IP to a host already connected on fd.
+softu2f_ctx *softu2f_usbip_init_with_socket(softu2f_init_flags flags, int fd) {
+  return softu2f_usbip_create(flags, NULL, 0, fd);
+}
+
+// Create a device exported over USB/IP, listening on addr and port for hosts
+// unless one is already connected on host_fd.
+softu2f_ctx *softu2f_usbip_create(softu2f_init_flags flags, const char *addr, uint16_t port, int host_fd) {
+  softu2f_engine *engine = NULL;
+  softu2f_ctx *ctx = NULL;
+  softu2f_usbip *usbip = NULL;
+  struct sockaddr_in sin;
+  int one = 1;
+  int err;
+
+  engine = softu2f_engine_create(flags);
+  if (!engine)
+    return NULL;
+
+  // Interrupt endpoints on a full speed device carry 64 byte reports.
+  ctx = softu2f_ctx_create(flags, HID_RPT_SIZE);
+  if (!ctx) {
+    softu2f_engine_free(engine);
+    return NULL;
+  }
+
+  // The engine is freed along with ctx.
+  ctx->engine = engine;
+  engine->devices = ctx;
+
+  usbip = (softu2f_usbip *)calloc(1, sizeof(softu2f_usbip));
+  if (!usbip) {
+    softu2f_log(ctx, "No memory for USB/IP server.\n");
+    goto fail;
+  }
+
+  usbip->listen_fd = -1;
+  usbip->fd = -1;
+  usbip->host_fd = host_fd;
+
+  usbip->out = CFDataCreateMutable(NULL, 0);
+  if (!usbip->out) {
+    softu2f_log(ctx, "No memory for USB/IP completions.\n");
+    goto fail;
+  }
+
+  if (host_fd >= 0)
+    goto start;
+
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (addr && inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+    softu2f_log(ctx, "Invalid USB/IP address: %s\n", addr);
+    goto fail;
+  }
+
+  usbip->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (usbip->listen_fd < 0) {
+    softu2f_log(ctx, "Error creating USB/IP socket: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  setsockopt(usbip->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(usbip->listen_fd, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) || listen(usbip->listen_fd, 1)) {
+    softu2f_log(ctx, "Error listening for USB/IP hosts: %s\n", strerror(errno));
+    goto fail;
+  }
+
+start:
+  ctx->usbip = usbip;
+  ctx->send_frame = softu2f_usbip_frame_send;
+
+  // The host paces frames by asking for them.
+  ctx->send_ready = softu2f_usbip_send_ready;
+  ctx->out_interval = 0;
+
+  err = pthread_create(&usbip->thread, NULL, softu2f_usbip_thread, ctx);
+  if (err) {
+    softu2f_log(ctx, "Error creating USB/IP thread: %d\n", err);
+    ctx->usbip = NULL;
+    goto fail;
+  }
+
+  return ctx;
+
+fail:
+  if (usbip)
+    softu2f_usbip_free(usbip);
+  softu2f_deinit(ctx);
+  return NULL;
+}
+
+// Stop exporting a device over USB/IP.
+void softu2f_usbip_stop(softu2f_ctx *ctx) {
+  softu2f_usbip *usbip = ctx->usbip;
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+  __atomic_store_n(&usbip->stop, true, __ATOMIC_RELEASE);
+  if (usbip->fd >= 0)
+    shutdown(usbip->fd, SHUT_RDWR);
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  pthread_join(usbip->thread, NULL);
+
+  ctx->usbip = NULL;
+  softu2f_usbip_free(usbip);
+}
+
+// Free a USB/IP server.
+void softu2f_usbip_free(softu2f_usbip *usbip) {
+  if (usbip->listen_fd >= 0)
+    close(usbip->listen_fd);
+
+  if (usbip->out)
+    CFRelease(usbip->out);
+
+  free(usbip);
+}
+
+// Accept USB/IP hosts one at a time. Run on its own thread.
+void *softu2f_usbip_thread(void *arg) {
+  softu2f_ctx *ctx = (softu2f_ctx *)arg;
+  softu2f_usbip *usbip = ctx->usbip;
+  struct pollfd pfd;
+  int fd;
+
+  // A host that was already connected is the only one.
+  if (usbip->host_fd >= 0) {
+    softu2f_usbip_connection(ctx, usbip->host_fd);
+    return NULL;
+  }
+
+  pfd.fd = usbip->listen_fd;
+  pfd.events = POLLIN;
+
+  while (!__atomic_load_n(&usbip->stop, __ATOMIC_ACQUIRE)) {
+    // Wake up now and then to check if we've been stopped.
+    if (poll(&pfd, 1, 200) <= 0)
+      continue;
+
+    fd = accept(usbip->listen_fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+
+    softu2f_usbip_connection(ctx, fd);
+  }
+
+  return NULL;
+}
+
+// Serve a connected USB/IP host, closing the connection when it's done.
+void softu2f_usbip_connection(softu2f_ctx *ctx, int fd) {
+  softu2f_usbip *usbip = ctx->usbip;
+  int one = 1;
+
+  // Frames are small and latency matters more than throughput.
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  // Stopping shuts the connection down to wake us up.
+  pthread_mutex_lock(&ctx->engine->mutex);
+  usbip->fd = fd;
+  if (__atomic_load_n(&usbip->stop, __ATOMIC_ACQUIRE))
+    shutdown(fd, SHUT_RDWR);
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  softu2f_usbip_serve(ctx, fd);
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+  usbip->fd = -1;
+  usbip->attached = false;
+  usbip->batching = false;
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  close(fd);
+}
+
+// Serve one USB/IP host connection until it closes.
+void softu2f_usbip_serve(softu2f_ctx *ctx, int fd) {
+  softu2f_usbip *usbip = ctx->usbip;
+  ssize_t n;
+
+  if (!softu2f_usbip_op(ctx, fd))
+    return;
+
+  softu2f_log(ctx, "USB/IP host attached.\n");
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+  usbip->attached = true;
+  usbip->nin = 0;
+  usbip->in_urb_count = 0;
+  usbip->frame_count = 0;
+  CFDataSetLength(usbip->out, 0);
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  while (1) {
+    n = read(fd, usbip->in + usbip->nin, sizeof(usbip->in) - usbip->nin);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+
+    usbip->nin += n;
+
+    // Handle every URB that arrived in this read, then write all of their
+    // completions at once.
+    pthread_mutex_lock(&ctx->engine->mutex);
+    usbip->batching = true;
+
+    if (!softu2f_usbip_urbs(ctx)) {
+      pthread_mutex_unlock(&ctx->engine->mutex);
+      break;
+    }
+
+    usbip->batching = false;
+    softu2f_usbip_flush(ctx);
+    pthread_mutex_unlock(&ctx->engine->mutex);
+  }
+
+  softu2f_log(ctx, "USB/IP host detached.\n");
+}
+
+// Answer a USB/IP device list or import request. Returns true once the host
+// has imported the device.
+bool softu2f_usbip_op(softu2f_ctx *ctx, int fd) {
+  uint8_t req[SOFTU2F_USBIP_OP_HDR_SIZE + SOFTU2F_USBIP_BUSID_SIZE];
+  uint8_t rep[SOFTU2F_USBIP_OP_HDR_SIZE + 4 + SOFTU2F_USBIP_DEV_SIZE + 4];
+  uint8_t *p = rep;
+  uint16_t code;
+
+  if (!softu2f_usbip_read(fd, req, SOFTU2F_USBIP_OP_HDR_SIZE))
+    return false;
+
+  code = (uint16_t)req[2] << 8 | req[3];
+
+  memset(rep, 0, sizeof(rep));
+  softu2f_be16_put(p, SOFTU2F_USBIP_VERSION);
+
+  switch (code) {
+  case SOFTU2F_USBIP_OP_REQ_DEVLIST:
+    softu2f_be16_put(p + 2, SOFTU2F_USBIP_OP_REP_DEVLIST);
+    p += SOFTU2F_USBIP_OP_HDR_SIZE;
+
+    // One device with one HID interface.
+    softu2f_be32_put(p, 1);
+    p += 4;
+    softu2f_usbip_device_put(p);
+    p += SOFTU2F_USBIP_DEV_SIZE;
+    *p++ = 0x03;
+    p += 3;
+
+    softu2f_usbip_write(fd, rep, p - rep);
+    return false;
+
+  case SOFTU2F_USBIP_OP_REQ_IMPORT:
+    if (!softu2f_usbip_read(fd, req + SOFTU2F_USBIP_OP_HDR_SIZE, SOFTU2F_USBIP_BUSID_SIZE))
+      return false;
+
+    softu2f_be16_put(p + 2, SOFTU2F_USBIP_OP_REP_IMPORT);
+    p += SOFTU2F_USBIP_OP_HDR_SIZE;
+
+    if (strncmp((char *)req + SOFTU2F_USBIP_OP_HDR_SIZE, SOFTU2F_USBIP_BUSID, SOFTU2F_USBIP_BUSID_SIZE)) {
+      softu2f_log(ctx, "USB/IP host asked for unknown device.\n");
+      softu2f_be32_put(rep + 4, 1);
+      softu2f_usbip_write(fd, rep, SOFTU2F_USBIP_OP_HDR_SIZE);
+      return false;
+    }
+
+    softu2f_usbip_device_put(p);
+    p += SOFTU2F_USBIP_DEV_SIZE;
+
+    return softu2f_usbip_write(fd, rep, p - rep);
+
+  default:
+    softu2f_log(ctx, "Unknown USB/IP operation: 0x%04x\n", code);
+    return false;
+  }
+}
+
+// Write the USB/IP description of the exported device.
+void softu2f_usbip_device_put(uint8_t *p) {
+  memset(p, 0, SOFTU2F_USBIP_DEV_SIZE);
+
+  strcpy((char *)p, "/sys/devices/softu2f");
+  strcpy((char *)p + 256, SOFTU2F_USBIP_BUSID);
+  p += 256 + SOFTU2F_USBIP_BUSID_SIZE;
+
+  softu2f_be32_put(p, 1); // busnum
+  softu2f_be32_put(p + 4, 1); // devnum
+  softu2f_be32_put(p + 8, SOFTU2F_USBIP_SPEED_FULL);
+  softu2f_be16_put(p + 12, kSoftU2FVendorID);
+  softu2f_be16_put(p + 14, kSoftU2FProductID);
+  softu2f_be16_put(p + 16, 0x0100); // bcdDevice
+  p[18] = 0;                        // bDeviceClass
+  p[19] = 0;                        // bDeviceSubClass
+  p[20] = 0;                        // bDeviceProtocol
+  p[21] = 1;                        // bConfigurationValue
+  p[22] = 1;                        // bNumConfigurations
+  p[23] = 1;                        // bNumInterfaces
+}
+
+// Handle complete URBs read from the host. Returns false if the host sent
+// something we can't handle.
+bool softu2f_usbip_urbs(softu2f_ctx *ctx) {
+  softu2f_usbip *usbip = ctx->usbip;
+  uint8_t *urb = usbip->in;
+  uint8_t *end = usbip->in + usbip->nin;
+  uint32_t cmd, seqnum, dir, ep, len;
+
+  while (end - urb >= SOFTU2F_USBIP_HDR_SIZE) {
+    cmd = softu2f_be32_get(urb);
+    seqnum = softu2f_be32_get(urb + 4);
+    dir = softu2f_be32_get(urb + 12);
+    ep = softu2f_be32_get(urb + 16);
+    len = softu2f_be32_get(urb + 24);
+
+    if (cmd == SOFTU2F_USBIP_CMD_UNLINK) {
+      softu2f_usbip_unlink(ctx, seqnum, softu2f_be32_get(urb + 20));
+      urb += SOFTU2F_USBIP_HDR_SIZE;
+      continue;
+    }
+
+    if (cmd != SOFTU2F_USBIP_CMD_SUBMIT || len > SOFTU2F_USBIP_MAX_TRANSFER) {
+      softu2f_log(ctx, "Unexpected USB/IP command: %u\n", cmd);
+      return false;
+    }
+
+    // OUT transfers carry their data after the header.
+    if (dir != SOFTU2F_USBIP_DIR_IN && end - urb < SOFTU2F_USBIP_HDR_SIZE + len)
+      break;
+
+    if (ep == 0) {
+      softu2f_usbip_control(ctx, seqnum, urb + 40, dir == SOFTU2F_USBIP_DIR_IN ? NULL : urb + SOFTU2F_USBIP_HDR_SIZE, len);
+    } else if (dir == SOFTU2F_USBIP_DIR_IN) {
+      softu2f_usbip_in(ctx, seqnum);
+    } else {
+      softu2f_usbip_out(ctx, seqnum, urb + SOFTU2F_USBIP_HDR_SIZE, len);
+    }
+
+    urb += SOFTU2F_USBIP_HDR_SIZE + (dir == SOFTU2F_USBIP_DIR_IN ? 0 : len);
+  }
+
+  // Keep the start of a partial URB for the next read.
+  usbip->nin = end - urb;
+  memmove(usbip->in, urb, usbip->nin);
+
+  return true;
+}
+
+// Answer a control transfer on endpoint 0. data is NULL for IN transfers.
+void softu2f_usbip_control(softu2f_ctx *ctx, uint32_t seqnum, uint8_t *setup, uint8_t *data, uint32_t len) {
+  softu2f_usbip *usbip = ctx->usbip;
+  uint8_t buf[SOFTU2F_USBIP_STRING_SIZE];
+  const uint8_t *reply = NULL;
+  uint16_t wValue = setup[2] | (uint16_t)setup[3] << 8;
+  uint16_t wLength = setup[6] | (uint16_t)setup[7] << 8;
+  uint32_t nreply = 0;
+
+  switch (setup[0] << 8 | setup[1]) {
+  case 0x8006: // GET_DESCRIPTOR from the device.
+  case 0x8106: // GET_DESCRIPTOR from the interface.
+    switch (wValue >> 8) {
+    case 0x01:
+      reply = softu2f_usbip_device_descriptor;
+      nreply = sizeof(softu2f_usbip_device_descriptor);
+      break;
+    case 0x02:
+      reply = softu2f_usbip_config_descriptor;
+      nreply = sizeof(softu2f_usbip_config_descriptor);
+      break;
+    case 0x03:
+      reply = buf;
+      nreply = softu2f_usbip_string(wValue & 0xFF, buf);
+      break;
+    case 0x21:
+      reply = softu2f_usbip_config_descriptor + 18;
+      nreply = 9;
+      break;
+    case 0x22:
+      reply = softu2f_usbip_report_descriptor;
+      nreply = sizeof(softu2f_usbip_report_descriptor);
+      break;
+    }
+
+    if (!nreply)
+      goto stall;
+    break;
+
+  case 0x8000: // GET_STATUS
+    memset(buf, 0, 2);
+    reply = buf;
+    nreply = 2;
+    break;
+
+  case 0x0009: // SET_CONFIGURATION
+  case 0x010B: // SET_INTERFACE
+  case 0x0001: // CLEAR_FEATURE
+  case 0x0201: // CLEAR_FEATURE on an endpoint
+  case 0x210A: // SET_IDLE
+  case 0x210B: // SET_PROTOCOL
+    break;
+
+  case 0x2109: // SET_REPORT. Some hosts send output reports this way.
+    if (data && len == ctx->layout.rpt_size)
+      softu2f_hid_frames_read(ctx, (U2FHID_FRAME *)data, 1);
+    break;
+
+  default:
+    goto stall;
+  }
+
+  if (nreply > wLength)
+    nreply = wLength;
+
+  softu2f_usbip_ret_submit(usbip, seqnum, 0, data ? len : nreply, reply);
+  return;
+
+stall:
+  softu2f_log(ctx, "Unsupported USB/IP control request: 0x%02x%02x\n", setup[0], setup[1]);
+  softu2f_usbip_ret_submit(usbip, seqnum, SOFTU2F_USBIP_EPIPE, 0, NULL);
+}
+
+// Handle an IN URB on the interrupt endpoint, completing it with a waiting
+// frame or queueing it until there is one.
+void softu2f_usbip_in(softu2f_ctx *ctx, uint32_t seqnum) {
+  softu2f_usbip *usbip = ctx->usbip;
+  U2FHID_FRAME *frame;
+
+  if (usbip->frame_count > 0) {
+    frame = SOFTU2F_FRAME_AT(usbip->frames, usbip->frame_head, HID_RPT_SIZE);
+    usbip->frame_head = (usbip->frame_head + 1) % SOFTU2F_USBIP_MAX_FRAMES;
+    usbip->frame_count--;
+
+    softu2f_usbip_ret_submit(usbip, seqnum, 0, HID_RPT_SIZE, (uint8_t *)frame);
+
+    // Have the next queued frame ready for the next URB.
+    softu2f_hid_out_pump(ctx);
+    return;
+  }
+
+  if (usbip->in_urb_count == SOFTU2F_USBIP_MAX_IN_URBS) {
+    softu2f_log(ctx, "Too many USB/IP IN URBs queued.\n");
+    softu2f_usbip_ret_submit(usbip, seqnum, SOFTU2F_USBIP_EPIPE, 0, NULL);
+    return;
+  }
+
+  usbip->in_urbs[(usbip->in_urb_head + usbip->in_urb_count) % SOFTU2F_USBIP_MAX_IN_URBS] = seqnum;
+  usbip->in_urb_count++;
+
+  softu2f_hid_out_pump(ctx);
+}
+
+// Handle an OUT URB on the interrupt endpoint.
+void softu2f_usbip_out(softu2f_ctx *ctx, uint32_t seqnum, uint8_t *data, uint32_t len) {
+  softu2f_usbip *usbip = ctx->usbip;
+
+  // Complete the URB first, so it goes out ahead of any response frames.
+  softu2f_usbip_ret_submit(usbip, seqnum, 0, len, NULL);
+
+  if (len % ctx->layout.rpt_size) {
+    softu2f_log(ctx, "Unexpected USB/IP transfer length: %u\n", len);
+    return;
+  }
+
+  softu2f_hid_frames_read(ctx, (U2FHID_FRAME *)data, len / ctx->layout.rpt_size);
+}
+
+// Unlink a queued IN URB.
+void softu2f_usbip_unlink(softu2f_ctx *ctx, uint32_t seqnum, uint32_t unlink_seqnum) {
+  softu2f_usbip *usbip = ctx->usbip;
+  uint8_t rep[SOFTU2F_USBIP_HDR_SIZE];
+  int32_t status = 0;
+  unsigned int i, at;
+
+  for (i = 0; i < usbip->in_urb_count; i++) {
+    at = (usbip->in_urb_head + i) % SOFTU2F_USBIP_MAX_IN_URBS;
+    if (usbip->in_urbs[at] != unlink_seqnum)
+      continue;
+
+    // Close the gap, keeping the rest in order.
+    for (; i + 1 < usbip->in_urb_count; i++) {
+      usbip->in_urbs[(usbip->in_urb_head + i) % SOFTU2F_USBIP_MAX_IN_URBS] =
+          usbip->in_urbs[(usbip->in_urb_head + i + 1) % SOFTU2F_USBIP_MAX_IN_URBS];
+    }
+    usbip->in_urb_count--;
+    status = SOFTU2F_USBIP_ECONNRESET;
+    break;
+  }
+
+  memset(rep, 0, SOFTU2F_USBIP_HDR_SIZE);
+  softu2f_be32_put(rep, SOFTU2F_USBIP_RET_UNLINK);
+  softu2f_be32_put(rep + 4, seqnum);
+  softu2f_be32_put(rep + 20, (uint32_t)status);
+
+  CFDataAppendBytes(usbip->out, rep, SOFTU2F_USBIP_HDR_SIZE);
+}
+
+// Queue a URB completion. data may be NULL for OUT transfers.
+void softu2f_usbip_ret_submit(softu2f_usbip *usbip, uint32_t seqnum, int32_t status, uint32_t len, const uint8_t *data) {
+  uint8_t rep[SOFTU2F_USBIP_HDR_SIZE];
+
+  memset(rep, 0, SOFTU2F_USBIP_HDR_SIZE);
+  softu2f_be32_put(rep, SOFTU2F_USBIP_RET_SUBMIT);
+  softu2f_be32_put(rep + 4, seqnum);
+  softu2f_be32_put(rep + 20, (uint32_t)status);
+  softu2f_be32_put(rep + 24, len);
+
+  CFDataAppendBytes(usbip->out, rep, SOFTU2F_USBIP_HDR_SIZE);
+  if (data && len)
+    CFDataAppendBytes(usbip->out, data, len);
+}
+
+// Write queued completions to the host.
+void softu2f_usbip_flush(softu2f_ctx *ctx) {
+  softu2f_usbip *usbip = ctx->usbip;
+  CFIndex len = CFDataGetLength(usbip->out);
+
+  if (len == 0 || usbip->fd < 0)
+    return;
+
+  if (!softu2f_usbip_write(usbip->fd, CFDataGetBytePtr(usbip->out), len)) {
+    softu2f_log(ctx, "Error writing to USB/IP host: %s\n", strerror(errno));
+    shutdown(usbip->fd, SHUT_RDWR);
+  }
+
+  CFDataSetLength(usbip->out, 0);
+}
+
+// Send a frame to the host on the next IN URB.
+bool softu2f_usbip_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  softu2f_usbip *usbip = ctx->usbip;
+  uint32_t seqnum;
+
+  if (!usbip->attached) {
+    softu2f_log(ctx, "No USB/IP host attached.\n");
+    return false;
+  }
+
+  if (usbip->in_urb_count > 0) {
+    seqnum = usbip->in_urbs[usbip->in_urb_head];
+    usbip->in_urb_head = (usbip->in_urb_head + 1) % SOFTU2F_USBIP_MAX_IN_URBS;
+    usbip->in_urb_count--;
+
+    softu2f_usbip_ret_submit(usbip, seqnum, 0, HID_RPT_SIZE, (uint8_t *)frame);
+  } else if (usbip->frame_count < SOFTU2F_USBIP_MAX_FRAMES) {
+    memcpy(SOFTU2F_FRAME_AT(usbip->frames, (usbip->frame_head + usbip->frame_count) % SOFTU2F_USBIP_MAX_FRAMES, HID_RPT_SIZE), frame, HID_RPT_SIZE);
+    usbip->frame_count++;
+  } else {
+    softu2f_log(ctx, "Too many frames waiting for USB/IP host.\n");
+    return false;
+  }
+
+  // Completions for URBs from the host are written together once they've
+  // all been handled.
+  if (!usbip->batching)
+    softu2f_usbip_flush(ctx);
+
+  return true;
+}
+
+// Whether the host is waiting for a frame, or would get one right away. Frames
+// are always taken while no host is attached, so they fail and are dropped.
+bool softu2f_usbip_send_ready(softu2f_ctx *ctx) {
+  softu2f_usbip *usbip = ctx->usbip;
+
+  return !usbip->attached || usbip->in_urb_count > 0 || usbip->frame_count == 0;
+}
+
+// Build a string descriptor. Returns its length.
+uint32_t softu2f_usbip_string(uint8_t index, uint8_t *buf) {
+  const char *str;
+  uint32_t len = 2;
+
+  switch (index) {
+  case 0:
+    // English (US) is the only language.
+    buf[0] = 4;
+    buf[1] = 0x03;
+    buf[2] = 0x09;
+    buf[3] = 0x04;
+    return 4;
+  case SOFTU2F_USBIP_STRING_PRODUCT:
+    str = kSoftU2FProductString;
+    break;
+  case SOFTU2F_USBIP_STRING_SERIAL:
+    str = kSoftU2FSerialNumberString;
+    break;
+  default:
+    return 0;
+  }
+
+  // UTF-16LE.
+  for (; *str && len + 2 <= SOFTU2F_USBIP_STRING_SIZE; str++) {
+    buf[len++] = *str;
+    buf[len++] = 0;
+  }
+
+  buf[0] = len;
+  buf[1] = 0x03;
+
+  return len;
+}
+
+// Read exactly len bytes from a socket.
+bool softu2f_usbip_read(int fd, uint8_t *buf, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = read(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+
+    buf += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+// Write exactly len bytes to a socket.
+bool softu2f_usbip_write(int fd, const uint8_t *buf, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+
+    buf += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+// Read a big-endian 32 bit value.
+uint32_t softu2f_be32_get(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Write a big-endian 32 bit value.
+void softu2f_be32_put(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+// Write a big-endian 16 bit value.
+void softu2f_be16_put(uint8_t *p, uint16_t value) {
+  p[0] = value >> 8;
+  p[1] = value;
+}
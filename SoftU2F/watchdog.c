@@ -0,0 +1,77 @@
+//
+//  watchdog.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+
+// Set how long a request can take before it is abandoned.
+void softu2f_deadline_set(softu2f_ctx *ctx, double seconds) {
+  pthread_mutex_lock(&ctx->engine->mutex);
+  ctx->deadline = seconds;
+  pthread_mutex_unlock(&ctx->engine->mutex);
+}
+
+// Register a function called when a request overruns its deadline.
+void softu2f_stall_handler_register(softu2f_ctx *ctx, softu2f_stall_handler handler) {
+  pthread_mutex_lock(&ctx->engine->mutex);
+  ctx->stall_handler = handler;
+  pthread_mutex_unlock(&ctx->engine->mutex);
+}
+
+// Count the time a handler took, and record a stall if it overran.
+void softu2f_hid_handler_done(softu2f_ctx *ctx, softu2f_hid_message *msg, double start) {
+  double elapsed = softu2f_time_now(ctx) - start;
+  uint64_t usec = (uint64_t)(elapsed * 1000000);
+
+  ctx->stats.handler_usec += usec;
+  if (usec > ctx->stats.handler_usec_max)
+    ctx->stats.handler_usec_max = usec;
+
+  // The response has already gone out, so there's nothing left to abandon.
+  if (ctx->deadline > 0 && elapsed > ctx->deadline)
+    softu2f_stall_record(ctx, msg->cid, msg->cmd, elapsed, false);
+}
+
+// Abandon deferred requests that overran their deadlines. The client gets
+// ERR_MSG_TIMEOUT and the handler's cancel callback is called.
+void softu2f_hid_pending_watchdog(softu2f_ctx *ctx) {
+  softu2f_hid_pending *pending;
+  double now;
+  uint32_t cid;
+  uint8_t cmd;
+
+  if (!ctx->pending_list)
+    return;
+
+  now = softu2f_time_now(ctx);
+
+restart:
+  for (pending = ctx->pending_list; pending; pending = pending->next) {
+    if (pending->deadline == 0 || now < pending->deadline)
+      continue;
+
+    // The cancel callback may free the request and change the list.
+    cid = pending->cid;
+    cmd = pending->cmd;
+
+    softu2f_stall_record(ctx, cid, cmd, now - pending->started, true);
+    softu2f_hid_pending_cancel(ctx, pending);
+    softu2f_hid_err_send(ctx, cid, ERR_MSG_TIMEOUT);
+    goto restart;
+  }
+}
+
+// Log and count a stall and tell the stall handler about it.
+void softu2f_stall_record(softu2f_ctx *ctx, uint32_t cid, uint8_t cmd, double elapsed, bool deferred) {
+  softu2f_stall stall = {cid, cmd, elapsed, deferred};
+
+  softu2f_log(ctx, "Request 0x%02x on CID 0x%08x stalled for %.3fs\n", cmd, cid, elapsed);
+  ctx->stats.stalls++;
+
+  if (ctx->stall_handler)
+    ctx->stall_handler(ctx, &stall);
+}
@@ -0,0 +1,477 @@
+//
+//  workers.c
+//  SoftU2F
+//
+//  Copyright © 2017 GitHub. All rights reserved.
+//
+
+#include "softu2f.h"
+#include "internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Hand U2FHID_MSG requests to worker processes over shared memory.
+bool softu2f_workers_start(softu2f_ctx *ctx, const char *name, unsigned int nworkers) {
+  softu2f_workers *workers;
+  int err;
+
+  if (ctx->workers) {
+    softu2f_log(ctx, "Workers already started.\n");
+    return false;
+  }
+
+  if (nworkers == 0) {
+    softu2f_log(ctx, "Can't start without any workers.\n");
+    return false;
+  }
+
+  workers = softu2f_workers_map(name, ctx->layout.rpt_size, nworkers);
+  if (!workers) {
+    softu2f_log(ctx, "Error creating shared memory for workers: %s\n", strerror(errno));
+    return false;
+  }
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+  ctx->workers = workers;
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  err = pthread_create(&workers->thread, NULL, softu2f_workers_thread, ctx);
+  if (err) {
+    softu2f_log(ctx, "Error creating worker thread: %d\n", err);
+
+    pthread_mutex_lock(&ctx->engine->mutex);
+    ctx->workers = NULL;
+    pthread_mutex_unlock(&ctx->engine->mutex);
+
+    softu2f_workers_unmap(workers);
+    return false;
+  }
+
+  return true;
+}
+
+// Stop handing requests to workers.
+void softu2f_workers_stop(softu2f_ctx *ctx) {
+  softu2f_workers *workers = ctx->workers;
+
+  if (!workers)
+    return;
+
+  __atomic_store_n(&workers->stop, true, __ATOMIC_RELEASE);
+  pthread_join(workers->thread, NULL);
+
+  pthread_mutex_lock(&ctx->engine->mutex);
+  ctx->workers = NULL;
+  pthread_mutex_unlock(&ctx->engine->mutex);
+
+  // Let attached workers know to return.
+  __atomic_store_n(&workers->shm->closed, 1, __ATOMIC_RELEASE);
+
+  softu2f_workers_unmap(workers);
+}
+
+// Serve U2FHID_MSG requests as a worker process.
+bool softu2f_worker_run(const char *name, unsigned int index, softu2f_hid_message_handler handler, void *user_data, softu2f_init_flags flags) {
+  softu2f_workers *workers = NULL;
+  softu2f_engine *engine = NULL;
+  softu2f_ctx *ctx = NULL;
+  softu2f_worker_slot *slot;
+  softu2f_worker_req *req;
+  softu2f_hid_message msg;
+  uint32_t state = SOFTU2F_WORKER_FREE;
+  uint32_t tail;
+  uint16_t bcnt;
+  unsigned int polls = 0;
+  bool ok = false;
+
+  workers = softu2f_workers_map(name, 0, 0);
+  if (!workers) {
+    if (flags & SOFTU2F_DEBUG)
+      fprintf(stderr, "Error mapping shared memory for workers: %s\n", strerror(errno));
+    return false;
+  }
+
+  if (index >= workers->shm->nworkers) {
+    if (flags & SOFTU2F_DEBUG)
+      fprintf(stderr, "No worker slot %u.\n", index);
+    goto done;
+  }
+
+  // Workers have an engine of their own for the message pool and lock.
+  engine = softu2f_engine_create(flags);
+  if (!engine)
+    goto done;
+
+  ctx = softu2f_ctx_create(flags, workers->shm->rpt_size);
+  if (!ctx) {
+    softu2f_engine_free(engine);
+    goto done;
+  }
+
+  // The engine is freed along with ctx.
+  ctx->engine = engine;
+  engine->devices = ctx;
+
+  ctx->send_frame = softu2f_worker_frame_send;
+  ctx->worker = workers;
+  softu2f_hid_msg_handler_register(ctx, U2FHID_MSG, handler);
+  softu2f_set_user_data(ctx, user_data);
+
+  // Claim our slot.
+  slot = softu2f_workers_slot(workers->shm, index);
+  if (!__atomic_compare_exchange_n(&slot->state, &state, SOFTU2F_WORKER_ATTACHING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    softu2f_log(ctx, "Worker %u is already attached.\n", index);
+    goto done;
+  }
+
+  slot->pid = getpid();
+  __atomic_store_n(&slot->state, SOFTU2F_WORKER_ATTACHED, __ATOMIC_RELEASE);
+  workers->slot = slot;
+
+  softu2f_log(ctx, "Worker %u serving requests.\n", index);
+
+  while (1) {
+    tail = slot->req_tail;
+
+    if (tail == __atomic_load_n(&slot->req_head, __ATOMIC_ACQUIRE)) {
+      if (++polls % SOFTU2F_WORKER_CHECK_POLLS == 0 && softu2f_worker_front_gone(workers))
+        break;
+
+      nanosleep(&softu2f_poll_interval, NULL);
+      continue;
+    }
+
+    // Hand the handler the request where it sits in the ring. The slot isn't
+    // reused until we move past it.
+    req = softu2f_workers_req(workers->shm, slot, tail);
+
+    // The length comes from another process. Read it once and make sure the
+    // data fits in the slot.
+    bcnt = __atomic_load_n(&req->bcnt, __ATOMIC_RELAXED);
+
+    memset(&msg, 0, sizeof(softu2f_hid_message));
+    msg.cmd = req->cmd;
+    msg.cid = req->cid;
+    msg.bcnt = bcnt;
+
+    pthread_mutex_lock(&engine->mutex);
+
+    if (bcnt > ctx->layout.max_msg) {
+      softu2f_log(ctx, "BCNT too large (%u). Bailing.\n", bcnt);
+      softu2f_hid_err_send(ctx, msg.cid, ERR_INVALID_LEN);
+      goto next;
+    }
+
+    msg.data = CFDataCreateWithBytesNoCopy(NULL, (uint8_t *)(req + 1), bcnt, kCFAllocatorNull);
+    if (msg.data) {
+      softu2f_hid_msg_dispatch(ctx, &msg);
+      softu2f_scratch_reset(ctx, &msg);
+      CFRelease(msg.data);
+    } else {
+      softu2f_log(ctx, "No memory for new message.\n");
+      softu2f_hid_err_send(ctx, msg.cid, ERR_OTHER);
+    }
+
+next:
+    pthread_mutex_unlock(&engine->mutex);
+
+    __atomic_store_n(&slot->req_tail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  softu2f_log(ctx, "Front process stopped. Worker %u returning.\n", index);
+  ok = true;
+
+done:
+  if (ctx)
+    softu2f_deinit(ctx);
+  softu2f_workers_unmap(workers);
+  return ok;
+}
+
+// Map shared memory for workers.
+softu2f_workers *softu2f_workers_map(const char *name, uint16_t rpt_size, unsigned int nworkers) {
+  softu2f_workers *workers = NULL;
+  softu2f_workers_shm *shm;
+  softu2f_frame_layout layout;
+  struct stat st;
+  size_t slot_size;
+  int fd = -1;
+  int err;
+
+  workers = (softu2f_workers *)calloc(1, sizeof(softu2f_workers));
+  if (!workers)
+    return NULL;
+
+  workers->front = nworkers > 0;
+
+  workers->name = strdup(name);
+  if (!workers->name)
+    goto fail;
+
+  if (workers->front) {
+    softu2f_frame_layout_init(&layout, rpt_size);
+    slot_size = SOFTU2F_WORKER_SLOT_SIZE(layout.max_msg, rpt_size);
+    workers->size = SOFTU2F_WORKERS_HEADER_SIZE + nworkers * slot_size;
+
+    // Anything left behind by an earlier front process is stale.
+    shm_unlink(name);
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+      goto fail;
+
+    if (ftruncate(fd, workers->size))
+      goto fail;
+  } else {
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+      goto fail;
+
+    if (fstat(fd, &st))
+      goto fail;
+
+    workers->size = st.st_size;
+    if (workers->size < SOFTU2F_WORKERS_HEADER_SIZE) {
+      errno = EINVAL;
+      goto fail;
+    }
+  }
+
+  shm = (softu2f_workers_shm *)mmap(NULL, workers->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shm == MAP_FAILED)
+    goto fail;
+
+  workers->shm = shm;
+  close(fd);
+  fd = -1;
+
+  if (workers->front) {
+    shm->rpt_size = rpt_size;
+    shm->max_msg = layout.max_msg;
+    shm->nworkers = nworkers;
+    shm->front_pid = getpid();
+    shm->slot_size = (uint32_t)slot_size;
+    __atomic_store_n(&shm->magic, SOFTU2F_WORKERS_MAGIC, __ATOMIC_RELEASE);
+  } else {
+    // The front process sizes everything from its report size.
+    softu2f_frame_layout_init(&layout, shm->rpt_size);
+
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SOFTU2F_WORKERS_MAGIC ||
+        !kSoftU2FReportSizeSupported(shm->rpt_size) ||
+        shm->max_msg != layout.max_msg ||
+        shm->slot_size != SOFTU2F_WORKER_SLOT_SIZE(shm->max_msg, shm->rpt_size) ||
+        workers->size < SOFTU2F_WORKERS_HEADER_SIZE + (size_t)shm->nworkers * shm->slot_size) {
+      errno = EINVAL;
+      goto fail;
+    }
+  }
+
+  return workers;
+
+fail:
+  err = errno;
+  if (fd >= 0)
+    close(fd);
+  softu2f_workers_unmap(workers);
+  errno = err;
+  return NULL;
+}
+
+// Unmap worker shared memory.
+void softu2f_workers_unmap(softu2f_workers *workers) {
+  if (workers->shm)
+    munmap(workers->shm, workers->size);
+
+  if (workers->front && workers->name)
+    shm_unlink(workers->name);
+
+  if (workers->name)
+    free(workers->name);
+
+  free(workers);
+}
+
+// Find a worker's slot in shared memory.
+softu2f_worker_slot *softu2f_workers_slot(softu2f_workers_shm *shm, unsigned int index) {
+  return (softu2f_worker_slot *)((uint8_t *)shm + SOFTU2F_WORKERS_HEADER_SIZE + (size_t)index * shm->slot_size);
+}
+
+// Find a request in a worker's request ring.
+softu2f_worker_req *softu2f_workers_req(softu2f_workers_shm *shm, softu2f_worker_slot *slot, uint32_t index) {
+  uint8_t *ring = (uint8_t *)slot + SOFTU2F_WORKER_SLOT_HEADER_SIZE;
+
+  return (softu2f_worker_req *)(ring + (index % SOFTU2F_WORKER_REQ_SLOTS) * SOFTU2F_WORKER_REQ_SIZE(shm->max_msg));
+}
+
+// Find a frame in a worker's response ring.
+U2FHID_FRAME *softu2f_workers_frame(softu2f_workers_shm *shm, softu2f_worker_slot *slot, uint32_t index) {
+  uint8_t *ring = (uint8_t *)slot + SOFTU2F_WORKER_SLOT_HEADER_SIZE + SOFTU2F_WORKER_REQ_SLOTS * SOFTU2F_WORKER_REQ_SIZE(shm->max_msg);
+
+  return SOFTU2F_FRAME_AT(ring, index % SOFTU2F_WORKER_RESP_SLOTS, shm->rpt_size);
+}
+
+// Queue a U2F message for the worker with the message's CID.
+bool softu2f_workers_dispatch(softu2f_ctx *ctx, softu2f_hid_message *msg) {
+  softu2f_workers_shm *shm = ctx->workers->shm;
+  softu2f_worker_slot *slot = NULL;
+  softu2f_worker_req *req;
+  unsigned int i;
+  uint32_t head;
+
+  // Keep each channel on one worker, skipping slots nobody is attached to.
+  for (i = 0; i < shm->nworkers; i++) {
+    slot = softu2f_workers_slot(shm, (msg->cid + i) % shm->nworkers);
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == SOFTU2F_WORKER_ATTACHED)
+      break;
+    slot = NULL;
+  }
+
+  if (!slot) {
+    softu2f_log(ctx, "No workers attached.\n");
+    softu2f_hid_err_send(ctx, msg->cid, ERR_OTHER);
+    return false;
+  }
+
+  head = slot->req_head;
+  if (head - __atomic_load_n(&slot->req_tail, __ATOMIC_ACQUIRE) >= SOFTU2F_WORKER_REQ_SLOTS) {
+    softu2f_log(ctx, "Worker process %d is busy.\n", slot->pid);
+    softu2f_hid_err_send(ctx, msg->cid, ERR_CHANNEL_BUSY);
+    return false;
+  }
+
+  req = softu2f_workers_req(shm, slot, head);
+  req->cid = msg->cid;
+  req->cmd = msg->cmd;
+  req->bcnt = CFDataGetLength(msg->data);
+  memcpy((uint8_t *)(req + 1), CFDataGetBytePtr(msg->data), req->bcnt);
+
+  __atomic_store_n(&slot->req_head, head + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+// Forward frames workers have responded with.
+void *softu2f_workers_thread(void *arg) {
+  softu2f_ctx *ctx = (softu2f_ctx *)arg;
+  softu2f_workers *workers = ctx->workers;
+  softu2f_worker_slot *slot;
+  unsigned int i, polls = 0;
+  bool check, busy;
+
+  while (!__atomic_load_n(&workers->stop, __ATOMIC_ACQUIRE)) {
+    busy = false;
+    check = ++polls % SOFTU2F_WORKER_CHECK_POLLS == 0;
+
+    for (i = 0; i < workers->shm->nworkers; i++) {
+      slot = softu2f_workers_slot(workers->shm, i);
+      if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SOFTU2F_WORKER_ATTACHED)
+        continue;
+
+      if (__atomic_load_n(&slot->resp_head, __ATOMIC_RELAXED) != slot->resp_tail) {
+        pthread_mutex_lock(&ctx->engine->mutex);
+        busy |= softu2f_workers_collect(ctx, slot);
+        pthread_mutex_unlock(&ctx->engine->mutex);
+      }
+
+      // Workers that have exited (and been waited for) are gone.
+      if (check && kill(slot->pid, 0) && errno == ESRCH) {
+        pthread_mutex_lock(&ctx->engine->mutex);
+        softu2f_workers_reap(ctx, slot);
+        pthread_mutex_unlock(&ctx->engine->mutex);
+      }
+    }
+
+    if (!busy)
+      nanosleep(&softu2f_poll_interval, NULL);
+  }
+
+  return NULL;
+}
+
+// Queue frames a worker has responded with to go out with the device's other
+// responses.
+bool softu2f_workers_collect(softu2f_ctx *ctx, softu2f_worker_slot *slot) {
+  softu2f_workers_shm *shm = ctx->workers->shm;
+  uint32_t tail = slot->resp_tail;
+  uint32_t head = __atomic_load_n(&slot->resp_head, __ATOMIC_ACQUIRE);
+  U2FHID_FRAME *frame;
+
+  if (tail == head)
+    return false;
+
+  // A worker writes each response's frames in a row, so each INIT frame opens
+  // an outbound stream and the CONT frames after it are added as they come.
+  for (; tail != head; tail++) {
+    frame = softu2f_workers_frame(shm, slot, tail);
+
+    if (FRAME_TYPE(*frame) == TYPE_INIT) {
+      softu2f_hid_out_close(ctx, frame->cid);
+      if (!softu2f_hid_out_open(ctx, frame))
+        softu2f_log(ctx, "Dropping response from worker process %d.\n", slot->pid);
+    } else if (!softu2f_hid_out_extend(ctx, frame)) {
+      softu2f_log(ctx, "Dropping frame from worker process %d.\n", slot->pid);
+    }
+  }
+
+  __atomic_store_n(&slot->resp_tail, tail, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+// Fail requests queued for a dead worker and free its slot.
+void softu2f_workers_reap(softu2f_ctx *ctx, softu2f_worker_slot *slot) {
+  softu2f_workers_shm *shm = ctx->workers->shm;
+  uint32_t index;
+
+  softu2f_log(ctx, "Worker process %d exited.\n", slot->pid);
+
+  // Send whatever it finished before failing the rest.
+  softu2f_workers_collect(ctx, slot);
+
+  // A response it was part way through goes out as far as it got.
+  for (index = slot->req_tail; index != slot->req_head; index++) {
+    softu2f_hid_out_close(ctx, softu2f_workers_req(shm, slot, index)->cid);
+    softu2f_hid_err_send(ctx, softu2f_workers_req(shm, slot, index)->cid, ERR_OTHER);
+  }
+
+  slot->req_head = 0;
+  slot->req_tail = 0;
+  slot->resp_head = 0;
+  slot->resp_tail = 0;
+  slot->pid = 0;
+  __atomic_store_n(&slot->state, SOFTU2F_WORKER_FREE, __ATOMIC_RELEASE);
+}
+
+// Queue a frame for the front process to send.
+bool softu2f_worker_frame_send(softu2f_ctx *ctx, U2FHID_FRAME *frame) {
+  softu2f_workers *workers = ctx->worker;
+  softu2f_worker_slot *slot = workers->slot;
+  uint32_t head = slot->resp_head;
+
+  // Wait for the front process to make room.
+  while (head - __atomic_load_n(&slot->resp_tail, __ATOMIC_ACQUIRE) >= SOFTU2F_WORKER_RESP_SLOTS) {
+    if (softu2f_worker_front_gone(workers)) {
+      softu2f_log(ctx, "Front process gone. Dropping frame.\n");
+      return false;
+    }
+
+    nanosleep(&softu2f_poll_interval, NULL);
+  }
+
+  memcpy(softu2f_workers_frame(workers->shm, slot, head), frame, ctx->layout.rpt_size);
+  __atomic_store_n(&slot->resp_head, head + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+// Check if the front process a worker serves has gone away.
+bool softu2f_worker_front_gone(softu2f_workers *workers) {
+  if (__atomic_load_n(&workers->shm->closed, __ATOMIC_ACQUIRE))
+    return true;
+
+  return kill(workers->shm->front_pid, 0) && errno == ESRCH;
+}